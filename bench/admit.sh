@@ -0,0 +1,32 @@
+#!/bin/sh
+# Wall time of a script starting many CPU and memory hungry background jobs
+# at once, unlimited and with admission by job count, CPU pressure and load.
+#
+# usage: bench/admit.sh [path/to/qsh] [jobs] [MiB per job]
+QSH=${1:-build/bin/qsh}
+JOBS=${2:-256}
+MIB=${3:-64}
+CPUS=$(nproc)
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+run() {
+    cat > "$SCRIPT" <<SCRIPT
+$1
+i=0
+while [ \$i -lt $JOBS ]; do
+    head -c ${MIB}M /dev/urandom | sort >/dev/null &
+    i=\$((i + 1))
+done
+wait
+SCRIPT
+    start=$(date +%s%N)
+    "$QSH" "$SCRIPT"
+    end=$(date +%s%N)
+    printf '%-24s %8d ms\n' "$2" $(((end - start) / 1000000))
+}
+
+run 'admit off' unlimited
+run "admit -j $CPUS" "admit -j $CPUS"
+run 'admit -p 20' 'admit -p 20'
+run 'admit -l 1' 'admit -l 1'
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Time per "-c" run of qsh against dash, as make and ninja run their
+# recipes, for a builtin, a single program, and a line whose last command
+# is a program.
+#
+# usage: bench/dash_c.sh [path/to/qsh] [runs] [path/to/dash]
+QSH=${1:-build/bin/qsh}
+RUNS=${2:-2000}
+DASH=${3:-dash}
+
+run() {
+    for sh in "$DASH" "$QSH"; do
+        start=$(date +%s%N)
+        i=0
+        while [ $i -lt "$RUNS" ]; do
+            "$sh" -c "$1"
+            i=$((i + 1))
+        done
+        end=$(date +%s%N)
+        printf '%-36s %-6s %6d us per run\n' "$1" "${sh##*/}" $(((end - start) / 1000 / RUNS))
+    done
+}
+
+run 'true'
+run '/bin/true'
+run 'echo x >/dev/null; /bin/true'
+run 'cd / && /bin/true'
+run '/bin/true | /bin/true'
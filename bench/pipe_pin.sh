@@ -0,0 +1,29 @@
+#!/bin/sh
+# Pipe throughput of a 4-stage pipeline run by qsh, with stages left to the
+# scheduler, placed on sibling CPUs by "pin auto", and with memory bound too.
+#
+# usage: bench/pipe_pin.sh [path/to/qsh] [MiB] [runs]
+QSH=${1:-build/bin/qsh}
+MIB=${2:-4096}
+RUNS=${3:-5}
+SCRIPT=$(mktemp)
+trap 'rm -f "$SCRIPT"' EXIT
+
+run() {
+    printf '%s\n' "$1" "dd if=/dev/zero bs=1M count=$MIB 2>/dev/null | cat | cat | wc -c >/dev/null" > "$SCRIPT"
+    best=0
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        "$QSH" "$SCRIPT"
+        end=$(date +%s%N)
+        rate=$((MIB * 1000000000 / (end - start)))
+        [ $rate -gt $best ] && best=$rate
+        i=$((i + 1))
+    done
+    printf '%-12s %8d MiB/s\n' "$2" $best
+}
+
+run 'pin off' unpinned
+run 'pin auto' 'pin auto'
+run 'pin -m auto' 'pin -m auto'
@@ -0,0 +1,263 @@
+/**
+ * Description: End-to-end latency of interactive use of qsh. The shell is
+ *              driven through a pseudo-terminal as a user would drive it, and
+ *              each round trip is timed from the keys written to the output
+ *              awaited. Results are reported as percentiles in microseconds.
+ *
+ * usage: qsh_ptylat [path/to/qsh] [rounds]
+ */
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// prompts of qsh begin with $LOGNAME
+#define MARK "@qshlat:"
+// longest wait for output in milliseconds
+#define TIMEOUT 5000
+
+typedef struct _series_t {
+    const char *name;
+    long *samples;
+    size_t n;
+} series_t;
+
+static pid_t shell;
+static int master = -1;
+// output of the shell not awaited yet
+static char out[65536];
+static size_t len;
+static unsigned syncs;
+
+/**
+ * now_us - Return microseconds of CLOCK_MONOTONIC.
+ */
+static long now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/**
+ * fail - Report what went wrong with the output so far, and give up.
+ */
+static void fail(const char *what)
+{
+    fprintf(stderr, "qsh_ptylat: %s\n--- output ---\n%.*s\n", what, (int) len, out);
+    kill(shell, SIGKILL);
+    exit(1);
+}
+
+/**
+ * put - Type keys to the shell.
+ */
+static void put(const char *keys)
+{
+    size_t n = strlen(keys);
+
+    if (write(master, keys, n) != (ssize_t) n) {
+        fail("write error");
+    }
+}
+
+/**
+ * await - Read output until text appears, and drop the output up to it.
+ *         Return the time when it was read.
+ */
+static long await(const char *text)
+{
+    size_t n = strlen(text);
+
+    while (true) {
+        char *hit = memmem(out, len, text, n);
+
+        if (hit != NULL) {
+            long t = now_us();
+
+            len -= hit + n - out;
+            memmove(out, hit + n, len);
+            return t;
+        }
+        struct pollfd pfd = {master, POLLIN, 0};
+        int ready = poll(&pfd, 1, TIMEOUT);
+
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        } else if (ready <= 0) {
+            fail(ready == 0 ? "timed out" : "poll error");
+        }
+        if (len == sizeof(out)) {
+            // keep the tail, where text may begin
+            memmove(out, out + len / 2, len - len / 2);
+            len -= len / 2;
+        }
+        ssize_t got = read(master, out + len, sizeof(out) - len);
+
+        if (got <= 0) {
+            fail("the shell is gone");
+        }
+        len += got;
+    }
+}
+
+/**
+ * await_prompt - Read output until a prompt appears. Return the time.
+ */
+static long await_prompt(void)
+{
+    await(MARK);
+    return await("> ");
+}
+
+/**
+ * settle - Wait for the shell to print a fresh prompt after anything it was
+ *          doing, and drop the output so far. The quotes keep the echo of
+ *          the command from matching its output.
+ */
+static void settle(void)
+{
+    char cmd[64];
+    char want[64];
+
+    snprintf(cmd, sizeof(cmd), "echo SY''NC%u\n", ++syncs);
+    snprintf(want, sizeof(want), "SYNC%u\r\n", syncs);
+    put(cmd);
+    await(want);
+    await_prompt();
+    len = 0;
+}
+
+/**
+ * add - Record a sample of series.
+ */
+static void add(series_t *series, long us)
+{
+    series->samples[series->n++] = us;
+}
+
+/**
+ * compare_long - Order samples ascending.
+ */
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * report - Print percentiles of series.
+ */
+static void report(series_t *series)
+{
+    static const double ranks[] = {0.5, 0.9, 0.99};
+    size_t n = series->n;
+
+    qsort(series->samples, n, sizeof(long), compare_long);
+    printf("%-22s %6zu", series->name, n);
+    for (size_t i = 0; i < sizeof(ranks) / sizeof(ranks[0]); ++i) {
+        // nearest rank
+        size_t k = (size_t) (ranks[i] * n + 0.999999);
+
+        printf(" %9ld", series->samples[k > 0 ? k - 1 : 0]);
+    }
+    printf(" %9ld\n", series->samples[n-1]);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *qsh = argc > 1 ? argv[1] : "build/bin/qsh";
+    size_t rounds = argc > 2 ? strtoul(argv[2], NULL, 10) : 100;
+    series_t series[] = {
+        {"keystroke to prompt", NULL, 0},
+        {"true", NULL, 0},
+        {"sleep 0", NULL, 0},
+        {"ctrl-z to prompt", NULL, 0},
+        {"fg to running", NULL, 0},
+        {"bg to prompt", NULL, 0},
+        {"job notification", NULL, 0},
+    };
+    const size_t nseries = sizeof(series) / sizeof(series[0]);
+
+    if (rounds == 0) {
+        fputs("usage: qsh_ptylat [path/to/qsh] [rounds]\n", stderr);
+        return 2;
+    }
+    for (size_t i = 0; i < nseries; ++i) {
+        if ((series[i].samples = malloc(rounds * sizeof(long))) == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+    if ((shell = forkpty(&master, NULL, NULL, NULL)) < 0) {
+        perror("forkpty");
+        return 1;
+    } else if (shell == 0) {
+        setenv("LOGNAME", MARK, 1);
+        execl(qsh, qsh, (char *) NULL);
+        perror(qsh);
+        _exit(127);
+    }
+    await_prompt();
+    for (size_t i = 0; i < rounds; ++i) {
+        long start = 0;
+
+        settle();
+        start = now_us();
+        put("\n");
+        add(&series[0], await_prompt() - start);
+
+        settle();
+        start = now_us();
+        put("true\n");
+        add(&series[1], await_prompt() - start);
+
+        settle();
+        start = now_us();
+        put("sleep 0\n");
+        add(&series[2], await_prompt() - start);
+
+        // cat echoes a line once it's in the foreground
+        settle();
+        put("cat\nx\n");
+        await("x\r\nx\r\n");
+        start = now_us();
+        put("\x1a");
+        add(&series[3], await_prompt() - start);
+        // the line is echoed by the terminal first, and "Continued" may come between
+        start = now_us();
+        put("fg\ny\n");
+        await("y\r\n");
+        add(&series[4], await("y\r\n") - start);
+        put("\x1a");
+        await_prompt();
+        start = now_us();
+        put("bg\n");
+        add(&series[5], await_prompt() - start);
+        put("kill -9 %1\n");
+        await("Killed");
+
+        settle();
+        start = now_us();
+        put("true &\n");
+        add(&series[6], await("Done") - start);
+    }
+    settle();
+    put("exit\n");
+    waitpid(shell, NULL, 0);
+    printf("%-22s %6s %9s %9s %9s %9s\n", "microseconds", "n", "p50", "p90", "p99", "max");
+    for (size_t i = 0; i < nseries; ++i) {
+        report(&series[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Startup time of qsh running an empty script, with no rc file, with an rc
+# file run on every start, and with the snapshot of the rc file mapped.
+#
+# usage: bench/startup.sh [path/to/qsh] [starts] [definitions in the rc file]
+QSH=${1:-build/bin/qsh}
+STARTS=${2:-1000}
+DEFS=${3:-500}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+i=0
+while [ $i -lt "$DEFS" ]; do
+    echo "VAR_$i=\"\${HOME}/lib/$i:\$(printf '%s' value_$i)\""
+    echo "export EXPORTED_$i=$i"
+    i=$((i + 1))
+done > "$DIR/rc"
+: > "$DIR/empty"
+
+run() {
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt "$STARTS" ]; do
+        QSHRC=$1 XDG_CACHE_HOME=$2 "$QSH" "$DIR/empty"
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    printf '%-24s %8d us per start\n' "$3" $(((end - start) / 1000 / STARTS))
+}
+
+run '' "$DIR/cache" 'no rc file'
+# a cache under a regular file can't be made, so the rc file runs every time
+run "$DIR/rc" "$DIR/empty/cache" "rc file, $DEFS x 2 lines"
+QSHRC=$DIR/rc XDG_CACHE_HOME=$DIR/cache "$QSH" "$DIR/empty"
+run "$DIR/rc" "$DIR/cache" 'rc snapshot'
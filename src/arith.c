@@ -0,0 +1,272 @@
+/**
+ * Description: Evaluation of integer expressions in $((...)) with the
+ *              precedence of C. Names are read from shell variables.
+ */
+#include "arith.h"
+#include "error.h"
+#include "vars.h"
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct _arith_t {
+    const char *p;
+    bool error;
+    // what went wrong if it's not the syntax
+    const char *message;
+} arith_t;
+
+// binary operators from the lowest precedence to the highest
+static const char *levels[][5] = {
+    {"||"}, {"&&"}, {"|"}, {"^"}, {"&"}, {"==", "!="},
+    {"<=", ">=", "<", ">"}, {"<<", ">>"}, {"+", "-"}, {"*", "/", "%"},
+};
+#define LEVELS (sizeof(levels) / sizeof(levels[0]))
+
+static long arith_cond(arith_t *a, bool eval);
+static long apply(arith_t *a, const char *op, long lhs, long rhs, bool eval);
+
+/**
+ * skip_blank - Skip blanks in an expression.
+ */
+static void skip_blank(arith_t *a)
+{
+    while (isspace((unsigned char) *a->p)) {
+        ++a->p;
+    }
+}
+
+/**
+ * value_of - Get value of the variable called name, which is 0 if unset.
+ */
+static long value_of(const char *name, size_t len)
+{
+    const char *value = get_var(name, len);
+
+    return value == NULL ? 0 : strtol(value, NULL, 0);
+}
+
+/**
+ * arith_primary - Evaluate a number, a name, a parenthesized expression or
+ *                 an assignment.
+ */
+static long arith_primary(arith_t *a, bool eval)
+{
+    skip_blank(a);
+    if (*a->p == '(') {
+        ++a->p;
+        long value = arith_cond(a, eval);
+
+        skip_blank(a);
+        if (*a->p != ')') {
+            a->error = true;
+            return 0;
+        }
+        ++a->p;
+        return value;
+    }
+    if (isdigit((unsigned char) *a->p)) {
+        char *end = NULL;
+        long value = strtol(a->p, &end, 0);
+
+        a->p = end;
+        return value;
+    }
+    const char *name = a->p;
+
+    while (isalnum((unsigned char) *a->p) || *a->p == '_') {
+        ++a->p;
+    }
+    size_t len = a->p - name;
+
+    if (len == 0 || !is_name(name, len)) {
+        a->error = true;
+        return 0;
+    }
+    skip_blank(a);
+    // an assignment such as "=" or "+="
+    static const char *assigns = "+-*/%";
+    char op = *a->p;
+
+    if ((op == '=' && a->p[1] != '=') || (op != '\0' && strchr(assigns, op) != NULL && a->p[1] == '=')) {
+        a->p += op == '=' ? 1 : 2;
+        long rhs = arith_cond(a, eval);
+        const char ops[2] = {op, '\0'};
+        long value = op == '=' ? rhs : apply(a, ops, value_of(name, len), rhs, eval);
+
+        if (eval && !a->error) {
+            char buf[32];
+
+            snprintf(buf, sizeof(buf), "%ld", value);
+            set_var(name, len, buf, false);
+        }
+        return value;
+    }
+    return value_of(name, len);
+}
+
+/**
+ * arith_unary - Evaluate unary operators.
+ */
+static long arith_unary(arith_t *a, bool eval)
+{
+    skip_blank(a);
+    switch (*a->p) {
+    case '!':
+        ++a->p;
+        return !arith_unary(a, eval);
+    case '~':
+        ++a->p;
+        return ~arith_unary(a, eval);
+    case '-':
+        ++a->p;
+        return (long) -(unsigned long) arith_unary(a, eval);
+    case '+':
+        ++a->p;
+        return arith_unary(a, eval);
+    default:
+        return arith_primary(a, eval);
+    }
+}
+
+/**
+ * match_op - Match an operator of level at the current position.
+ */
+static const char *match_op(arith_t *a, size_t level)
+{
+    skip_blank(a);
+    for (size_t i = 0; i < 5 && levels[level][i] != NULL; ++i) {
+        size_t n = strlen(levels[level][i]);
+
+        if (strncmp(a->p, levels[level][i], n) == 0
+                // "|" is not "||", and "<" is not "<<"
+                && !(n == 1 && (a->p[1] == a->p[0] || a->p[1] == '='))) {
+            return levels[level][i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * fail - Note an error other than of the syntax, if the expression is
+ *        evaluated.
+ */
+static void fail(arith_t *a, const char *message, bool eval)
+{
+    if (eval && !a->error) {
+        a->error = true;
+        a->message = message;
+    }
+}
+
+/**
+ * shift - Shift lhs left or right by rhs bits, which must be fewer than
+ *         those of a long.
+ */
+static long shift(arith_t *a, long lhs, long rhs, bool left, bool eval)
+{
+    if (rhs < 0 || rhs >= (long) (sizeof(long) * CHAR_BIT)) {
+        fail(a, "shift count out of range", eval);
+        return 0;
+    }
+    return left ? (long) ((unsigned long) lhs << rhs) : lhs >> rhs;
+}
+
+/**
+ * apply - Apply binary operator op. What overflows wraps around, as in bash.
+ */
+static long apply(arith_t *a, const char *op, long lhs, long rhs, bool eval)
+{
+    switch (op[0]) {
+    case '|': return op[1] == '|' ? lhs || rhs : lhs | rhs;
+    case '&': return op[1] == '&' ? lhs && rhs : lhs & rhs;
+    case '^': return lhs ^ rhs;
+    case '=': return lhs == rhs;
+    case '!': return lhs != rhs;
+    case '<': return op[1] == '=' ? lhs <= rhs : op[1] == '<' ? shift(a, lhs, rhs, true, eval) : lhs < rhs;
+    case '>': return op[1] == '=' ? lhs >= rhs : op[1] == '>' ? shift(a, lhs, rhs, false, eval) : lhs > rhs;
+    case '+': return (long) ((unsigned long) lhs + (unsigned long) rhs);
+    case '-': return (long) ((unsigned long) lhs - (unsigned long) rhs);
+    case '*': return (long) ((unsigned long) lhs * (unsigned long) rhs);
+    default:
+        if (rhs == 0) {
+            fail(a, "division by zero", eval);
+            return 0;
+        }
+        // LONG_MIN / -1 traps
+        if (rhs == -1) {
+            return op[0] == '/' ? (long) -(unsigned long) lhs : 0;
+        }
+        return op[0] == '/' ? lhs / rhs : lhs % rhs;
+    }
+}
+
+/**
+ * arith_binary - Evaluate binary operators from level on.
+ */
+static long arith_binary(arith_t *a, size_t level, bool eval)
+{
+    if (level == LEVELS) {
+        return arith_unary(a, eval);
+    }
+    long lhs = arith_binary(a, level + 1, eval);
+    const char *op = NULL;
+
+    while (!a->error && (op = match_op(a, level)) != NULL) {
+        a->p += strlen(op);
+        // the right side of "&&" and "||" is not evaluated when it's useless
+        bool skip = (op[0] == '&' && op[1] == '&' && !lhs) || (op[0] == '|' && op[1] == '|' && lhs);
+        long rhs = arith_binary(a, level + 1, eval && !skip);
+
+        lhs = apply(a, op, lhs, rhs, eval && !skip);
+    }
+    return lhs;
+}
+
+/**
+ * arith_cond - Evaluate the conditional operator.
+ */
+static long arith_cond(arith_t *a, bool eval)
+{
+    long cond = arith_binary(a, 0, eval);
+
+    skip_blank(a);
+    if (*a->p != '?') {
+        return cond;
+    }
+    ++a->p;
+    long yes = arith_cond(a, eval && cond);
+
+    skip_blank(a);
+    if (*a->p != ':') {
+        a->error = true;
+        return 0;
+    }
+    ++a->p;
+    long no = arith_cond(a, eval && !cond);
+
+    return cond ? yes : no;
+}
+
+/**
+ * arith_eval - Evaluate an arithmetic expression. ok is set to false on
+ *              syntax errors, division by zero or shifts out of range.
+ */
+long arith_eval(const char *expr, bool *ok)
+{
+    arith_t a = {expr, false, NULL};
+    long value = 0;
+
+    skip_blank(&a);
+    if (*a.p != '\0') {
+        value = arith_cond(&a, true);
+        skip_blank(&a);
+    }
+    *ok = !a.error && *a.p == '\0';
+    if (!*ok) {
+        app_error(a.message != NULL ? a.message : "arithmetic syntax error");
+    }
+    return value;
+}
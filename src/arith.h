@@ -0,0 +1,8 @@
+/**
+ * Description: Declarations of arithmetic expansion.
+ */
+#pragma once
+
+#include <stdbool.h>
+
+long arith_eval(const char *expr, bool *ok);
@@ -0,0 +1,572 @@
+/**
+ * Description: Builtin utilities which run in the shell instead of forking
+ *              tiny programs such as /bin/echo and /usr/bin/test.
+ */
+#include "builtin.h"
+#include "error.h"
+#include "main.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// state of parsing arguments of test
+typedef struct _test_t {
+    char **argv;
+    int argc;
+    int pos;
+    bool error;
+} test_t;
+
+static bool test_or(test_t *t);
+
+/**
+ * put_escape - Print the escape sequence p points to, which begins with '\'.
+ *              p is moved to the last character of the sequence. Return false
+ *              if it's "\c", which stops output.
+ */
+static bool put_escape(const char **p)
+{
+    const char *s = *p + 1;
+    int ch = 0;
+
+    switch (*s) {
+    case 'a': ch = '\a'; break;
+    case 'b': ch = '\b'; break;
+    case 'f': ch = '\f'; break;
+    case 'n': ch = '\n'; break;
+    case 'r': ch = '\r'; break;
+    case 't': ch = '\t'; break;
+    case 'v': ch = '\v'; break;
+    case '\\': ch = '\\'; break;
+    case 'c':
+        return false;
+    case '0': case '1': case '2': case '3':
+    case '4': case '5': case '6': case '7': {
+        // \0nnn for echo and \nnn for printf
+        int digits = *s == '0' ? 4 : 3;
+
+        for (; digits > 0 && *s >= '0' && *s <= '7'; --digits, ++s) {
+            ch = ch * 8 + *s - '0';
+        }
+        --s;
+        break;
+    } case '\0':
+        // a single '\' at the end
+        ch = '\\';
+        --s;
+        break;
+    default:
+        putchar('\\');
+        ch = *s;
+        break;
+    }
+    putchar(ch);
+    *p = s;
+    return true;
+}
+
+/**
+ * put_escaped - Print str with escape sequences interpreted. Return false if
+ *               output is stopped by "\c".
+ */
+static bool put_escaped(const char *str)
+{
+    for (; *str != '\0'; ++str) {
+        if (*str != '\\') {
+            putchar(*str);
+        } else if (!put_escape(&str)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * do_echo - Print arguments separated by spaces. Options -n, -e and -E are
+ *           supported.
+ */
+int do_echo(char *argv[])
+{
+    bool newline = true;
+    bool escape = false;
+
+    for (++argv; *argv != NULL && (*argv)[0] == '-' && (*argv)[1] != '\0'; ++argv) {
+        const char *opt = *argv + 1;
+
+        if (opt[strspn(opt, "neE")] != '\0') {
+            break;
+        }
+        for (; *opt != '\0'; ++opt) {
+            if (*opt == 'n') {
+                newline = false;
+            } else {
+                escape = *opt == 'e';
+            }
+        }
+    }
+    for (char **arg = argv; *arg != NULL; ++arg) {
+        if (arg != argv) {
+            putchar(' ');
+        }
+        if (!escape) {
+            fputs(*arg, stdout);
+        } else if (!put_escaped(*arg)) {
+            return 0;
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    return 0;
+}
+
+/**
+ * to_number - Convert an argument of printf to a number, where a leading
+ *             quote means the code of the next character.
+ */
+static long long to_number(const char *arg, int *status)
+{
+    if (arg == NULL) {
+        return 0;
+    }
+    if (*arg == '\'' || *arg == '\"') {
+        return (unsigned char) arg[1];
+    }
+    char *end = NULL;
+
+    errno = 0;
+    long long n = strtoll(arg, &end, 0);
+
+    if (end == arg || *end != '\0' || errno != 0) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return n;
+}
+
+/**
+ * do_printf - Print arguments under the control of format. The format is
+ *             reused as long as there are arguments left.
+ */
+int do_printf(char *argv[])
+{
+    if (argv[1] == NULL) {
+        app_error("printf: usage: printf format [arguments]");
+        return 2;
+    }
+    const char *format = argv[1];
+    char **args = argv + 2;
+    int status = 0;
+    bool consumed = false;
+
+    do {
+        consumed = false;
+        for (const char *p = format; *p != '\0'; ++p) {
+            if (*p == '\\') {
+                if (!put_escape(&p)) {
+                    return status;
+                }
+                continue;
+            } else if (*p != '%') {
+                putchar(*p);
+                continue;
+            } else if (p[1] == '%') {
+                putchar('%');
+                ++p;
+                continue;
+            }
+            // "%", flags, width, precision, "ll", conversion and '\0'
+            char spec[32] = "%";
+            size_t n = 1;
+
+            for (++p; *p != '\0' && strchr("-+ #0", *p) != NULL && n < 8; ++p) {
+                spec[n++] = *p;
+            }
+            for (; isdigit((unsigned char) *p) && n < 16; ++p) {
+                spec[n++] = *p;
+            }
+            if (*p == '.') {
+                for (spec[n++] = *p++; isdigit((unsigned char) *p) && n < 24; ++p) {
+                    spec[n++] = *p;
+                }
+            }
+            if (*p == '\0') {
+                app_error("printf: missing format character");
+                return 1;
+            }
+            const char *arg = *args;
+
+            if (arg != NULL) {
+                ++args;
+                consumed = true;
+            }
+            switch (*p) {
+            case 'd':
+            case 'i':
+                strcpy(spec + n, "lld");
+                printf(spec, to_number(arg, &status));
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n] = *p;
+                printf(spec, (unsigned long long) to_number(arg, &status));
+                break;
+            case 'e':
+            case 'E':
+            case 'f':
+            case 'g':
+            case 'G':
+                spec[n] = *p;
+                printf(spec, arg == NULL ? 0.0 : strtod(arg, NULL));
+                break;
+            case 'c':
+                if (arg != NULL && *arg != '\0') {
+                    putchar(*arg);
+                }
+                break;
+            case 's':
+                spec[n] = 's';
+                printf(spec, arg == NULL ? "" : arg);
+                break;
+            case 'b':
+                if (arg != NULL && !put_escaped(arg)) {
+                    return status;
+                }
+                break;
+            default:
+                fprintf(stderr, "printf: %%%c: invalid format character\n", *p);
+                return 1;
+            }
+        }
+    } while (*args != NULL && consumed);
+    return status;
+}
+
+/**
+ * test_arg - Get the argument of test at offset off from current position.
+ */
+static const char *test_arg(const test_t *t, int off)
+{
+    return t->pos + off < t->argc ? t->argv[t->pos+off] : NULL;
+}
+
+/**
+ * test_integer - Convert an operand of test to an integer.
+ */
+static long long test_integer(test_t *t, const char *arg)
+{
+    char *end = NULL;
+
+    errno = 0;
+    long long n = strtoll(arg, &end, 10);
+
+    if (end == arg || *end != '\0' || errno != 0) {
+        fprintf(stderr, "test: %s: integer expression expected\n", arg);
+        t->error = true;
+    }
+    return n;
+}
+
+/**
+ * is_binary_op - Judge whether op is a binary operator of test.
+ */
+static bool is_binary_op(const char *op)
+{
+    static const char *ops[] = {
+        "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+        "-nt", "-ot", "-ef", NULL,
+    };
+
+    for (const char **p = ops; op != NULL && *p != NULL; ++p) {
+        if (strcmp(op, *p) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * test_binary - Evaluate a binary expression of test.
+ */
+static bool test_binary(test_t *t, const char *lhs, const char *op, const char *rhs)
+{
+    if (op[0] != '-') {
+        int cmp = strcmp(lhs, rhs);
+
+        switch (op[0]) {
+        case '<':
+            return cmp < 0;
+        case '>':
+            return cmp > 0;
+        case '!':
+            return cmp != 0;
+        default:
+            return cmp == 0;
+        }
+    }
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat ls;
+        struct stat rs;
+        bool lok = stat(lhs, &ls) == 0;
+        bool rok = stat(rhs, &rs) == 0;
+
+        switch (op[1]) {
+        case 'n':
+            return lok && (!rok || ls.st_mtime > rs.st_mtime);
+        case 'o':
+            return rok && (!lok || ls.st_mtime < rs.st_mtime);
+        default:
+            return lok && rok && ls.st_dev == rs.st_dev && ls.st_ino == rs.st_ino;
+        }
+    }
+    long long l = test_integer(t, lhs);
+    long long r = test_integer(t, rhs);
+
+    switch (op[1] * 256 + op[2]) {
+    case 'e' * 256 + 'q':
+        return l == r;
+    case 'n' * 256 + 'e':
+        return l != r;
+    case 'l' * 256 + 't':
+        return l < r;
+    case 'l' * 256 + 'e':
+        return l <= r;
+    case 'g' * 256 + 't':
+        return l > r;
+    default:
+        return l >= r;
+    }
+}
+
+/**
+ * test_unary - Evaluate a unary expression of test. Set error if op is not
+ *              a unary operator.
+ */
+static bool test_unary(test_t *t, const char *op, const char *arg)
+{
+    struct stat st;
+
+    switch (op[1]) {
+    case 'z':
+        return *arg == '\0';
+    case 'n':
+        return *arg != '\0';
+    case 'r':
+        return access(arg, R_OK) == 0;
+    case 'w':
+        return access(arg, W_OK) == 0;
+    case 'x':
+        return access(arg, X_OK) == 0;
+    case 't':
+        return isatty(atoi(arg));
+    case 'L':
+    case 'h':
+        return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    default:
+        break;
+    }
+    if (strchr("efdspSbc", op[1]) == NULL) {
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        t->error = true;
+        return false;
+    }
+    if (stat(arg, &st) < 0) {
+        return false;
+    }
+    switch (op[1]) {
+    case 'f':
+        return S_ISREG(st.st_mode);
+    case 'd':
+        return S_ISDIR(st.st_mode);
+    case 's':
+        return st.st_size > 0;
+    case 'p':
+        return S_ISFIFO(st.st_mode);
+    case 'S':
+        return S_ISSOCK(st.st_mode);
+    case 'b':
+        return S_ISBLK(st.st_mode);
+    case 'c':
+        return S_ISCHR(st.st_mode);
+    default:
+        return true;
+    }
+}
+
+/**
+ * test_primary - Evaluate a primary expression of test.
+ */
+static bool test_primary(test_t *t)
+{
+    const char *arg = test_arg(t, 0);
+
+    if (arg == NULL) {
+        app_error("test: argument expected");
+        t->error = true;
+        return false;
+    }
+    if (strcmp(arg, "(") == 0) {
+        ++t->pos;
+        bool result = test_or(t);
+
+        if (test_arg(t, 0) == NULL || strcmp(test_arg(t, 0), ")") != 0) {
+            app_error("test: ')' expected");
+            t->error = true;
+        }
+        ++t->pos;
+        return result;
+    }
+    if (is_binary_op(test_arg(t, 1)) && test_arg(t, 2) != NULL) {
+        t->pos += 3;
+        return test_binary(t, arg, t->argv[t->pos-2], t->argv[t->pos-1]);
+    }
+    if (arg[0] == '-' && arg[1] != '\0' && arg[2] == '\0' && test_arg(t, 1) != NULL) {
+        t->pos += 2;
+        return test_unary(t, arg, t->argv[t->pos-1]);
+    }
+    ++t->pos;
+    return *arg != '\0';
+}
+
+/**
+ * test_not - Evaluate an expression of test which may be negated.
+ */
+static bool test_not(test_t *t)
+{
+    const char *arg = test_arg(t, 0);
+
+    if (arg != NULL && strcmp(arg, "!") == 0 && test_arg(t, 1) != NULL) {
+        ++t->pos;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+/**
+ * test_and - Evaluate expressions of test joined by "-a".
+ */
+static bool test_and(test_t *t)
+{
+    bool result = test_not(t);
+
+    while (test_arg(t, 0) != NULL && strcmp(test_arg(t, 0), "-a") == 0) {
+        ++t->pos;
+        // evaluate anyway to consume arguments
+        result = test_not(t) && result;
+    }
+    return result;
+}
+
+/**
+ * test_or - Evaluate expressions of test joined by "-o".
+ */
+static bool test_or(test_t *t)
+{
+    bool result = test_and(t);
+
+    while (test_arg(t, 0) != NULL && strcmp(test_arg(t, 0), "-o") == 0) {
+        ++t->pos;
+        result = test_and(t) || result;
+    }
+    return result;
+}
+
+/**
+ * eval_test - Evaluate argc arguments of test. Return 0 for true, 1 for false
+ *             and 2 for errors.
+ */
+static int eval_test(char *argv[], int argc)
+{
+    test_t t = {argv, argc, 0, false};
+    bool result = false;
+
+    if (argc == 0) {
+        return 1;
+    } else if (argc == 1) {
+        // a single string, even if it looks like an operator
+        result = *argv[0] != '\0';
+    } else if (argc == 2 && strcmp(argv[0], "!") == 0) {
+        result = *argv[1] == '\0';
+    } else if (argc == 3 && is_binary_op(argv[1])) {
+        result = test_binary(&t, argv[0], argv[1], argv[2]);
+    } else {
+        result = test_or(&t);
+        if (t.pos < argc && !t.error) {
+            fprintf(stderr, "test: %s: unexpected argument\n", argv[t.pos]);
+            t.error = true;
+        }
+    }
+    return t.error ? 2 : !result;
+}
+
+/**
+ * do_test - Evaluate a conditional expression.
+ */
+int do_test(char *argv[])
+{
+    int argc = 0;
+
+    while (argv[argc+1] != NULL) {
+        ++argc;
+    }
+    return eval_test(argv + 1, argc);
+}
+
+/**
+ * do_bracket - Evaluate a conditional expression ending with ']'.
+ */
+int do_bracket(char *argv[])
+{
+    int argc = 0;
+
+    while (argv[argc+1] != NULL) {
+        ++argc;
+    }
+    if (argc == 0 || strcmp(argv[argc], "]") != 0) {
+        app_error("[: missing ']'");
+        return 2;
+    }
+    return eval_test(argv + 1, argc - 1);
+}
+
+/**
+ * do_true - Do nothing successfully.
+ */
+int do_true(char *argv[])
+{
+    UNUSED(argv);
+    return 0;
+}
+
+/**
+ * do_false - Do nothing unsuccessfully.
+ */
+int do_false(char *argv[])
+{
+    UNUSED(argv);
+    return 1;
+}
+
+/**
+ * do_pwd - Print current directory.
+ */
+int do_pwd(char *argv[])
+{
+    UNUSED(argv);
+    char *dirname = getcwd(NULL, 0);
+
+    if (dirname == NULL) {
+        unix_error("pwd");
+        return 1;
+    }
+    puts(dirname);
+    free(dirname);
+    return 0;
+}
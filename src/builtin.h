@@ -0,0 +1,13 @@
+/**
+ * Description: Declarations of builtin utilities which don't touch the state
+ *              of the shell.
+ */
+#pragma once
+
+int do_echo(char *argv[]);
+int do_printf(char *argv[]);
+int do_test(char *argv[]);
+int do_bracket(char *argv[]);
+int do_true(char *argv[]);
+int do_false(char *argv[]);
+int do_pwd(char *argv[]);
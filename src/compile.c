@@ -0,0 +1,1111 @@
+/**
+ * Description: The compiler from source to bytecode. A complete command is
+ *              parsed into a flat array of nodes first, which is then walked
+ *              to emit instructions, so that loops are never parsed again.
+ */
+#include "compile.h"
+#include "error.h"
+#include "lex.h"
+#include "vars.h"
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// index of no node, and the end of a chain of jumps to patch
+#define NIL 0
+#define NO_ADDR UINT32_MAX
+
+enum NODE {
+    N_NONE, N_SIMPLE, N_PIPE, N_AND, N_OR, N_NOT, N_SEQ, N_BG, N_IF, N_WHILE,
+    N_UNTIL, N_FOR, N_CASE, N_ITEM, N_GROUP, N_SUBSHELL, N_REDIR, N_BREAK,
+    N_CONTINUE,
+};
+
+/*
+ * Fields of nodes:
+ *   N_SIMPLE: a = command
+ *   N_PIPE: a = first stage, b = number of stages
+ *   N_AND, N_OR: a = left, b = right
+ *   N_NOT, N_BG, N_GROUP, N_SUBSHELL: a = child
+ *   N_SEQ: a = first child
+ *   N_IF: a = condition, b = then, c = else
+ *   N_WHILE, N_UNTIL: a = condition, b = body
+ *   N_FOR: a = command of the name and words, b = body
+ *   N_CASE: a = word, b = first item
+ *   N_ITEM: a = first pattern word, b = number of patterns, c = body
+ *   N_REDIR: a = child, b = command holding redirects
+ *   N_BREAK, N_CONTINUE: a = number of loops
+ * Lists are linked by next, and start and end are offsets of source text.
+ */
+typedef struct _node_t {
+    uint8_t type;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint32_t next;
+    uint32_t start;
+    uint32_t end;
+} node_t;
+
+// a here-document whose body follows the next newline
+typedef struct _heredoc_t {
+    uint32_t redir;
+    bool strip;
+} heredoc_t;
+
+typedef struct _parser_t {
+    lexer_t lx;
+    token_t tok;
+    // end of the last token consumed
+    size_t last_end;
+    prog_t *prog;
+    node_t *nodes;
+    size_t nnodes;
+    size_t nodes_cap;
+    heredoc_t *heredocs;
+    size_t nheredocs;
+    size_t heredocs_cap;
+    enum COMPILE status;
+    jmp_buf fail;
+} parser_t;
+
+// a loop enclosing code being generated, for break and continue
+typedef struct _loop_t {
+    struct _loop_t *outer;
+    uint32_t top;
+    // chain of jumps to the end of the loop
+    uint32_t breaks;
+    unsigned redirs;
+} loop_t;
+
+typedef struct _ctx_t {
+    loop_t *loop;
+    // redirects applied by OP_REDIR in the shell
+    unsigned redirs;
+    unsigned slot;
+} ctx_t;
+
+static uint32_t parse_list(parser_t *p, bool top);
+
+/**
+ * grow - Make room for one more element in array.
+ */
+static void *grow(void *array, size_t *cap, size_t n, size_t size)
+{
+    if (n < *cap) {
+        return array;
+    }
+    size_t new_cap = *cap == 0 ? 16 : *cap * 2;
+    void *tmp = realloc(array, new_cap * size);
+
+    if (tmp == NULL) {
+        unix_fatal("realloc error");
+    }
+    *cap = new_cap;
+    return tmp;
+}
+
+/**
+ * pool_add - Copy text to the pool of prog. Return its offset.
+ */
+static uint32_t pool_add(prog_t *prog, const char *text, size_t len)
+{
+    while (prog->npool + len + 1 > prog->pool_cap) {
+        prog->pool = grow(prog->pool, &prog->pool_cap, prog->pool_cap, 1);
+    }
+    uint32_t off = prog->npool;
+
+    memcpy(prog->pool + off, text, len);
+    prog->pool[off+len] = '\0';
+    prog->npool += len + 1;
+    return off;
+}
+
+/**
+ * add_word - Add a word to prog. Return its index.
+ */
+static uint32_t add_word(prog_t *prog, const char *text, size_t len)
+{
+    prog->words = grow(prog->words, &prog->words_cap, prog->nwords, sizeof(word_t));
+    prog->words[prog->nwords].off = pool_add(prog, text, len);
+    prog->words[prog->nwords].len = len;
+    return prog->nwords++;
+}
+
+/**
+ * add_cmd - Add a command to prog. Return its index.
+ */
+static uint32_t add_cmd(prog_t *prog, const cmd_t *cmd)
+{
+    prog->cmds = grow(prog->cmds, &prog->cmds_cap, prog->ncmds, sizeof(cmd_t));
+    prog->cmds[prog->ncmds] = *cmd;
+    return prog->ncmds++;
+}
+
+/**
+ * emit - Emit an instruction. Return its address.
+ */
+static uint32_t emit(prog_t *prog, uint8_t op, uint32_t a, uint32_t b, unsigned slot)
+{
+    prog->code = grow(prog->code, &prog->code_cap, prog->ncode, sizeof(insn_t));
+    insn_t *insn = &prog->code[prog->ncode];
+
+    insn->op = op;
+    insn->flags = 0;
+    insn->slot = slot;
+    insn->a = a;
+    insn->b = b;
+    return prog->ncode++;
+}
+
+/**
+ * patch - Make the chain of jumps linked by their targets jump to addr.
+ */
+static void patch(prog_t *prog, uint32_t chain, uint32_t addr)
+{
+    while (chain != NO_ADDR) {
+        uint32_t next = prog->code[chain].a;
+
+        prog->code[chain].a = addr;
+        chain = next;
+    }
+}
+
+/**
+ * fail - Stop compiling with status.
+ */
+static void fail(parser_t *p, enum COMPILE status)
+{
+    if (status == COMPILE_ERROR) {
+        const token_t *tok = &p->tok;
+
+        if (tok->type == T_NEWLINE) {
+            app_error("syntax error near unexpected token `newline'");
+        } else {
+            printf("syntax error near unexpected token `%.*s'\n", (int) tok->len, p->lx.src + tok->off);
+        }
+    }
+    p->status = status;
+    longjmp(p->fail, 1);
+}
+
+/**
+ * strip_tabs - Remove leading tabs of lines in s. Return the length left.
+ */
+static size_t strip_tabs(char *s, size_t len)
+{
+    size_t n = 0;
+    bool head = true;
+
+    for (size_t i = 0; i < len; ++i) {
+        if (!(head && s[i] == '\t')) {
+            s[n++] = s[i];
+            head = s[i] == '\n';
+        }
+    }
+    s[n] = '\0';
+    return n;
+}
+
+/**
+ * read_heredocs - Read bodies of here-documents after a newline.
+ */
+static void read_heredocs(parser_t *p)
+{
+    prog_t *prog = p->prog;
+
+    for (size_t i = 0; i < p->nheredocs; ++i) {
+        redir_t *redir = &prog->redirs[p->heredocs[i].redir];
+        char delim[redir->target.len + 1];
+        size_t off = 0;
+        size_t len = 0;
+
+        memcpy(delim, word_text(prog, redir->target), sizeof(delim));
+        if (!lex_heredoc(&p->lx, delim, redir->target.len, p->heredocs[i].strip, &off, &len)) {
+            fail(p, COMPILE_INCOMPLETE);
+        }
+        redir->target.off = pool_add(prog, p->lx.src + off, len);
+        redir->target.len = len;
+        if (p->heredocs[i].strip) {
+            redir->target.len = strip_tabs(prog->pool + redir->target.off, len);
+        }
+    }
+    p->nheredocs = 0;
+}
+
+/**
+ * next - Move to the next token. Here-documents are read after a newline.
+ */
+static void next(parser_t *p)
+{
+    p->last_end = p->tok.off + p->tok.len;
+    if (lex_next(&p->lx, &p->tok) == T_ERROR) {
+        fail(p, COMPILE_INCOMPLETE);
+    }
+    if (p->nheredocs > 0 && (p->tok.type == T_NEWLINE || p->tok.type == T_EOF)) {
+        read_heredocs(p);
+    }
+}
+
+/**
+ * new_node - Add a node beginning at start and ending at the last token.
+ */
+static uint32_t new_node(parser_t *p, enum NODE type, uint32_t a, uint32_t b, uint32_t c, size_t start)
+{
+    p->nodes = grow(p->nodes, &p->nodes_cap, p->nnodes, sizeof(node_t));
+    node_t *node = &p->nodes[p->nnodes];
+
+    node->type = type;
+    node->a = a;
+    node->b = b;
+    node->c = c;
+    node->next = NIL;
+    node->start = start;
+    node->end = p->last_end;
+    return p->nnodes++;
+}
+
+/**
+ * is_reserved - Judge whether the current token is the reserved word.
+ */
+static bool is_reserved(const parser_t *p, const char *word)
+{
+    const token_t *tok = &p->tok;
+
+    return tok->type == T_WORD && !tok->quoted && tok->len == strlen(word)
+        && strncmp(p->lx.src + tok->off, word, tok->len) == 0;
+}
+
+/**
+ * at_end - Judge whether the current token ends a list.
+ */
+static bool at_end(const parser_t *p)
+{
+    static const char *ends[] = {"then", "else", "elif", "fi", "do", "done", "esac", "}", NULL};
+
+    switch (p->tok.type) {
+    case T_EOF:
+    case T_RPAREN:
+    case T_DSEMI:
+        return true;
+    case T_WORD:
+        for (const char **end = ends; *end != NULL; ++end) {
+            if (is_reserved(p, *end)) {
+                return true;
+            }
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+/**
+ * skip_newlines - Skip newlines, which may be inside of compound commands.
+ */
+static void skip_newlines(parser_t *p)
+{
+    while (p->tok.type == T_NEWLINE) {
+        next(p);
+    }
+}
+
+/**
+ * expect - Consume the reserved word, which must be the current token.
+ */
+static void expect(parser_t *p, const char *word)
+{
+    if (!is_reserved(p, word)) {
+        fail(p, p->tok.type == T_EOF ? COMPILE_INCOMPLETE : COMPILE_ERROR);
+    }
+    next(p);
+}
+
+/**
+ * expect_word - Make sure the current token is a word.
+ */
+static void expect_word(parser_t *p)
+{
+    if (p->tok.type != T_WORD) {
+        fail(p, p->tok.type == T_EOF ? COMPILE_INCOMPLETE : COMPILE_ERROR);
+    }
+}
+
+/**
+ * token_word - Add the current token to words of prog.
+ */
+static uint32_t token_word(parser_t *p)
+{
+    return add_word(p->prog, p->lx.src + p->tok.off, p->tok.len);
+}
+
+/**
+ * unquote - Remove quotes of a delimiter of a here-document in place. Return
+ *           the length left.
+ */
+static size_t unquote(char *s, size_t len)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        if (s[i] == '\\' && i + 1 < len) {
+            s[n++] = s[++i];
+        } else if (s[i] != '\'' && s[i] != '\"') {
+            s[n++] = s[i];
+        }
+    }
+    s[n] = '\0';
+    return n;
+}
+
+/**
+ * parse_redirect - Parse a redirect operator and its target.
+ */
+static void parse_redirect(parser_t *p)
+{
+    prog_t *prog = p->prog;
+    redir_t redir = {p->tok.fd, p->tok.redir, {0, 0}};
+
+    next(p);
+    expect_word(p);
+    redir.target.off = pool_add(prog, p->lx.src + p->tok.off, p->tok.len);
+    redir.target.len = p->tok.len;
+    if (redir.kind == R_HEREDOC || redir.kind == R_HEREDOC_STRIP) {
+        // the target is the delimiter until the body is read
+        p->heredocs = grow(p->heredocs, &p->heredocs_cap, p->nheredocs, sizeof(heredoc_t));
+        p->heredocs[p->nheredocs].redir = prog->nredirs;
+        p->heredocs[p->nheredocs++].strip = redir.kind == R_HEREDOC_STRIP;
+        redir.kind = p->tok.quoted ? R_HEREDOC_RAW : R_HEREDOC;
+        redir.target.len = unquote(prog->pool + redir.target.off, redir.target.len);
+    }
+    prog->redirs = grow(prog->redirs, &prog->redirs_cap, prog->nredirs, sizeof(redir_t));
+    prog->redirs[prog->nredirs++] = redir;
+    next(p);
+}
+
+/**
+ * parse_redirects - Parse redirects following a compound command into a
+ *                   command. Return the command, or NIL if there's none.
+ */
+static uint32_t parse_redirects(parser_t *p)
+{
+    if (p->tok.type != T_REDIR) {
+        return NIL;
+    }
+    cmd_t cmd = {0};
+
+    cmd.redir = p->prog->nredirs;
+    while (p->tok.type == T_REDIR) {
+        parse_redirect(p);
+    }
+    cmd.nredirs = p->prog->nredirs - cmd.redir;
+    return add_cmd(p->prog, &cmd);
+}
+
+/**
+ * is_assignment - Judge whether the current token is an assignment.
+ */
+static bool is_assignment(const parser_t *p)
+{
+    const char *text = p->lx.src + p->tok.off;
+    const char *equal = memchr(text, '=', p->tok.len);
+
+    return equal != NULL && is_name(text, equal - text);
+}
+
+/**
+ * loop_jump - Turn "break n" or "continue n" into a node, or return NIL if
+ *             the simple command is not such one.
+ */
+static uint32_t loop_jump(parser_t *p, const cmd_t *cmd, size_t start)
+{
+    const prog_t *prog = p->prog;
+
+    if (cmd->nwords == 0 || cmd->nwords > 2 || cmd->nassigns > 0 || cmd->nredirs > 0) {
+        return NIL;
+    }
+    const char *name = word_text(prog, prog->words[cmd->word]);
+    enum NODE type = strcmp(name, "break") == 0 ? N_BREAK
+        : strcmp(name, "continue") == 0 ? N_CONTINUE : N_NONE;
+
+    if (type == N_NONE) {
+        return NIL;
+    }
+    int n = cmd->nwords == 2 ? atoi(word_text(prog, prog->words[cmd->word+1])) : 1;
+
+    return new_node(p, type, n < 1 ? 1 : n, 0, 0, start);
+}
+
+/**
+ * parse_simple - Parse a simple command with its assignments and redirects.
+ */
+static uint32_t parse_simple(parser_t *p)
+{
+    prog_t *prog = p->prog;
+    size_t start = p->tok.off;
+    cmd_t cmd = {0};
+    bool assigning = true;
+
+    cmd.word = prog->nwords;
+    cmd.redir = prog->nredirs;
+    while (true) {
+        if (p->tok.type == T_WORD) {
+            if (assigning && is_assignment(p)) {
+                ++cmd.nassigns;
+            } else {
+                assigning = false;
+            }
+            token_word(p);
+            next(p);
+        } else if (p->tok.type == T_REDIR) {
+            parse_redirect(p);
+        } else {
+            break;
+        }
+    }
+    cmd.nwords = prog->nwords - cmd.word;
+    cmd.nredirs = prog->nredirs - cmd.redir;
+    uint32_t jump = loop_jump(p, &cmd, start);
+
+    return jump != NIL ? jump : new_node(p, N_SIMPLE, add_cmd(prog, &cmd), 0, 0, start);
+}
+
+/**
+ * parse_if - Parse an if command from "if" or "elif" to "fi".
+ */
+static uint32_t parse_if(parser_t *p, size_t start)
+{
+    next(p);
+    uint32_t cond = parse_list(p, false);
+
+    expect(p, "then");
+    uint32_t body = parse_list(p, false);
+    uint32_t other = NIL;
+
+    if (is_reserved(p, "elif")) {
+        // the nested if consumes "fi"
+        other = parse_if(p, p->tok.off);
+    } else {
+        if (is_reserved(p, "else")) {
+            next(p);
+            other = parse_list(p, false);
+        }
+        expect(p, "fi");
+    }
+    return new_node(p, N_IF, cond, body, other, start);
+}
+
+/**
+ * parse_while - Parse a while or until loop.
+ */
+static uint32_t parse_while(parser_t *p, enum NODE type, size_t start)
+{
+    next(p);
+    uint32_t cond = parse_list(p, false);
+
+    expect(p, "do");
+    uint32_t body = parse_list(p, false);
+
+    expect(p, "done");
+    return new_node(p, type, cond, body, 0, start);
+}
+
+/**
+ * parse_for - Parse a for loop. Without "in", positional parameters are
+ *             iterated.
+ */
+static uint32_t parse_for(parser_t *p, size_t start)
+{
+    prog_t *prog = p->prog;
+    cmd_t cmd = {0};
+
+    next(p);
+    expect_word(p);
+    if (!is_name(p->lx.src + p->tok.off, p->tok.len)) {
+        fail(p, COMPILE_ERROR);
+    }
+    cmd.word = token_word(p);
+    next(p);
+    skip_newlines(p);
+    if (is_reserved(p, "in")) {
+        next(p);
+        while (p->tok.type == T_WORD) {
+            token_word(p);
+            next(p);
+        }
+        if (p->tok.type != T_SEMI && p->tok.type != T_NEWLINE) {
+            fail(p, p->tok.type == T_EOF ? COMPILE_INCOMPLETE : COMPILE_ERROR);
+        }
+        next(p);
+    } else {
+        static const char *params = "\"$@\"";
+
+        add_word(prog, params, strlen(params));
+        if (p->tok.type == T_SEMI) {
+            next(p);
+        }
+    }
+    cmd.nwords = prog->nwords - cmd.word;
+    skip_newlines(p);
+    expect(p, "do");
+    uint32_t body = parse_list(p, false);
+
+    expect(p, "done");
+    return new_node(p, N_FOR, add_cmd(prog, &cmd), body, 0, start);
+}
+
+/**
+ * parse_case - Parse a case command.
+ */
+static uint32_t parse_case(parser_t *p, size_t start)
+{
+    next(p);
+    expect_word(p);
+    uint32_t word = token_word(p);
+    uint32_t first = NIL;
+    uint32_t last = NIL;
+
+    next(p);
+    skip_newlines(p);
+    expect(p, "in");
+    skip_newlines(p);
+    while (!is_reserved(p, "esac")) {
+        size_t item_start = p->tok.off;
+        uint32_t pattern = p->prog->nwords;
+
+        if (p->tok.type == T_LPAREN) {
+            next(p);
+        }
+        expect_word(p);
+        token_word(p);
+        next(p);
+        while (p->tok.type == T_PIPE) {
+            next(p);
+            expect_word(p);
+            token_word(p);
+            next(p);
+        }
+        if (p->tok.type != T_RPAREN) {
+            fail(p, p->tok.type == T_EOF ? COMPILE_INCOMPLETE : COMPILE_ERROR);
+        }
+        next(p);
+        uint32_t body = parse_list(p, false);
+        uint32_t item = new_node(p, N_ITEM, pattern, p->prog->nwords - pattern, body, item_start);
+
+        if (last == NIL) {
+            first = item;
+        } else {
+            p->nodes[last].next = item;
+        }
+        last = item;
+        if (p->tok.type != T_DSEMI) {
+            break;
+        }
+        next(p);
+        skip_newlines(p);
+    }
+    expect(p, "esac");
+    return new_node(p, N_CASE, word, first, 0, start);
+}
+
+/**
+ * parse_command - Parse a simple command or a compound command with its
+ *                 redirects.
+ */
+static uint32_t parse_command(parser_t *p)
+{
+    size_t start = p->tok.off;
+    uint32_t node = NIL;
+
+    switch (p->tok.type) {
+    case T_LPAREN:
+        next(p);
+        node = parse_list(p, false);
+        if (p->tok.type != T_RPAREN) {
+            fail(p, p->tok.type == T_EOF ? COMPILE_INCOMPLETE : COMPILE_ERROR);
+        }
+        next(p);
+        node = new_node(p, N_SUBSHELL, node, 0, 0, start);
+        break;
+    case T_WORD:
+        if (is_reserved(p, "if")) {
+            node = parse_if(p, start);
+        } else if (is_reserved(p, "while")) {
+            node = parse_while(p, N_WHILE, start);
+        } else if (is_reserved(p, "until")) {
+            node = parse_while(p, N_UNTIL, start);
+        } else if (is_reserved(p, "for")) {
+            node = parse_for(p, start);
+        } else if (is_reserved(p, "case")) {
+            node = parse_case(p, start);
+        } else if (is_reserved(p, "{")) {
+            next(p);
+            node = parse_list(p, false);
+            expect(p, "}");
+            node = new_node(p, N_GROUP, node, 0, 0, start);
+        } else if (at_end(p)) {
+            fail(p, COMPILE_ERROR);
+        } else {
+            return parse_simple(p);
+        }
+        break;
+    case T_REDIR:
+        return parse_simple(p);
+    case T_EOF:
+        fail(p, COMPILE_INCOMPLETE);
+        break;
+    default:
+        fail(p, COMPILE_ERROR);
+        break;
+    }
+    uint32_t redirects = parse_redirects(p);
+
+    return redirects == NIL ? node : new_node(p, N_REDIR, node, redirects, 0, start);
+}
+
+/**
+ * parse_pipeline - Parse commands connected by '|', which may follow '!'.
+ */
+static uint32_t parse_pipeline(parser_t *p)
+{
+    size_t start = p->tok.off;
+    bool bang = is_reserved(p, "!");
+
+    if (bang) {
+        next(p);
+    }
+    uint32_t first = parse_command(p);
+    uint32_t last = first;
+    uint32_t n = 1;
+
+    while (p->tok.type == T_PIPE) {
+        next(p);
+        skip_newlines(p);
+        uint32_t stage = parse_command(p);
+
+        p->nodes[last].next = stage;
+        last = stage;
+        ++n;
+    }
+    uint32_t node = n == 1 ? first : new_node(p, N_PIPE, first, n, 0, start);
+
+    return bang ? new_node(p, N_NOT, node, 0, 0, start) : node;
+}
+
+/**
+ * parse_and_or - Parse pipelines connected by "&&" and "||".
+ */
+static uint32_t parse_and_or(parser_t *p)
+{
+    size_t start = p->tok.off;
+    uint32_t left = parse_pipeline(p);
+
+    while (p->tok.type == T_AND || p->tok.type == T_OR) {
+        enum NODE type = p->tok.type == T_AND ? N_AND : N_OR;
+
+        next(p);
+        skip_newlines(p);
+        uint32_t right = parse_pipeline(p);
+
+        left = new_node(p, type, left, right, 0, start);
+    }
+    return left;
+}
+
+/**
+ * parse_list - Parse commands separated by ';', '&' or newlines. A list on top
+ *              level ends at the first newline, which is left consumed.
+ */
+static uint32_t parse_list(parser_t *p, bool top)
+{
+    size_t start = p->tok.off;
+    uint32_t first = NIL;
+    uint32_t last = NIL;
+    uint32_t n = 0;
+
+    while (true) {
+        if (!top) {
+            skip_newlines(p);
+        }
+        if (at_end(p)) {
+            break;
+        }
+        uint32_t node = parse_and_or(p);
+
+        if (p->tok.type == T_AMP) {
+            next(p);
+            node = new_node(p, N_BG, node, 0, 0, p->nodes[node].start);
+        } else if (p->tok.type == T_SEMI) {
+            next(p);
+        } else if (p->tok.type == T_NEWLINE) {
+            if (!top) {
+                next(p);
+            }
+        } else if (!at_end(p)) {
+            fail(p, COMPILE_ERROR);
+        }
+        if (last == NIL) {
+            first = node;
+        } else {
+            p->nodes[last].next = node;
+        }
+        last = node;
+        ++n;
+        if (top && (p->tok.type == T_NEWLINE || p->tok.type == T_EOF)) {
+            break;
+        }
+    }
+    return n <= 1 ? first : new_node(p, N_SEQ, first, 0, 0, start);
+}
+
+static void gen(parser_t *p, uint32_t index, ctx_t ctx);
+
+/**
+ * set_text - Keep source text of a node in the pool to name the job of cmd.
+ */
+static void set_text(parser_t *p, uint32_t cmd, uint32_t index)
+{
+    const node_t *node = &p->nodes[index];
+    size_t len = node->end - node->start;
+    prog_t *prog = p->prog;
+
+    // names of jobs end with a newline
+    uint32_t off = pool_add(prog, p->lx.src + node->start, len + 1);
+
+    prog->pool[off+len] = '\n';
+    prog->cmds[cmd].text = off;
+}
+
+/**
+ * gen_outline - Emit code of a node out of line, to be run in a subshell.
+ *               Return its entry.
+ */
+static uint32_t gen_outline(parser_t *p, uint32_t index)
+{
+    prog_t *prog = p->prog;
+    uint32_t jump = emit(prog, OP_JMP, 0, 0, 0);
+    uint32_t entry = prog->ncode;
+    ctx_t ctx = {NULL, 0, 0};
+
+    gen(p, index, ctx);
+    emit(prog, OP_END, 0, 0, 0);
+    prog->code[jump].a = prog->ncode;
+    return entry;
+}
+
+/**
+ * subshell_cmd - Add a command running node in a subshell.
+ */
+static uint32_t subshell_cmd(parser_t *p, uint32_t index)
+{
+    const node_t *node = &p->nodes[index];
+    cmd_t cmd = {0};
+
+    if (node->type == N_REDIR && p->nodes[node->a].type == N_SUBSHELL) {
+        uint32_t redirects = node->b;
+
+        cmd.code = gen_outline(p, p->nodes[node->a].a);
+        cmd.redir = p->prog->cmds[redirects].redir;
+        cmd.nredirs = p->prog->cmds[redirects].nredirs;
+    } else if (node->type == N_SUBSHELL) {
+        cmd.code = gen_outline(p, node->a);
+    } else {
+        cmd.code = gen_outline(p, index);
+    }
+    return add_cmd(p->prog, &cmd);
+}
+
+/**
+ * gen_pipe - Emit a pipeline, the stages of which are made contiguous.
+ */
+static void gen_pipe(parser_t *p, uint32_t index, uint8_t flags)
+{
+    prog_t *prog = p->prog;
+    uint32_t n = p->nodes[index].b;
+    cmd_t *stages = malloc(n * sizeof(*stages));
+
+    if (stages == NULL) {
+        unix_fatal("malloc error");
+    }
+    uint32_t stage = p->nodes[index].a;
+
+    for (uint32_t i = 0; i < n; ++i, stage = p->nodes[stage].next) {
+        uint32_t cmd = p->nodes[stage].type == N_SIMPLE ? p->nodes[stage].a : subshell_cmd(p, stage);
+
+        stages[i] = prog->cmds[cmd];
+    }
+    uint32_t first = prog->ncmds;
+
+    for (uint32_t i = 0; i < n; ++i) {
+        add_cmd(prog, &stages[i]);
+    }
+    free(stages);
+    set_text(p, first, index);
+    uint32_t pc = emit(prog, OP_PIPE, first, n, 0);
+
+    prog->code[pc].flags = flags;
+}
+
+/**
+ * gen_jump - Emit break or continue jumping out of loops.
+ */
+static void gen_jump(parser_t *p, const node_t *node, ctx_t ctx)
+{
+    prog_t *prog = p->prog;
+    loop_t *loop = ctx.loop;
+
+    for (uint32_t i = 1; i < node->a && loop != NULL && loop->outer != NULL; ++i) {
+        loop = loop->outer;
+    }
+    if (loop == NULL) {
+        emit(prog, OP_SET, 0, 0, 0);
+        return;
+    }
+    for (unsigned i = loop->redirs; i < ctx.redirs; ++i) {
+        emit(prog, OP_UNREDIR, 0, 0, 0);
+    }
+    if (node->type == N_CONTINUE) {
+        emit(prog, OP_JMP, loop->top, 0, 0);
+    } else {
+        loop->breaks = emit(prog, OP_JMP, loop->breaks, 0, 0);
+    }
+}
+
+/**
+ * gen_case - Emit a case command. Patterns of an item jump to its body.
+ */
+static void gen_case(parser_t *p, const node_t *node, ctx_t ctx)
+{
+    prog_t *prog = p->prog;
+    unsigned slot = ctx.slot++;
+    uint32_t ends = NO_ADDR;
+
+    emit(prog, OP_CASE, node->a, 0, slot);
+    for (uint32_t item = node->b; item != NIL; item = p->nodes[item].next) {
+        const node_t *it = &p->nodes[item];
+        uint32_t first = prog->ncode;
+
+        for (uint32_t i = 0; i < it->b; ++i) {
+            emit(prog, OP_MATCH, it->a + i, 0, slot);
+        }
+        uint32_t skip = emit(prog, OP_JMP, 0, 0, 0);
+
+        for (uint32_t addr = first; addr < skip; ++addr) {
+            prog->code[addr].b = prog->ncode;
+        }
+        gen(p, it->c, ctx);
+        ends = emit(prog, OP_JMP, ends, 0, 0);
+        prog->code[skip].a = prog->ncode;
+    }
+    emit(prog, OP_SET, 0, 0, 0);
+    patch(prog, ends, prog->ncode);
+}
+
+/**
+ * gen_loop - Emit a while, until or for loop.
+ */
+static void gen_loop(parser_t *p, const node_t *node, ctx_t ctx)
+{
+    prog_t *prog = p->prog;
+    loop_t loop = {ctx.loop, 0, NO_ADDR, ctx.redirs};
+    uint32_t exit = 0;
+    ctx_t body = ctx;
+
+    body.loop = &loop;
+    if (node->type == N_FOR) {
+        body.slot = ctx.slot + 1;
+        emit(prog, OP_FOR, node->a, 0, ctx.slot);
+        loop.top = prog->ncode;
+        exit = emit(prog, OP_NEXT, node->a, 0, ctx.slot);
+        gen(p, node->b, body);
+        emit(prog, OP_JMP, loop.top, 0, 0);
+        prog->code[exit].b = prog->ncode;
+    } else {
+        loop.top = prog->ncode;
+        gen(p, node->a, ctx);
+        exit = emit(prog, node->type == N_WHILE ? OP_JNZ : OP_JZ, 0, 0, 0);
+        gen(p, node->b, body);
+        emit(prog, OP_JMP, loop.top, 0, 0);
+        prog->code[exit].a = prog->ncode;
+    }
+    patch(prog, loop.breaks, prog->ncode);
+    if (node->type != N_FOR) {
+        // the status of a loop which has run no command is zero
+        emit(prog, OP_SET, 0, 0, 0);
+    }
+}
+
+/**
+ * gen - Emit code of a node.
+ */
+static void gen(parser_t *p, uint32_t index, ctx_t ctx)
+{
+    prog_t *prog = p->prog;
+    node_t node = p->nodes[index];
+
+    if (ctx.slot >= prog->nslots) {
+        prog->nslots = ctx.slot + 1;
+    }
+    switch (node.type) {
+    case N_NONE:
+        emit(prog, OP_SET, 0, 0, 0);
+        break;
+    case N_SIMPLE:
+        set_text(p, node.a, index);
+        emit(prog, OP_PIPE, node.a, 1, 0);
+        break;
+    case N_PIPE:
+        gen_pipe(p, index, 0);
+        break;
+    case N_AND:
+    case N_OR: {
+        gen(p, node.a, ctx);
+        uint32_t skip = emit(prog, node.type == N_AND ? OP_JNZ : OP_JZ, 0, 0, 0);
+
+        gen(p, node.b, ctx);
+        prog->code[skip].a = prog->ncode;
+        break;
+    } case N_NOT:
+        gen(p, node.a, ctx);
+        emit(prog, OP_NOT, 0, 0, 0);
+        break;
+    case N_SEQ:
+        for (uint32_t child = node.a; child != NIL; child = p->nodes[child].next) {
+            gen(p, child, ctx);
+        }
+        break;
+    case N_BG: {
+        const node_t *child = &p->nodes[node.a];
+
+        if (child->type == N_PIPE) {
+            gen_pipe(p, node.a, PIPE_BG);
+            break;
+        }
+        uint32_t cmd = child->type == N_SIMPLE ? child->a : subshell_cmd(p, node.a);
+
+        set_text(p, cmd, index);
+        uint32_t pc = emit(prog, OP_PIPE, cmd, 1, 0);
+
+        prog->code[pc].flags = PIPE_BG;
+        break;
+    } case N_IF: {
+        gen(p, node.a, ctx);
+        uint32_t other = emit(prog, OP_JNZ, 0, 0, 0);
+
+        gen(p, node.b, ctx);
+        uint32_t end = emit(prog, OP_JMP, 0, 0, 0);
+
+        prog->code[other].a = prog->ncode;
+        if (node.c != NIL) {
+            gen(p, node.c, ctx);
+        } else {
+            emit(prog, OP_SET, 0, 0, 0);
+        }
+        prog->code[end].a = prog->ncode;
+        break;
+    } case N_WHILE:
+    case N_UNTIL:
+    case N_FOR:
+        gen_loop(p, &node, ctx);
+        break;
+    case N_CASE:
+        gen_case(p, &node, ctx);
+        break;
+    case N_GROUP:
+        gen(p, node.a, ctx);
+        break;
+    case N_SUBSHELL: {
+        uint32_t cmd = subshell_cmd(p, index);
+
+        set_text(p, cmd, index);
+        emit(prog, OP_PIPE, cmd, 1, 0);
+        break;
+    } case N_REDIR: {
+        if (p->nodes[node.a].type == N_SUBSHELL) {
+            uint32_t cmd = subshell_cmd(p, index);
+
+            set_text(p, cmd, index);
+            emit(prog, OP_PIPE, cmd, 1, 0);
+            break;
+        }
+        // a failed redirect jumps to OP_UNREDIR, skipping the command
+        uint32_t redir = emit(prog, OP_REDIR, node.b, 0, 0);
+
+        ++ctx.redirs;
+        gen(p, node.a, ctx);
+        uint32_t end = emit(prog, OP_UNREDIR, 0, 0, 0);
+
+        prog->code[redir].b = end;
+        break;
+    } case N_BREAK:
+    case N_CONTINUE:
+        gen_jump(p, &node, ctx);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * compile - Compile the first complete command in src into prog, which is
+ *           reset first. The length of source compiled is set in consumed.
+ */
+enum COMPILE compile(prog_t *prog, const char *src, size_t len, size_t *consumed)
+{
+    parser_t p;
+
+    memset(&p, 0, sizeof(p));
+    p.prog = prog;
+    p.status = COMPILE_OK;
+    prog_reset(prog);
+    lex_init(&p.lx, src, len);
+    // node 0 is NIL
+    new_node(&p, N_NONE, 0, 0, 0, 0);
+    if (setjmp(p.fail) == 0) {
+        next(&p);
+        if (p.tok.type != T_NEWLINE && p.tok.type != T_EOF) {
+            uint32_t root = parse_list(&p, true);
+
+            if (p.tok.type != T_NEWLINE && p.tok.type != T_EOF) {
+                fail(&p, COMPILE_ERROR);
+            }
+            ctx_t ctx = {NULL, 0, 0};
+
+            gen(&p, root, ctx);
+        }
+        emit(prog, OP_END, 0, 0, 0);
+    } else {
+        prog_reset(prog);
+    }
+    free(p.nodes);
+    free(p.heredocs);
+    *consumed = p.lx.pos;
+    return p.status;
+}
+
+/**
+ * prog_reset - Empty prog, keeping its memory.
+ */
+void prog_reset(prog_t *prog)
+{
+    prog->ncode = 0;
+    prog->ncmds = 0;
+    prog->nwords = 0;
+    prog->nredirs = 0;
+    prog->npool = 0;
+    prog->nslots = 0;
+}
+
+/**
+ * prog_free - Free memory of prog.
+ */
+void prog_free(prog_t *prog)
+{
+    free(prog->code);
+    free(prog->cmds);
+    free(prog->words);
+    free(prog->redirs);
+    free(prog->pool);
+    memset(prog, 0, sizeof(*prog));
+}
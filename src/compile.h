@@ -0,0 +1,112 @@
+/**
+ * Description: Declarations of the compiler from source to bytecode. A
+ *              program holds no pointers: words, commands and jumps refer to
+ *              each other by indexes, and text is kept in a string pool.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum OPCODE {
+    // return from the interpreter loop
+    OP_END,
+    // run commands a to a+b-1 as a pipeline
+    OP_PIPE,
+    OP_JMP,
+    // jump to a if the last status is zero
+    OP_JZ,
+    // jump to a if the last status isn't zero
+    OP_JNZ,
+    OP_NOT,
+    // set the last status to a
+    OP_SET,
+    // expand words of command a into slot as the list of a for loop
+    OP_FOR,
+    // assign the next word in slot to word a, or jump to b if there's none
+    OP_NEXT,
+    // expand word a into slot as the subject of a case
+    OP_CASE,
+    // jump to b if pattern word a matches the subject in slot
+    OP_MATCH,
+    // apply redirects of command a in the shell
+    OP_REDIR,
+    // undo the last OP_REDIR
+    OP_UNREDIR,
+};
+
+// flags of OP_PIPE
+#define PIPE_BG 1
+
+// code of a simple command
+#define NO_CODE 0
+
+typedef struct _insn_t {
+    uint8_t op;
+    uint8_t flags;
+    uint16_t slot;
+    uint32_t a;
+    uint32_t b;
+} insn_t;
+
+// raw text of a word in the pool, with quotes and substitutions kept
+typedef struct _word_t {
+    uint32_t off;
+    uint32_t len;
+} word_t;
+
+typedef struct _redir_t {
+    // -1 for the default of the operator
+    int32_t fd;
+    // enum REDIR of the lexer
+    uint32_t kind;
+    word_t target;
+} redir_t;
+
+typedef struct _cmd_t {
+    uint32_t word;
+    uint32_t nwords;
+    // leading words which are assignments
+    uint32_t nassigns;
+    uint32_t redir;
+    uint32_t nredirs;
+    // entry of a compound command run in a subshell, or NO_CODE
+    uint32_t code;
+    // offset of the text in the pool naming a job
+    uint32_t text;
+} cmd_t;
+
+typedef struct _prog_t {
+    insn_t *code;
+    size_t ncode;
+    size_t code_cap;
+    cmd_t *cmds;
+    size_t ncmds;
+    size_t cmds_cap;
+    word_t *words;
+    size_t nwords;
+    size_t words_cap;
+    redir_t *redirs;
+    size_t nredirs;
+    size_t redirs_cap;
+    char *pool;
+    size_t npool;
+    size_t pool_cap;
+    // slots of loops and cases needed by the interpreter
+    unsigned nslots;
+} prog_t;
+
+enum COMPILE { COMPILE_OK, COMPILE_INCOMPLETE, COMPILE_ERROR, };
+
+enum COMPILE compile(prog_t *prog, const char *src, size_t len, size_t *consumed);
+void prog_reset(prog_t *prog);
+void prog_free(prog_t *prog);
+
+/**
+ * word_text - Get the raw text of a word, which is terminated by '\0'.
+ */
+static inline const char *word_text(const prog_t *prog, word_t word)
+{
+    return prog->pool + word.off;
+}
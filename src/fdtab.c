@@ -0,0 +1,138 @@
+/**
+ * Description: The table of descriptors above standard error which commands
+ *              inherit: those opened by "exec N>file", those passed to the
+ *              shell, and those the shell redirects for itself for a while.
+ *              A forked stage closes every other descriptor of the shell, so
+ *              a descriptor in the table is given to commands by dup2 alone,
+ *              never opened again. The table is an array kept in order, as
+ *              it holds a few descriptors.
+ */
+#include "error.h"
+#include "fdtab.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int *table;
+static size_t nfds;
+static size_t cap;
+
+/**
+ * lower_bound - Return the index of the first descriptor not below fd.
+ */
+static size_t lower_bound(int fd)
+{
+    size_t lo = 0;
+    size_t hi = nfds;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (table[mid] < fd) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * fdtab_add - Add fd to the table.
+ */
+void fdtab_add(int fd)
+{
+    size_t i = lower_bound(fd);
+
+    if (i < nfds && table[i] == fd) {
+        return;
+    }
+    if (nfds == cap) {
+        cap = cap == 0 ? 8 : cap * 2;
+        int *tmp = realloc(table, cap * sizeof(*table));
+
+        if (tmp == NULL) {
+            unix_fatal("realloc error");
+        }
+        table = tmp;
+    }
+    memmove(table + i + 1, table + i, (nfds - i) * sizeof(*table));
+    table[i] = fd;
+    ++nfds;
+}
+
+/**
+ * fdtab_del - Remove fd from the table.
+ */
+void fdtab_del(int fd)
+{
+    size_t i = lower_bound(fd);
+
+    if (i < nfds && table[i] == fd) {
+        memmove(table + i, table + i + 1, (nfds - i - 1) * sizeof(*table));
+        --nfds;
+    }
+}
+
+/**
+ * fdtab_has - Return whether fd is in the table.
+ */
+bool fdtab_has(int fd)
+{
+    size_t i = lower_bound(fd);
+
+    return i < nfds && table[i] == fd;
+}
+
+/**
+ * fdtab_next - Return the lowest descriptor in the table not below fd, or -1.
+ */
+int fdtab_next(int fd)
+{
+    size_t i = lower_bound(fd);
+
+    return i < nfds ? table[i] : -1;
+}
+
+/**
+ * fdtab_inherit - Add descriptors above standard error which the shell is
+ *                 given without close-on-exec.
+ */
+void fdtab_inherit(void)
+{
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *entry = NULL;
+
+    if (dir == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        int fd = atoi(entry->d_name);
+        int flags = fd > 2 && fd != dirfd(dir) ? fcntl(fd, F_GETFD) : -1;
+
+        if (flags >= 0 && !(flags & FD_CLOEXEC)) {
+            fdtab_add(fd);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * fd_shell - Move fd, which the shell keeps for itself, to FD_SHELL or above.
+ *            Return the descriptor it's moved to, or fd if it can't be.
+ */
+int fd_shell(int fd)
+{
+    if (fd < 0 || fd >= FD_SHELL) {
+        return fd;
+    }
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, FD_SHELL);
+
+    if (high < 0) {
+        return fd;
+    }
+    close(fd);
+    return high;
+}
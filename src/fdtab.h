@@ -0,0 +1,17 @@
+/**
+ * Description: Declarations of the table of descriptors commands inherit.
+ */
+#pragma once
+
+#include <stdbool.h>
+
+// descriptors the shell keeps for itself are moved here or above, so those
+// users pick below it are free
+#define FD_SHELL 10
+
+void fdtab_add(int fd);
+void fdtab_del(int fd);
+bool fdtab_has(int fd);
+int fdtab_next(int fd);
+void fdtab_inherit(void);
+int fd_shell(int fd);
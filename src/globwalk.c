@@ -0,0 +1,532 @@
+/**
+ * Description: Pathname expansion. Directories are scanned with getdents64
+ *              relative to a directory fd by a pool of threads, each taking
+ *              work from its own deque and stealing from the others when it
+ *              runs out. Literal components are checked without scanning.
+ */
+#include "error.h"
+#include "globwalk.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// most threads scanning directories for "**"
+#define MAX_WORKERS 16
+// size of the buffer of getdents64
+#define DENTS_SIZE 32768
+
+// a directory to scan for a component of the pattern
+typedef struct _work_t {
+    // relative to the base directory, "" for itself
+    char *path;
+    unsigned comp;
+} work_t;
+
+typedef struct _deque_t {
+    pthread_mutex_t lock;
+    work_t *items;
+    // the owner takes from the tail, and thieves from the head
+    size_t head;
+    size_t tail;
+    size_t cap;
+} deque_t;
+
+typedef struct _walk_t {
+    char **comps;
+    unsigned ncomps;
+    // the pattern ends with '/', so only directories match
+    bool dir_only;
+    int base;
+    // literal leading components, which are the base directory
+    char *prefix;
+    size_t prefix_len;
+    deque_t *deques;
+    unsigned nworkers;
+    // work pushed but not done yet
+    atomic_size_t pending;
+} walk_t;
+
+typedef struct _worker_t {
+    walk_t *walk;
+    unsigned id;
+    pthread_t thread;
+    char **results;
+    size_t n;
+    size_t cap;
+} worker_t;
+
+static void scan(worker_t *worker, const char *path, unsigned comp);
+
+/**
+ * closed_bracket - Judge whether a bracket expression starting after '[' at s
+ *                  is closed by ']' in the same component. If it's not, '['
+ *                  is an ordinary character.
+ */
+static bool closed_bracket(const char *s)
+{
+    if (*s == '!' || *s == '^') {
+        ++s;
+    }
+    // a ']' first is in the set
+    if (*s == ']') {
+        ++s;
+    }
+    for (; *s != '\0' && *s != '/'; ++s) {
+        if (*s == '\\' && s[1] != '\0') {
+            ++s;
+        } else if (*s == ']') {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * is_literal - Judge whether a component of a pattern has no unescaped
+ *              pattern characters.
+ */
+static bool is_literal(const char *s)
+{
+    for (; *s != '\0'; ++s) {
+        if (*s == '\\' && s[1] != '\0') {
+            ++s;
+        } else if (*s == '*' || *s == '?' || (*s == '[' && closed_bracket(s + 1))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * glob_pattern - Judge whether pattern has unescaped pattern characters, so
+ *                that it's to be matched against directories at all.
+ */
+bool glob_pattern(const char *pattern)
+{
+    return !is_literal(pattern);
+}
+
+/**
+ * unescape - Remove backslashes quoting characters of s in place.
+ */
+static char *unescape(char *s)
+{
+    char *to = s;
+
+    for (const char *from = s; *from != '\0'; ++from) {
+        if (*from == '\\' && from[1] != '\0') {
+            ++from;
+        }
+        *to++ = *from;
+    }
+    *to = '\0';
+    return s;
+}
+
+/**
+ * join - Join a path relative to the base directory and a name.
+ */
+static char *join(const char *path, const char *name)
+{
+    size_t len = strlen(path);
+    size_t name_len = strlen(name);
+    char *joined = malloc(len + name_len + 2);
+
+    if (joined == NULL) {
+        unix_fatal("malloc error");
+    }
+    memcpy(joined, path, len);
+    if (len > 0) {
+        joined[len++] = '/';
+    }
+    memcpy(joined + len, name, name_len + 1);
+    return joined;
+}
+
+/**
+ * push_work - Push a directory to scan onto the deque of worker.
+ */
+static void push_work(worker_t *worker, char *path, unsigned comp)
+{
+    deque_t *deque = &worker->walk->deques[worker->id];
+
+    atomic_fetch_add(&worker->walk->pending, 1);
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->cap) {
+        if (deque->head > 0) {
+            memmove(deque->items, deque->items + deque->head,
+                    (deque->tail - deque->head) * sizeof(work_t));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            size_t cap = deque->cap == 0 ? 64 : deque->cap * 2;
+            work_t *items = realloc(deque->items, cap * sizeof(*items));
+
+            if (items == NULL) {
+                unix_fatal("realloc error");
+            }
+            deque->items = items;
+            deque->cap = cap;
+        }
+    }
+    deque->items[deque->tail].path = path;
+    deque->items[deque->tail++].comp = comp;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ * take_work - Take work from the tail of deque, or the head if steal is true.
+ */
+static bool take_work(deque_t *deque, bool steal, work_t *work)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        *work = steal ? deque->items[deque->head++] : deque->items[--deque->tail];
+        found = true;
+        if (deque->head == deque->tail) {
+            deque->head = deque->tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/**
+ * add_result - Add a path matched.
+ */
+static void add_result(worker_t *worker, const char *path, const char *name)
+{
+    walk_t *walk = worker->walk;
+    size_t len = strlen(path);
+    size_t name_len = strlen(name);
+    char *result = malloc(walk->prefix_len + len + name_len + 3);
+
+    if (result == NULL) {
+        unix_fatal("malloc error");
+    }
+    char *p = result;
+
+    memcpy(p, walk->prefix, walk->prefix_len);
+    p += walk->prefix_len;
+    memcpy(p, path, len);
+    p += len;
+    if (len > 0) {
+        *p++ = '/';
+    }
+    memcpy(p, name, name_len);
+    p += name_len;
+    if (walk->dir_only) {
+        *p++ = '/';
+    }
+    *p = '\0';
+    if (worker->n == worker->cap) {
+        worker->cap = worker->cap == 0 ? 64 : worker->cap * 2;
+        char **results = realloc(worker->results, worker->cap * sizeof(char *));
+
+        if (results == NULL) {
+            unix_fatal("realloc error");
+        }
+        worker->results = results;
+    }
+    worker->results[worker->n++] = result;
+}
+
+/**
+ * is_dir - Judge whether an entry of dirfd is a directory. Symbolic links are
+ *          followed only if follow is true.
+ */
+static bool is_dir(int dirfd, const char *name, unsigned char type, bool follow)
+{
+    struct stat st;
+
+    if (type == DT_DIR) {
+        return true;
+    } else if (type != DT_UNKNOWN && (type != DT_LNK || !follow)) {
+        return false;
+    }
+    return fstatat(dirfd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * match_entry - Match an entry of a directory against component comp.
+ */
+static void match_entry(worker_t *worker, int dirfd, const char *path,
+        const char *name, unsigned char type, unsigned comp)
+{
+    walk_t *walk = worker->walk;
+
+    if (fnmatch(walk->comps[comp], name, FNM_PERIOD) != 0) {
+        return;
+    }
+    if (comp + 1 == walk->ncomps) {
+        if (!walk->dir_only || is_dir(dirfd, name, type, true)) {
+            add_result(worker, path, name);
+        }
+    } else if (is_dir(dirfd, name, type, true)) {
+        push_work(worker, join(path, name), comp + 1);
+    }
+}
+
+/**
+ * scan_literal - Check a literal component without reading the directory.
+ */
+static void scan_literal(worker_t *worker, const char *path, unsigned comp)
+{
+    walk_t *walk = worker->walk;
+    char *joined = join(path, walk->comps[comp]);
+    const char *name = unescape(joined + (*path == '\0' ? 0 : strlen(path) + 1));
+    struct stat st;
+
+    if (fstatat(walk->base, joined, &st, 0) == 0) {
+        if (comp + 1 < walk->ncomps) {
+            if (S_ISDIR(st.st_mode)) {
+                scan(worker, joined, comp + 1);
+            }
+        } else if (!walk->dir_only || S_ISDIR(st.st_mode)) {
+            add_result(worker, path, name);
+        }
+    }
+    free(joined);
+}
+
+/**
+ * scan - Match entries of directory path against component comp.
+ */
+static void scan(worker_t *worker, const char *path, unsigned comp)
+{
+    walk_t *walk = worker->walk;
+    const char *pattern = walk->comps[comp];
+    bool globstar = strcmp(pattern, "**") == 0;
+
+    if (!globstar && is_literal(pattern)) {
+        scan_literal(worker, path, comp);
+        return;
+    }
+    int dirfd = openat(walk->base, *path == '\0' ? "." : path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char buf[DENTS_SIZE];
+    ssize_t n = 0;
+
+    if (dirfd < 0) {
+        return;
+    }
+    while ((n = getdents64(dirfd, buf, sizeof(buf))) > 0) {
+        for (ssize_t off = 0; off < n; ) {
+            struct dirent64 *entry = (struct dirent64 *) (buf + off);
+            const char *name = entry->d_name;
+
+            off += entry->d_reclen;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            if (!globstar) {
+                match_entry(worker, dirfd, path, name, entry->d_type, comp);
+                continue;
+            }
+            // "**" matches no directory too, but never hidden ones
+            if (comp + 1 < walk->ncomps) {
+                match_entry(worker, dirfd, path, name, entry->d_type, comp + 1);
+            } else if (name[0] != '.' && (!walk->dir_only || is_dir(dirfd, name, entry->d_type, true))) {
+                add_result(worker, path, name);
+            }
+            if (name[0] != '.' && is_dir(dirfd, name, entry->d_type, false)) {
+                push_work(worker, join(path, name), comp);
+            }
+        }
+    }
+    close(dirfd);
+}
+
+/**
+ * work - Run a worker until there's no work left anywhere.
+ */
+static void *work(void *arg)
+{
+    worker_t *worker = arg;
+    walk_t *walk = worker->walk;
+    work_t item;
+
+    while (true) {
+        bool found = take_work(&walk->deques[worker->id], false, &item);
+
+        for (unsigned i = 1; !found && i < walk->nworkers; ++i) {
+            found = take_work(&walk->deques[(worker->id + i) % walk->nworkers], true, &item);
+        }
+        if (found) {
+            scan(worker, item.path, item.comp);
+            free(item.path);
+            atomic_fetch_sub(&walk->pending, 1);
+        } else if (atomic_load(&walk->pending) == 0) {
+            return NULL;
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * split_pattern - Split pattern into components of walk, the leading literal
+ *                 ones of which make the prefix. Return false if there's no
+ *                 pattern character at all.
+ */
+static bool split_pattern(walk_t *walk, char *pattern)
+{
+    size_t len = strlen(pattern);
+    char *save = NULL;
+
+    walk->comps = malloc((len / 2 + 2) * sizeof(char *));
+    walk->prefix = malloc(len + 2);
+    if (walk->comps == NULL || walk->prefix == NULL) {
+        unix_fatal("malloc error");
+    }
+    walk->dir_only = len > 0 && pattern[len-1] == '/';
+    walk->prefix_len = 0;
+    if (pattern[0] == '/') {
+        walk->prefix[walk->prefix_len++] = '/';
+    }
+    for (char *comp = strtok_r(pattern, "/", &save); comp != NULL; comp = strtok_r(NULL, "/", &save)) {
+        if (walk->ncomps == 0 && is_literal(comp)) {
+            size_t n = strlen(unescape(comp));
+
+            memcpy(walk->prefix + walk->prefix_len, comp, n);
+            walk->prefix_len += n;
+            walk->prefix[walk->prefix_len++] = '/';
+        } else if (strcmp(comp, "**") != 0 || walk->ncomps == 0
+                || strcmp(walk->comps[walk->ncomps-1], "**") != 0) {
+            // "**/**" is the same as "**"
+            walk->comps[walk->ncomps++] = comp;
+        }
+    }
+    walk->prefix[walk->prefix_len] = '\0';
+    return walk->ncomps > 0;
+}
+
+/**
+ * compare_path - Compare paths for qsort.
+ */
+static int compare_path(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * walk_tree - Run workers of walk from the base directory, and collect paths
+ *             matched into *paths. Return the number of them.
+ */
+static size_t walk_tree(walk_t *walk, char ***paths)
+{
+    deque_t deques[walk->nworkers];
+    worker_t workers[walk->nworkers];
+    sigset_t all;
+    sigset_t prev;
+    size_t n = 0;
+
+    memset(deques, 0, sizeof(deques));
+    memset(workers, 0, sizeof(workers));
+    walk->deques = deques;
+    for (unsigned i = 0; i < walk->nworkers; ++i) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        workers[i].walk = walk;
+        workers[i].id = i;
+    }
+    push_work(&workers[0], strdup(""), 0);
+    // signals are handled by the shell, never by workers
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &prev);
+    for (unsigned i = 1; i < walk->nworkers; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+            unix_fatal("pthread_create error");
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+    work(&workers[0]);
+    for (unsigned i = 1; i < walk->nworkers; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (unsigned i = 0; i < walk->nworkers; ++i) {
+        n += workers[i].n;
+    }
+    if (n > 0 && (*paths = malloc(n * sizeof(char *))) == NULL) {
+        unix_fatal("malloc error");
+    }
+    n = 0;
+    for (unsigned i = 0; i < walk->nworkers; ++i) {
+        if (workers[i].n > 0) {
+            memcpy(*paths + n, workers[i].results, workers[i].n * sizeof(char *));
+            n += workers[i].n;
+        }
+        free(workers[i].results);
+        free(deques[i].items);
+        pthread_mutex_destroy(&deques[i].lock);
+    }
+    return n;
+}
+
+/**
+ * glob_paths - Get paths matching pattern, in which pattern characters are
+ *              quoted by backslashes. Paths are sorted and kept in *paths,
+ *              which should be freed by free_paths. Return the number of them.
+ */
+size_t glob_paths(const char *pattern, char ***paths)
+{
+    walk_t walk = {0};
+    char *copy = strdup(pattern);
+    size_t n = 0;
+
+    *paths = NULL;
+    if (copy == NULL) {
+        unix_fatal("strdup error");
+    }
+    if (split_pattern(&walk, copy)) {
+        walk.base = open(walk.prefix_len == 0 ? "." : walk.prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (walk.ncomps > 0 && walk.base >= 0) {
+        // a single level is scanned by the shell itself
+        walk.nworkers = 1;
+        if (strstr(pattern, "**") != NULL) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+            walk.nworkers = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : cpus;
+        }
+        n = walk_tree(&walk, paths);
+        close(walk.base);
+        if (n > 1) {
+            qsort(*paths, n, sizeof(char *), compare_path);
+        }
+    }
+    // "**" may reach a path in more than one way
+    size_t unique = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        if (unique > 0 && strcmp((*paths)[unique-1], (*paths)[i]) == 0) {
+            free((*paths)[i]);
+        } else {
+            (*paths)[unique++] = (*paths)[i];
+        }
+    }
+    free(walk.comps);
+    free(walk.prefix);
+    free(copy);
+    return unique;
+}
+
+/**
+ * free_paths - Free paths got from glob_paths.
+ */
+void free_paths(char **paths, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        free(paths[i]);
+    }
+    free(paths);
+}
@@ -0,0 +1,12 @@
+/**
+ * Description: Declarations of pathname expansion, with "**" matching any
+ *              number of directories.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+bool glob_pattern(const char *pattern);
+size_t glob_paths(const char *pattern, char ***paths);
+void free_paths(char **paths, size_t n);
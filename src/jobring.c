@@ -0,0 +1,165 @@
+/**
+ * Description: The last output of background jobs kept in memory, turned on
+ *              by "ring SIZE". Standard output and standard error of such a
+ *              job go into a pipe the shell keeps, which the pump reads
+ *              straight into a ring of SIZE bytes for the job. So
+ *              a job takes no more memory however much it writes, and never
+ *              touches the disk. "jobs -o" prints what's in a ring. Rings of
+ *              jobs whose output is over are kept for the last KEPT of them.
+ */
+#include "error.h"
+#include "fdtab.h"
+#include "jobring.h"
+#include "pump.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define KEPT 16
+
+typedef struct _jobring_t {
+    // the read end of its pipe, or -1 once its output is over
+    pump_src_t src;
+    // the last process of the job
+    pid_t pid;
+    char *data;
+    size_t size;
+    // bytes ever written to it
+    unsigned long long total;
+    struct _jobring_t *next;
+} jobring_t;
+
+// the newest first
+static jobring_t *rings;
+// rings whose output is over
+static unsigned over;
+
+/**
+ * trim - Free the oldest rings whose output is over but the last KEPT.
+ */
+static void trim(void)
+{
+    while (over > KEPT) {
+        jobring_t **oldest = NULL;
+
+        for (jobring_t **p = &rings; *p != NULL; p = &(*p)->next) {
+            if ((*p)->src.fd < 0) {
+                oldest = p;
+            }
+        }
+        jobring_t *ring = *oldest;
+
+        *oldest = ring->next;
+        free(ring->data);
+        free(ring);
+        --over;
+    }
+}
+
+/**
+ * fill - Read what's in the pipe of ring into it, over its oldest bytes, or
+ *        end it if the output is over.
+ */
+static void fill(pump_src_t *src)
+{
+    jobring_t *ring = (jobring_t *) src;
+    size_t pos = ring->total % ring->size;
+    struct iovec iov[2] = {{ring->data + pos, ring->size - pos}, {ring->data, pos}};
+    ssize_t n = readv(src->fd, iov, pos == 0 ? 1 : 2);
+
+    if (n > 0) {
+        ring->total += n;
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        pump_del(src);
+        close(src->fd);
+        src->fd = -1;
+        ++over;
+        trim();
+    }
+}
+
+/**
+ * jobring_pipe - Open a pipe for output of a job into a ring. Return the
+ *                write end for the job, and set the read end in *fd.
+ */
+int jobring_pipe(int *fd)
+{
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        unix_fatal("pipe error");
+    }
+    *fd = fd_shell(fds[0]);
+    return fds[1];
+}
+
+/**
+ * jobring_add - Read fd, the read end of jobring_pipe, into a ring of size
+ *               bytes for the job whose last process is pid.
+ */
+void jobring_add(int fd, pid_t pid, size_t size)
+{
+    jobring_t *ring = malloc(sizeof(*ring));
+
+    // pages of the ring are only taken as they are written
+    if (ring == NULL || (ring->data = malloc(size)) == NULL) {
+        unix_fatal("malloc error");
+    }
+    ring->src = (pump_src_t) {fd, fill};
+    ring->pid = pid;
+    ring->size = size;
+    ring->total = 0;
+    pump_lock();
+    ring->next = rings;
+    rings = ring;
+    pump_add(&ring->src);
+    pump_unlock();
+}
+
+/**
+ * jobring_copy - Copy what's in the ring of the job whose last process is pid
+ *                into *data, which is to be freed, and its length into *len.
+ *                Return false if the job has no ring.
+ */
+bool jobring_copy(pid_t pid, char **data, size_t *len)
+{
+    jobring_t *ring = NULL;
+
+    pump_lock();
+    for (ring = rings; ring != NULL && ring->pid != pid; ring = ring->next) {
+    }
+    if (ring != NULL) {
+        size_t pos = ring->total % ring->size;
+
+        *len = ring->total < ring->size ? ring->total : ring->size;
+        if ((*data = malloc(*len + 1)) == NULL) {
+            unix_fatal("malloc error");
+        }
+        if (ring->total <= ring->size) {
+            memcpy(*data, ring->data, *len);
+        } else {
+            memcpy(*data, ring->data + pos, ring->size - pos);
+            memcpy(*data + ring->size - pos, ring->data, pos);
+        }
+    }
+    pump_unlock();
+    return ring != NULL;
+}
+
+/**
+ * jobring_reset - Stop filling rings of the shell in a forked child, where the
+ *                 pump doesn't run. What's in them is kept for "jobs -o" in a
+ *                 pipeline.
+ */
+void jobring_reset(void)
+{
+    for (jobring_t *ring = rings; ring != NULL; ring = ring->next) {
+        if (ring->src.fd >= 0) {
+            close(ring->src.fd);
+            ring->src.fd = -1;
+        }
+    }
+}
@@ -0,0 +1,14 @@
+/**
+ * Description: Declarations of the last output of background jobs kept in
+ *              memory.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+int jobring_pipe(int *fd);
+void jobring_add(int fd, pid_t pid, size_t size);
+bool jobring_copy(pid_t pid, char **data, size_t *len);
+void jobring_reset(void);
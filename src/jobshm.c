@@ -0,0 +1,187 @@
+/**
+ * Description: The table of jobs of an interactive shell published in shared
+ *              memory, as a file qsh-UID-PID.jobs in $XDG_RUNTIME_DIR or in
+ *              /dev/shm, for monitors to map read-only and see what each
+ *              shell is running without signalling or tracing it. The shell
+ *              copies a job into its slot whenever the job changes, which
+ *              takes a few stores, and a counter in the header makes a
+ *              seqlock: it's odd while jobs are written, and a reader retries
+ *              a copy taken while it was odd or changed.
+ *
+ *              The handler of SIGCHLD changes jobs too. A change it makes
+ *              while the shell is writing is left to the shell, which writes
+ *              all jobs again before it ends, so there's one writer at once.
+ */
+#include "jobshm.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static jobshm_t *table;
+static size_t table_size;
+static const job_t *source;
+static char path[PATH_MAX];
+// the shell which made the file, and removes it on exit
+static pid_t owner;
+static volatile sig_atomic_t writing;
+static volatile sig_atomic_t pending;
+
+/**
+ * put - Copy job i into its slot.
+ */
+static void put(size_t i)
+{
+    const job_t *job = &source[i];
+    jobshm_job_t *slot = &table->jobs[i];
+    size_t len = strnlen(job->name, JOBSHM_NAME - 1);
+
+    slot->jid = job->pid == 0 ? 0 : job->jid;
+    slot->pgid = job->pid;
+    slot->last = job->last;
+    slot->state = job->state;
+    slot->procs = job->num;
+    slot->start = job->start;
+    // the name ends with the newline it's printed with
+    if (len > 0 && job->name[len-1] == '\n') {
+        --len;
+    }
+    memcpy(slot->name, job->name, len);
+    memset(slot->name + len, 0, JOBSHM_NAME - len);
+}
+
+/**
+ * publish - Copy job i into its slot, or all jobs if i is negative, under
+ *           the seqlock.
+ */
+static void publish(long i)
+{
+    do {
+        if (writing) {
+            pending = true;
+            return;
+        }
+        writing = true;
+        pending = false;
+        uint32_t seq = table->seq;
+
+        __atomic_store_n(&table->seq, seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        if (i >= 0) {
+            put(i);
+        } else {
+            for (size_t j = 0; j < table->njobs; ++j) {
+                put(j);
+            }
+        }
+        __atomic_store_n(&table->seq, seq + 2, __ATOMIC_RELEASE);
+        writing = false;
+        i = -1;
+    } while (pending);
+}
+
+/**
+ * jobshm_open - Publish the n jobs of the shell, updated by jobshm_update.
+ *               Return false if the file can't be made.
+ */
+bool jobshm_open(const job_t jobs[], size_t n)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    int fd = -1;
+
+    if (dir == NULL || dir[0] == '\0') {
+        dir = "/dev/shm";
+    }
+    snprintf(path, sizeof(path), "%s/qsh-%d-%d.jobs", dir, (int) getuid(), (int) getpid());
+    // one left by a shell of the same pid is stale, and one of another user
+    // won't be opened
+    unlink(path);
+    table_size = sizeof(*table) + n * sizeof(*table->jobs);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644)) < 0) {
+        return false;
+    }
+    if (ftruncate(fd, table_size) < 0
+            || (table = mmap(NULL, table_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        table = NULL;
+        close(fd);
+        unlink(path);
+        return false;
+    }
+    close(fd);
+    memcpy(table->magic, JOBSHM_MAGIC, sizeof(JOBSHM_MAGIC));
+    table->version = JOBSHM_VERSION;
+    table->njobs = n;
+    table->pid = getpid();
+    source = jobs;
+    owner = getpid();
+    publish(-1);
+    atexit(jobshm_close);
+    return true;
+}
+
+/**
+ * jobshm_update - Publish job i after it has changed.
+ */
+void jobshm_update(size_t i)
+{
+    if (table != NULL) {
+        publish(i);
+    }
+}
+
+/**
+ * jobshm_read - Copy jobs of a table shm mapped by a reader into jobs, which
+ *               has room for shm->njobs of them. Return false if the shell
+ *               kept writing them.
+ */
+bool jobshm_read(const jobshm_t *shm, jobshm_job_t jobs[])
+{
+    for (int tries = 0; tries < 1000; ++tries) {
+        uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+
+        if (seq % 2 == 1) {
+            continue;
+        }
+        memcpy(jobs, shm->jobs, shm->njobs * sizeof(*jobs));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * jobshm_path - Return the path of the table, or NULL if it's not published.
+ */
+const char *jobshm_path(void)
+{
+    return table == NULL ? NULL : path;
+}
+
+/**
+ * jobshm_close - Remove the table when the shell which made it exits.
+ */
+void jobshm_close(void)
+{
+    if (owner == getpid()) {
+        unlink(path);
+        owner = 0;
+    }
+    jobshm_reset();
+}
+
+/**
+ * jobshm_reset - Stop publishing jobs in a forked child, which are the
+ *                shell's.
+ */
+void jobshm_reset(void)
+{
+    if (table != NULL) {
+        munmap(table, table_size);
+        table = NULL;
+    }
+}
@@ -0,0 +1,47 @@
+/**
+ * Description: Declarations of the table of jobs of an interactive shell
+ *              published in shared memory, and its layout for readers.
+ */
+#pragma once
+
+#include "main.h"
+#include <stdint.h>
+
+#define JOBSHM_MAGIC "qshjobs"
+#define JOBSHM_VERSION 1
+#define JOBSHM_NAME 256
+
+// a job as readers see it
+typedef struct _jobshm_job_t {
+    // 0 for a free slot
+    uint32_t jid;
+    // the group of the job, and its last process
+    int32_t pgid;
+    int32_t last;
+    // enum STATE
+    int32_t state;
+    // processes of it still running
+    uint32_t procs;
+    uint32_t unused;
+    // when it started in nanoseconds of CLOCK_REALTIME
+    int64_t start;
+    char name[JOBSHM_NAME];
+} jobshm_job_t;
+
+// the file, named qsh-UID-PID.jobs
+typedef struct _jobshm_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t njobs;
+    int32_t pid;
+    // odd while jobs are being written, so a copy taken meanwhile is retried
+    uint32_t seq;
+    jobshm_job_t jobs[];
+} jobshm_t;
+
+bool jobshm_open(const job_t jobs[], size_t n);
+void jobshm_update(size_t i);
+bool jobshm_read(const jobshm_t *shm, jobshm_job_t jobs[]);
+const char *jobshm_path(void);
+void jobshm_close(void);
+void jobshm_reset(void);
@@ -0,0 +1,263 @@
+/**
+ * Description: Statuses of background jobs kept until they are waited for,
+ *              in a table hashed by the pid of the last process of each job.
+ *              Jobs are also queued in the order they finish, so waiting for
+ *              any of many jobs takes no scan of them. The table only grows
+ *              when a job is added, so jobs can be marked done by a handler
+ *              of SIGCHLD as long as it's blocked meanwhile.
+ */
+#include "error.h"
+#include "jobstat.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+// a slot never used, and one whose job has been waited for
+#define EMPTY 0
+#define REMOVED (-1)
+
+typedef struct _jobstat_t {
+    pid_t pid;
+    unsigned jid;
+    // the status once it's done, or JOBSTAT_RUNNING
+    int status;
+} jobstat_t;
+
+static jobstat_t *table;
+// slots of the table and the ring, a power of 2
+static size_t cap;
+// slots not empty, including removed ones
+static size_t used;
+static size_t live;
+static unsigned running;
+static unsigned next_jid;
+// pids of jobs in the order they finish, some of which may be waited for
+static pid_t *ring;
+static size_t head;
+static size_t tail;
+
+/**
+ * slot - Return the first slot to probe for pid.
+ */
+static size_t slot(pid_t pid)
+{
+    return ((uint32_t) pid * 2654435761u) & (cap - 1);
+}
+
+/**
+ * find - Find the job of pid, or return NULL.
+ */
+static jobstat_t *find(pid_t pid)
+{
+    if (cap == 0) {
+        return NULL;
+    }
+    for (size_t i = slot(pid); table[i].pid != EMPTY; i = (i + 1) & (cap - 1)) {
+        if (table[i].pid == pid) {
+            return &table[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * grow - Rehash the table, doubling it if it's crowded with jobs rather than
+ *        removed slots.
+ */
+static void grow(void)
+{
+    jobstat_t *old = table;
+    size_t old_cap = cap;
+    pid_t *old_ring = ring;
+    size_t n = 0;
+
+    cap = cap == 0 ? 64 : live * 4 >= cap ? cap * 2 : cap;
+    table = calloc(cap, sizeof(*table));
+    ring = malloc(cap * sizeof(*ring));
+    if (table == NULL || ring == NULL) {
+        unix_fatal("malloc error");
+    }
+    for (size_t i = 0; i < old_cap; ++i) {
+        if (old[i].pid != EMPTY && old[i].pid != REMOVED) {
+            size_t j = slot(old[i].pid);
+
+            while (table[j].pid != EMPTY) {
+                j = (j + 1) & (cap - 1);
+            }
+            table[j] = old[i];
+        }
+    }
+    for (size_t i = head; i != tail; ++i) {
+        ring[n++] = old_ring[i & (old_cap - 1)];
+    }
+    used = live;
+    head = 0;
+    tail = n;
+    free(old);
+    free(old_ring);
+}
+
+/**
+ * jobstat_add - Remember a background job whose last process is pid. Return
+ *               its job number, which counts from 1 when no job is left.
+ *               Call it with SIGCHLD blocked.
+ */
+unsigned jobstat_add(pid_t pid)
+{
+    jobstat_t *js = find(pid);
+
+    if (live == 0) {
+        next_jid = 0;
+    }
+    if (js == NULL) {
+        if ((used + 1) * 2 > cap) {
+            grow();
+        }
+        size_t i = slot(pid);
+
+        while (table[i].pid != EMPTY && table[i].pid != REMOVED) {
+            i = (i + 1) & (cap - 1);
+        }
+        js = &table[i];
+        used += js->pid == EMPTY;
+        ++live;
+    } else if (js->status == JOBSTAT_RUNNING) {
+        --running;
+    }
+    js->pid = pid;
+    js->jid = ++next_jid;
+    js->status = JOBSTAT_RUNNING;
+    ++running;
+    return js->jid;
+}
+
+/**
+ * compact - Drop pids of jobs waited for already from the ring.
+ */
+static void compact(void)
+{
+    size_t n = head;
+
+    for (size_t i = head; i != tail; ++i) {
+        jobstat_t *js = find(ring[i & (cap - 1)]);
+
+        if (js != NULL && js->status != JOBSTAT_RUNNING) {
+            ring[n++ & (cap - 1)] = ring[i & (cap - 1)];
+        }
+    }
+    tail = n;
+}
+
+/**
+ * jobstat_done - Keep status of the job whose last process pid has finished.
+ *                Return false if it's not a background job. It's safe in a
+ *                handler of SIGCHLD.
+ */
+bool jobstat_done(pid_t pid, int status)
+{
+    jobstat_t *js = find(pid);
+
+    if (js == NULL || js->status != JOBSTAT_RUNNING) {
+        return false;
+    }
+    js->status = status;
+    --running;
+    if (tail - head == cap) {
+        compact();
+    }
+    ring[tail++ & (cap - 1)] = pid;
+    return true;
+}
+
+/**
+ * remove_job - Forget js.
+ */
+static void remove_job(jobstat_t *js)
+{
+    js->pid = REMOVED;
+    --live;
+}
+
+/**
+ * jobstat_get - Return the status of the job whose last process is pid, and
+ *               forget it if it's done. Return JOBSTAT_RUNNING if it's not
+ *               done, or JOBSTAT_UNKNOWN if it's not a background job.
+ */
+int jobstat_get(pid_t pid)
+{
+    jobstat_t *js = find(pid);
+
+    if (js == NULL) {
+        return JOBSTAT_UNKNOWN;
+    }
+    int status = js->status;
+
+    if (status != JOBSTAT_RUNNING) {
+        remove_job(js);
+    }
+    return status;
+}
+
+/**
+ * jobstat_forget - Forget the job whose last process is pid, which is not in
+ *                  background any more. It's safe in a handler of SIGCHLD.
+ */
+void jobstat_forget(pid_t pid)
+{
+    jobstat_t *js = find(pid);
+
+    if (js != NULL) {
+        running -= js->status == JOBSTAT_RUNNING;
+        remove_job(js);
+    }
+}
+
+/**
+ * jobstat_next - Get the status of the job which finished first of those not
+ *                waited for, and forget it. Return the pid of its last
+ *                process, 0 if none has finished, or -1 if there's no job.
+ */
+pid_t jobstat_next(int *status)
+{
+    while (head != tail) {
+        pid_t pid = ring[head++ & (cap - 1)];
+        jobstat_t *js = find(pid);
+
+        // a pid waited for already, or reused by a job running now
+        if (js != NULL && js->status != JOBSTAT_RUNNING) {
+            *status = js->status;
+            remove_job(js);
+            return pid;
+        }
+    }
+    return running > 0 ? 0 : -1;
+}
+
+/**
+ * jobstat_find - Return the pid of the last process of job jid, or 0.
+ */
+pid_t jobstat_find(unsigned jid)
+{
+    for (size_t i = 0; i < cap; ++i) {
+        if (table[i].pid != EMPTY && table[i].pid != REMOVED && table[i].jid == jid) {
+            return table[i].pid;
+        }
+    }
+    return 0;
+}
+
+/**
+ * jobstat_clear - Forget every job.
+ */
+void jobstat_clear(void)
+{
+    free(table);
+    free(ring);
+    table = NULL;
+    ring = NULL;
+    cap = 0;
+    used = 0;
+    live = 0;
+    running = 0;
+    head = 0;
+    tail = 0;
+}
@@ -0,0 +1,20 @@
+/**
+ * Description: Declarations of statuses of background jobs kept until they
+ *              are waited for.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// what jobstat_get returns for a job not known, or still running
+#define JOBSTAT_UNKNOWN (-2)
+#define JOBSTAT_RUNNING (-1)
+
+unsigned jobstat_add(pid_t pid);
+bool jobstat_done(pid_t pid, int status);
+int jobstat_get(pid_t pid);
+void jobstat_forget(pid_t pid);
+pid_t jobstat_next(int *status);
+pid_t jobstat_find(unsigned jid);
+void jobstat_clear(void);
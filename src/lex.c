@@ -0,0 +1,403 @@
+/**
+ * Description: The lexer splitting source into words and operators. Quotes
+ *              and substitutions are kept in words and removed on expansion.
+ *              Runs of ordinary characters are skipped 32 or 16 bytes at a
+ *              time with AVX2 or SSE2 where they're available.
+ */
+#include "lex.h"
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+// classes of characters stopping a scan
+enum CLASS { C_WORD, C_DQUOTE, C_BQUOTE, C_PAREN, C_BRACE, C_NUM, };
+
+typedef struct _class_t {
+    const char *chars;
+    // bit of each high nibble, and bits of high nibbles of each low nibble
+    uint8_t hi[16];
+    uint8_t lo[16];
+} class_t;
+
+static class_t classes[C_NUM] = {
+    {" \t\n;&|<>()\\'\"`$", {0}, {0}},
+    {"\"\\$`", {0}, {0}},
+    {"`\\", {0}, {0}},
+    {"()\\'\"`$", {0}, {0}},
+    {"{}\\'\"`$", {0}, {0}},
+};
+// bit of each class for every character
+static uint8_t members[256];
+
+static size_t scan_scalar(const char *src, size_t pos, size_t len, enum CLASS cl);
+static size_t (*scan)(const char *src, size_t pos, size_t len, enum CLASS cl) = scan_scalar;
+
+/**
+ * scan_scalar - Find the first character of class cl from pos on. Return len
+ *               if there's none.
+ */
+static size_t scan_scalar(const char *src, size_t pos, size_t len, enum CLASS cl)
+{
+    while (pos < len && !(members[(unsigned char) src[pos]] & (1 << cl))) {
+        ++pos;
+    }
+    return pos;
+}
+
+#ifdef __SSE2__
+/**
+ * scan_sse2 - Find the first character of class cl comparing 16 bytes with
+ *             each character of it at a time.
+ */
+static size_t scan_sse2(const char *src, size_t pos, size_t len, enum CLASS cl)
+{
+    const char *chars = classes[cl].chars;
+    size_t n = strlen(chars);
+    __m128i set[16];
+
+    for (size_t i = 0; i < n; ++i) {
+        set[i] = _mm_set1_epi8(chars[i]);
+    }
+    while (pos + 16 <= len) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (src + pos));
+        __m128i hits = _mm_setzero_si128();
+
+        for (size_t i = 0; i < n; ++i) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, set[i]));
+        }
+        unsigned mask = _mm_movemask_epi8(hits);
+
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+    return scan_scalar(src, pos, len, cl);
+}
+
+/**
+ * scan_avx2 - Find the first character of class cl looking up both nibbles
+ *             of 32 bytes at a time with shuffles.
+ */
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *src, size_t pos, size_t len, enum CLASS cl)
+{
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) classes[cl].lo));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) classes[cl].hi));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+
+    while (pos + 32 <= len) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (src + pos));
+        __m256i low = _mm256_shuffle_epi8(lo, _mm256_and_si256(block, nibble));
+        __m256i high = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble));
+        __m256i misses = _mm256_cmpeq_epi8(_mm256_and_si256(low, high), zero);
+        unsigned mask = ~(unsigned) _mm256_movemask_epi8(misses);
+
+        if (mask != 0) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 32;
+    }
+    return scan_sse2(src, pos, len, cl);
+}
+#endif
+
+/**
+ * init_classes - Build tables of classes and choose the fastest scanner
+ *                before main runs.
+ */
+__attribute__((constructor))
+static void init_classes(void)
+{
+    for (int cl = 0; cl < C_NUM; ++cl) {
+        class_t *class = &classes[cl];
+        // high nibbles seen, each of which gets a bit
+        int groups[16];
+        int ngroups = 0;
+
+        memset(groups, -1, sizeof(groups));
+        for (const char *p = class->chars; *p != '\0'; ++p) {
+            unsigned char ch = *p;
+
+            members[ch] |= 1 << cl;
+            if (groups[ch>>4] < 0) {
+                groups[ch>>4] = ngroups++;
+                class->hi[ch>>4] = 1 << groups[ch>>4];
+            }
+            class->lo[ch&0xf] |= 1 << groups[ch>>4];
+        }
+    }
+#ifdef __SSE2__
+    scan = scan_sse2;
+    // constructors may run before the one filling what cpu_supports reads
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan = scan_avx2;
+    }
+#endif
+}
+
+/**
+ * skip_dquote - Skip a string in double quotes beginning at pos.
+ */
+static size_t skip_dquote(const char *src, size_t len, size_t pos)
+{
+    for (++pos; (pos = scan(src, pos, len, C_DQUOTE)) < len; ) {
+        switch (src[pos]) {
+        case '\"':
+            return pos + 1;
+        case '\\':
+            pos += 2;
+            break;
+        case '$':
+        case '`':
+            if ((pos = lex_skip(src, len, pos)) == LEX_OPEN) {
+                return LEX_OPEN;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return LEX_OPEN;
+}
+
+/**
+ * skip_nested - Skip text between open and close, which may nest, beginning
+ *               at pos pointing to open.
+ */
+static size_t skip_nested(const char *src, size_t len, size_t pos, char open, char close)
+{
+    enum CLASS cl = open == '(' ? C_PAREN : C_BRACE;
+    int depth = 0;
+
+    while ((pos = scan(src, pos, len, cl)) < len) {
+        char ch = src[pos];
+
+        if (ch == open) {
+            ++depth;
+            ++pos;
+        } else if (ch == close) {
+            ++pos;
+            if (--depth == 0) {
+                return pos;
+            }
+        } else if ((pos = lex_skip(src, len, pos)) == LEX_OPEN) {
+            return LEX_OPEN;
+        }
+    }
+    return LEX_OPEN;
+}
+
+/**
+ * lex_skip - Skip a quoted string, an escaped character or a substitution
+ *            beginning at pos. Return the position after it, or LEX_OPEN if
+ *            it's not closed.
+ */
+size_t lex_skip(const char *src, size_t len, size_t pos)
+{
+    switch (src[pos]) {
+    case '\\':
+        return pos + 2 <= len ? pos + 2 : LEX_OPEN;
+    case '\'': {
+        const char *quote = memchr(src + pos + 1, '\'', len - pos - 1);
+
+        return quote == NULL ? LEX_OPEN : (size_t) (quote - src) + 1;
+    } case '\"':
+        return skip_dquote(src, len, pos);
+    case '`':
+        for (++pos; (pos = scan(src, pos, len, C_BQUOTE)) < len; pos += 2) {
+            if (src[pos] == '`') {
+                return pos + 1;
+            }
+        }
+        return LEX_OPEN;
+    case '$':
+        if (pos + 1 < len && src[pos+1] == '(') {
+            return skip_nested(src, len, pos + 1, '(', ')');
+        } else if (pos + 1 < len && src[pos+1] == '{') {
+            return skip_nested(src, len, pos + 1, '{', '}');
+        }
+        return pos + 1;
+    default:
+        return pos + 1;
+    }
+}
+
+/**
+ * lex_init - Initialize a lexer for source.
+ */
+void lex_init(lexer_t *lx, const char *src, size_t len)
+{
+    lx->src = src;
+    lx->len = len;
+    lx->pos = 0;
+    lx->incomplete = false;
+}
+
+/**
+ * lex_redirect - Get a redirect operator at pos of lexer.
+ */
+static enum TOKEN lex_redirect(lexer_t *lx, token_t *tok)
+{
+    const char *s = lx->src + lx->pos;
+    bool more = lx->pos + 1 < lx->len;
+
+    if (s[0] == '<' && more && s[1] == '<') {
+        bool strip = lx->pos + 2 < lx->len && s[2] == '-';
+
+        tok->redir = strip ? R_HEREDOC_STRIP : R_HEREDOC;
+        lx->pos += strip ? 3 : 2;
+        return tok->type = T_REDIR;
+    } else if (s[0] == '<') {
+        tok->redir = more && s[1] == '&' ? R_DUPIN : R_IN;
+    } else if (more && s[1] == '>') {
+        tok->redir = R_APPEND;
+    } else if (more && s[1] == '&') {
+        tok->redir = R_DUPOUT;
+    } else {
+        // ">|" is the same as '>' since there's no noclobber, but it may
+        // write a rotating log
+        tok->redir = more && s[1] == '|' ? R_CLOBBER : R_OUT;
+    }
+    lx->pos += tok->redir == R_IN || tok->redir == R_OUT ? 1 : 2;
+    return tok->type = T_REDIR;
+}
+
+/**
+ * lex_next - Get the next token. T_ERROR is returned when source ends inside
+ *            a word, which sets incomplete.
+ */
+enum TOKEN lex_next(lexer_t *lx, token_t *tok)
+{
+    const char *src = lx->src;
+
+    while (lx->pos < lx->len) {
+        char ch = src[lx->pos];
+
+        if (ch == ' ' || ch == '\t') {
+            ++lx->pos;
+        } else if (ch == '\\' && lx->pos + 1 < lx->len && src[lx->pos+1] == '\n') {
+            // line continuation
+            lx->pos += 2;
+        } else if (ch == '#') {
+            const char *newline = memchr(src + lx->pos, '\n', lx->len - lx->pos);
+
+            lx->pos = newline == NULL ? lx->len : (size_t) (newline - src);
+        } else {
+            break;
+        }
+    }
+    tok->off = lx->pos;
+    tok->fd = -1;
+    tok->quoted = false;
+    if (lx->pos >= lx->len) {
+        tok->len = 0;
+        return tok->type = T_EOF;
+    }
+    const char *s = src + lx->pos;
+    bool more = lx->pos + 1 < lx->len;
+
+    switch (s[0]) {
+    case '\n':
+        tok->type = T_NEWLINE;
+        break;
+    case ';':
+        tok->type = more && s[1] == ';' ? T_DSEMI : T_SEMI;
+        break;
+    case '&':
+        tok->type = more && s[1] == '&' ? T_AND : T_AMP;
+        break;
+    case '|':
+        tok->type = more && s[1] == '|' ? T_OR : T_PIPE;
+        break;
+    case '(':
+        tok->type = T_LPAREN;
+        break;
+    case ')':
+        tok->type = T_RPAREN;
+        break;
+    case '<':
+    case '>':
+        lex_redirect(lx, tok);
+        tok->len = lx->pos - tok->off;
+        return T_REDIR;
+    default: {
+        size_t pos = lx->pos;
+        size_t digits = 0;
+
+        while ((pos = scan(src, pos, lx->len, C_WORD)) < lx->len) {
+            char c = src[pos];
+
+            if (c != '\\' && c != '\'' && c != '\"' && c != '`' && c != '$') {
+                break;
+            }
+            tok->quoted = tok->quoted || c != '$';
+            if ((pos = lex_skip(src, lx->len, pos)) == LEX_OPEN) {
+                lx->incomplete = true;
+                lx->pos = lx->len;
+                return tok->type = T_ERROR;
+            }
+        }
+        while (lx->pos + digits < pos && src[lx->pos+digits] >= '0' && src[lx->pos+digits] <= '9') {
+            ++digits;
+        }
+        // a number right before '<' or '>' is a file descriptor
+        if (digits > 0 && digits == pos - lx->pos && digits < 5
+                && pos < lx->len && (src[pos] == '<' || src[pos] == '>')) {
+            int fd = 0;
+
+            for (size_t i = lx->pos; i < pos; ++i) {
+                fd = fd * 10 + src[i] - '0';
+            }
+            lx->pos = pos;
+            lex_redirect(lx, tok);
+            tok->fd = fd;
+            tok->len = lx->pos - tok->off;
+            return T_REDIR;
+        }
+        tok->len = pos - lx->pos;
+        lx->pos = pos;
+        return tok->type = T_WORD;
+    } }
+    tok->len = tok->type == T_DSEMI || tok->type == T_AND || tok->type == T_OR ? 2 : 1;
+    lx->pos += tok->len;
+    return tok->type;
+}
+
+/**
+ * lex_heredoc - Find the body of a here-document beginning at the current
+ *               position, which ends with a line of delim. Leading tabs are
+ *               ignored if strip is true. The body is [*off, *off + *len),
+ *               and the lexer moves after the delimiter. Return false if it
+ *               isn't complete yet.
+ */
+bool lex_heredoc(lexer_t *lx, const char *delim, size_t delim_len, bool strip, size_t *off, size_t *len)
+{
+    size_t line = lx->pos;
+
+    *off = lx->pos;
+    while (line < lx->len) {
+        const char *newline = memchr(lx->src + line, '\n', lx->len - line);
+        size_t end = newline == NULL ? lx->len : (size_t) (newline - lx->src);
+        size_t start = line;
+
+        while (strip && start < end && lx->src[start] == '\t') {
+            ++start;
+        }
+        if (end - start == delim_len && memcmp(lx->src + start, delim, delim_len) == 0) {
+            *len = line - *off;
+            lx->pos = newline == NULL ? end : end + 1;
+            return true;
+        }
+        if (newline == NULL) {
+            break;
+        }
+        line = end + 1;
+    }
+    lx->incomplete = true;
+    return false;
+}
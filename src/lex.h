@@ -0,0 +1,46 @@
+/**
+ * Description: Declarations of the lexer splitting source into tokens.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// returned by lex_skip when a construct is not closed
+#define LEX_OPEN ((size_t) -1)
+
+enum TOKEN {
+    T_EOF, T_WORD, T_NEWLINE, T_SEMI, T_DSEMI, T_AMP, T_PIPE, T_AND, T_OR,
+    T_LPAREN, T_RPAREN, T_REDIR, T_ERROR,
+};
+
+// kinds of redirect operators, and here-documents not expanded
+enum REDIR {
+    R_IN, R_OUT, R_APPEND, R_DUPIN, R_DUPOUT, R_HEREDOC, R_HEREDOC_STRIP,
+    R_HEREDOC_RAW, R_CLOBBER,
+};
+
+typedef struct _token_t {
+    enum TOKEN type;
+    // text of the token in source
+    size_t off;
+    size_t len;
+    // file descriptor before a redirect operator, -1 if not given
+    int fd;
+    enum REDIR redir;
+    // whether a word contains quotes or escapes, so it can't be reserved
+    bool quoted;
+} token_t;
+
+typedef struct _lexer_t {
+    const char *src;
+    size_t len;
+    size_t pos;
+    // set when source ends inside quotes or substitutions
+    bool incomplete;
+} lexer_t;
+
+void lex_init(lexer_t *lx, const char *src, size_t len);
+enum TOKEN lex_next(lexer_t *lx, token_t *tok);
+size_t lex_skip(const char *src, size_t len, size_t pos);
+bool lex_heredoc(lexer_t *lx, const char *delim, size_t delim_len, bool strip, size_t *off, size_t *len);
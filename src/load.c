@@ -0,0 +1,68 @@
+/**
+ * Description: Readings of how busy CPUs of the system are, taken from
+ *              pressure stall information and the load average. Both are
+ *              taken over the last moment rather than averaged over seconds,
+ *              so that a burst of jobs is seen before it piles up.
+ */
+#include "load.h"
+#include "wheel.h"
+#include <stdio.h>
+#include <unistd.h>
+
+// pressure is measured over this window at least
+#define WINDOW_MS 100
+
+/**
+ * cpu_pressure - Return the percentage of time some task waited for a CPU
+ *                lately, or -1 if the kernel doesn't tell.
+ */
+double cpu_pressure(void)
+{
+    static long long last_ms;
+    static unsigned long long last_total;
+    static double last = -1;
+    long long now = monotonic_ms();
+
+    if (last_ms != 0 && now - last_ms < WINDOW_MS) {
+        return last;
+    }
+    FILE *fp = fopen("/proc/pressure/cpu", "re");
+    unsigned long long total = 0;
+    double avg10 = 0;
+
+    if (fp == NULL) {
+        return -1;
+    }
+    if (fscanf(fp, "some avg10=%lf avg60=%*f avg300=%*f total=%llu", &avg10, &total) != 2) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    // total counts microseconds, and the first reading has nothing to compare
+    last = last_ms == 0 ? avg10 : (total - last_total) / 10.0 / (now - last_ms);
+    last_ms = now;
+    last_total = total;
+    return last;
+}
+
+/**
+ * cpu_load - Return the number of tasks runnable now per online CPU, or -1
+ *            if it's unknown.
+ */
+double cpu_load(void)
+{
+    FILE *fp = fopen("/proc/loadavg", "re");
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int runnable = 0;
+
+    if (fp == NULL) {
+        return -1;
+    }
+    if (fscanf(fp, "%*f %*f %*f %d/", &runnable) != 1 || cpus < 1) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    // the shell reading it is one of them
+    return (runnable - 1.0) / cpus;
+}
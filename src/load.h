@@ -0,0 +1,7 @@
+/**
+ * Description: Declarations of readings of how busy CPUs of the system are.
+ */
+#pragma once
+
+double cpu_pressure(void);
+double cpu_load(void);
@@ -1,29 +1,153 @@
 /**
  * The "main" module of qsh.
  */
+#include "arith.h"
+#include "builtin.h"
+#include "compile.h"
 #include "error.h"
+#include "fdtab.h"
+#include "globwalk.h"
+#include "jobring.h"
+#include "jobshm.h"
+#include "jobstat.h"
+#include "lex.h"
+#include "load.h"
 #include "main.h"
-#include <dirent.h>
+#include "memo.h"
+#include "pin.h"
+#include "pump.h"
+#include "rotate.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "vars.h"
+#include "wheel.h"
 #include <stdbool.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <pwd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <sys/wait.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <time.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <sys/syscall.h>
+
+// size of ordinary chunks of the arena
+#define CHUNK_SIZE 65536
+// buffers of fields kept for nested expansions
+#define SCRATCH_NUM 8
+// milliseconds between checks of whether queued jobs can start
+#define ADMIT_INTERVAL 250
+
+// modes of expansion
+enum EXPAND { EXP_SPLIT = 1, EXP_PATTERN = 2, EXP_TILDE = 4, EXP_HEREDOC = 8, };
+
+// state of expanding a word into fields
+typedef struct _expand_t {
+    // where fields go, or NULL if the word is expanded to a single string
+    strvec_t *fields;
+    char *buf;
+    size_t len;
+    size_t cap;
+    enum EXPAND mode;
+    // the field has quotes, so it's kept even if it's empty
+    bool quoted;
+    // the field has pattern characters out of quotes
+    bool glob;
+    // the field has '[' out of quotes, which is a pattern only if closed
+    bool bracket;
+    // quoted characters of the field are escaped by backslashes
+    bool escaped;
+    // "$@" was expanded to nothing
+    bool no_at;
+} expand_t;
 
 #ifndef DEBUG
 static char prompt[MAXLINE];
-static char original_cmd[MAXLINE];
 static job_t jobs[MAXARGS];
 static pid_t grps[PID_MAX];
 #endif
 
-static char cmd[MAXLINE];
-
+// whether the shell does job control, which is off in subshells
+static bool jobctl;
+// status of the last command waited for
+static int last_status;
+// status of the last command substitution, or -1 if there's none
+static int subst_status = -1;
+// set when an expansion has failed, so the command isn't run
+static bool expand_failed;
+// status of the last process of the foreground job, set when it's reaped
+static volatile sig_atomic_t fg_status;
+// pid of the last background job
+static pid_t last_bg;
+static pid_t shell_pid;
+// whether stages of pipelines are placed on sibling CPUs, and their memory too
+static bool auto_pin;
+static bool auto_pin_mem;
+// limits on background jobs running at once, or 0 for no limit
+static unsigned admit_jobs;
+static double admit_pressure;
+static double admit_load;
+// bytes of the last output kept for each background job, or 0 for none
+static size_t ring_size;
+// pidfds of background jobs running without job control
+static int *bg_fds;
+static size_t nbg_fds;
+static size_t bg_fds_cap;
 #ifndef DEBUG
+// the number of jobs ever queued
+static unsigned long queue_seq;
+#endif
+// the arena of words expanded for commands being run
+static chunk_t *arena;
+// a released chunk kept to avoid calling malloc in loops
+static chunk_t *spare;
+static char *scratch[SCRATCH_NUM];
+static size_t scratch_cap[SCRATCH_NUM];
+static unsigned scratch_depth;
+// whether the rc file is running, and has done nothing but leave state which
+// its snapshot can hold
+static bool rc_running;
+static bool rc_pure;
+// records of the snapshot of the rc file so far
+static snap_t rc_snap;
+// pipes to rotating logs opened by the shell for redirects of a stage about
+// to run in a child
+static const cmd_t *log_cmd;
+static int *log_fds;
+// set by exec without a command to keep redirects of the shell
+static bool keep_redirects;
+// set while the last command of "qsh -c" runs, which may replace the shell
+static bool tail_source;
+// coprocesses whose pipes are open
+static coproc_t *coprocs;
+static size_t ncoprocs;
+static size_t coprocs_cap;
+// whether any coprocess has exited since their pipes were closed
+static volatile sig_atomic_t coprocs_gone;
+// file descriptors saved by OP_REDIR, and rotating logs it opened
+typedef struct _redir_frame_t {
+    saved_t saved;
+    unsigned long logs;
+} redir_frame_t;
+
+static redir_frame_t *redir_stack;
+static size_t redir_depth;
+static size_t redir_cap;
+
+static size_t capture(const char *cmdline, size_t cmdlen, char **out);
+static bool run_source(const char *src, size_t len, bool final, size_t *consumed);
+static void expand_text(expand_t *e, const char *s, size_t len, bool dquote);
+static pid_t wait_child(pid_t pid, int *status);
+static void change_ttyio(handler_t *handle_way);
+static int exec_command(char *argv[]);
+
 /**
  * signal - Wrapper for the sigaction function. Reliable version of signal(),
  *          using POSIX sigaction().
@@ -50,7 +174,24 @@ static handler_t *mysignal(int signum, handler_t *handler)
     }
     return old_action.sa_handler;
 }
-#endif
+
+/**
+ * child_reaped - Note a child reaped with status if it's gone: its track in
+ *                the trace ends, and a coprocess is marked for its pipes to
+ *                be closed. It's safe in a handler of SIGCHLD.
+ */
+static void child_reaped(pid_t pid, int status)
+{
+    if (pid > 0 && (WIFEXITED(status) || WIFSIGNALED(status))) {
+        trace_reaped(pid, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+        for (size_t i = 0; i < ncoprocs; ++i) {
+            if (coprocs[i].pid == pid) {
+                coprocs[i].gone = true;
+                coprocs_gone = true;
+            }
+        }
+    }
+}
 
 #ifndef DEBUG
 /**
@@ -120,6 +261,17 @@ static pid_t fgpid(const job_t jobs[])
     return 0;
 }
 
+/**
+ * open_gate - Let processes of job go on if they wait to be admitted.
+ */
+static void open_gate(job_t *job)
+{
+    if (job->gate >= 0) {
+        close(job->gate);
+        job->gate = -1;
+    }
+}
+
 /**
  * clearjob - Clear entries in a job structure.
  */
@@ -127,14 +279,28 @@ static void clearjob(job_t *job)
 {
     if (job->num != 0) {
         if (--job->num == 0) {
+            // like timeout(1), a job stopped by its deadline has status 124
+            if (wheel_cancel(job->pid) && job->state == FG) {
+                fg_status = 124;
+            }
             if (job->state != UNDEF && job->state != FG && job->state != KILLED) {
                 print_job(job, DONE);
             }
+            // its status is kept for "wait" unless it's finished in foreground
+            if (job->state == FG) {
+                jobstat_forget(job->last);
+            } else {
+                jobstat_done(job->last, job->status);
+            }
             job->name[0] = '\0';
             job->state = UNDEF;
             job->jid = 0;
             job->pid = 0;
+            job->last = 0;
+            job->deadline = 0;
+            open_gate(job);
         }
+        jobshm_update(job - jobs);
     }
 }
 
@@ -176,6 +342,7 @@ static void delete_job(job_t jobs[], pid_t pid)
  */
 static void set_terminal(pid_t pgid)
 {
+    trace_begin("tcsetpgrp", NULL);
     if (tcsetpgrp(STDIN_FILENO, pgid) < 0) {
         unix_fatal("tcsetpgrp error");
     }
@@ -185,6 +352,7 @@ static void set_terminal(pid_t pgid)
     if (tcsetpgrp(STDERR_FILENO, pgid) < 0) {
         unix_fatal("tcsetpgrp error");
     }
+    trace_end("tcsetpgrp");
 }
 
 /**
@@ -198,14 +366,32 @@ static void sigchld_handler(int sig)
     while ((pid = waitpid(-1, &status, WCONTINUED | WNOHANG | WUNTRACED)) > 0) {
         job_t *job = getjob(jobs, pid2jid(grps[pid]));
 
+        child_reaped(pid, status);
+
+        if (job == NULL) {
+            // not started with job control, which leads its group if it's timed
+            wheel_cancel(pid);
+            if (WIFEXITED(status) || WIFSIGNALED(status)) {
+                jobstat_done(pid, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+            }
+            continue;
+        }
         if (WIFSTOPPED(status)) {
             if (job->state == FG) {
                 fputs("\n", stdout);
                 print_job(job, STOP);
+                fg_status = 128 + WSTOPSIG(status);
             }
             job->state = STOP;
+            jobshm_update(job - jobs);
         } else if (WIFSIGNALED(status)) {
             sig = WTERMSIG(status);
+            if (pid == job->last) {
+                job->status = 128 + sig;
+            }
+            if (job->state == FG && pid == job->last) {
+                fg_status = 128 + sig;
+            }
             if (sig == SIGKILL) {
                 job->state = KILLED;
                 print_job(job, KILLED);
@@ -218,6 +404,12 @@ static void sigchld_handler(int sig)
                 print_job(job, CONTINUED);
             }
         } else {
+            if (pid == job->last) {
+                job->status = WEXITSTATUS(status);
+            }
+            if (job->state == FG && pid == job->last) {
+                fg_status = WEXITSTATUS(status);
+            }
             delete_job(jobs, grps[pid]);
         }
     }
@@ -283,25 +475,158 @@ static void do_dup(int oldfd, int newfd)
 }
 
 /**
- * redirect - Do redirect according to content in redirects.
+ * save_fd - Save fd before the shell itself redirects it.
+ */
+static void save_fd(int fd, saved_t *saved)
+{
+    if (saved == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < saved->n; ++i) {
+        if (saved->fds[i].fd == fd) {
+            return;
+        }
+    }
+    if (saved->n == saved->cap) {
+        size_t cap = saved->cap == 0 ? 4 : saved->cap * 2;
+        saved_fd_t *tmp = realloc(saved->fds, cap * sizeof(*tmp));
+
+        if (tmp == NULL) {
+            unix_fatal("realloc error");
+        }
+        saved->fds = tmp;
+        saved->cap = cap;
+    }
+    // fd is closed now and so should it be after restoring if it can't be copied
+    saved->fds[saved->n].fd = fd;
+    saved->fds[saved->n].copy = fcntl(fd, F_DUPFD_CLOEXEC, FD_SHELL);
+    saved->fds[saved->n++].inherited = fdtab_has(fd);
+}
+
+/**
+ * restore_fds - Restore file descriptors saved before redirecting.
+ */
+static void restore_fds(saved_t *saved)
+{
+    while (saved->n > 0) {
+        const saved_fd_t *fd = &saved->fds[--saved->n];
+
+        if (fd->copy >= 0) {
+            do_dup(fd->copy, fd->fd);
+        } else {
+            close(fd->fd);
+        }
+        if (fd->fd > STDERR_FILENO && fd->inherited) {
+            fdtab_add(fd->fd);
+        } else if (fd->fd > STDERR_FILENO) {
+            fdtab_del(fd->fd);
+        }
+    }
+    free(saved->fds);
+    memset(saved, 0, sizeof(*saved));
+}
+
+/**
+ * keep_fds - Keep what the shell has redirected, for exec without a command.
+ */
+static void keep_fds(saved_t *saved)
+{
+    for (size_t i = 0; i < saved->n; ++i) {
+        if (saved->fds[i].copy >= 0) {
+            close(saved->fds[i].copy);
+        }
+    }
+    free(saved->fds);
+    memset(saved, 0, sizeof(*saved));
+}
+
+/**
+ * shell_fd - Return whether fd is kept by the shell for itself, so it can't
+ *            be redirected or duplicated.
  */
-static void redirect(const redirect_t *redirects)
+static bool shell_fd(int fd)
+{
+    int flags = fd >= FD_SHELL && !fdtab_has(fd) ? fcntl(fd, F_GETFD) : -1;
+
+    return flags >= 0 && (flags & FD_CLOEXEC);
+}
+
+/**
+ * drop_logs - Close pipes to rotating logs in redirects not done, so their
+ *             logs see the end. Return false.
+ */
+static bool drop_logs(const redirect_t *redirects)
+{
+    for (; redirects->type != NO; ++redirects) {
+        if (redirect_type(redirects->type) == PIPE) {
+            close(redirects->from);
+        }
+    }
+    return false;
+}
+
+/**
+ * redirect - Do redirect according to content in redirects. If saved isn't
+ *            NULL, original file descriptors are saved in it to be restored
+ *            later. Descriptors above standard error are put in the table
+ *            commands inherit, or taken out of it once closed. Return false
+ *            on failure.
+ */
+static bool redirect(const redirect_t *redirects, saved_t *saved)
 {
     while (redirects->type != NO) {
 #ifdef DEBUG
+        UNUSED(saved);
         printf("%d ", redirects->type);
         printf("%s\n", redirects->filename);
+        if (redirect_type(redirects->type) == PIPE) {
+            close(redirects->from);
+        }
         ++redirects;
         continue;
 #endif
         // get IN, OUT, or ERR
         int toredirect = get_direction(redirects->type);
+        int newfd = redirects->fd;
         mode_t mode = toredirect == IN ? O_RDONLY : O_WRONLY | O_CREAT | O_APPEND;
 
+        if (saved != NULL && shell_fd(newfd)) {
+            printf("%d: bad file descriptor\n", newfd);
+            return drop_logs(redirects);
+        }
+        save_fd(newfd, saved);
         switch (redirect_type(redirects->type)) {
         case CLOSE:
-            if (close(type2fd(toredirect)) < 0) {
-                unix_fatal("close error");
+            if (close(newfd) < 0 && errno != EBADF) {
+                unix_error("close error");
+                return drop_logs(redirects);
+            }
+            break;
+        case HEREDOC: {
+            // a memfd never blocks the writer like a pipe would
+            int fd = memfd_create("qsh-heredoc", MFD_CLOEXEC);
+
+            if (fd < 0) {
+                unix_error("memfd_create error");
+                return drop_logs(redirects);
+            }
+            if (write(fd, redirects->doc, redirects->doc_len) != (ssize_t) redirects->doc_len
+                    || lseek(fd, 0, SEEK_SET) < 0) {
+                unix_error("here-document error");
+                close(fd);
+                return drop_logs(redirects);
+            }
+            do_dup(fd, newfd);
+            break;
+        }
+        case PIPE:
+            do_dup(redirects->from, newfd);
+            break;
+        case DUP:
+            // the duplicated descriptor is kept open
+            if ((saved != NULL && shell_fd(redirects->from)) || dup2(redirects->from, newfd) < 0) {
+                printf("%d: bad file descriptor\n", redirects->from);
+                return drop_logs(redirects);
             }
             break;
         case NO:
@@ -310,28 +635,25 @@ static void redirect(const redirect_t *redirects)
             }
             // case NO and APPEND share the next code
         case APPEND: {
-            int fd = 0;
+            int fd = open(redirects->filename, mode, RWRWR);
 
-            // it seems to have different semantics with normal shell
-            if (strcmp(redirects->filename, "&1") == 0) {
-                fd = STDOUT_FILENO;
-            } else if (strcmp(redirects->filename, "&2") == 0) {
-                fd = STDERR_FILENO;
-            } else {
-                fd = open(redirects->filename, mode, RWRWR);
-            }
             if (fd < 0) {
-                unix_fatal(redirects->filename);
+                unix_error(redirects->filename);
+                return drop_logs(redirects);
             }
-            int newfd = type2fd(toredirect);
-
             do_dup(fd, newfd);
             break;
         } default:
             break;
         }
+        if (newfd > STDERR_FILENO && redirect_type(redirects->type) == CLOSE) {
+            fdtab_del(newfd);
+        } else if (newfd > STDERR_FILENO) {
+            fdtab_add(newfd);
+        }
         ++redirects;
     }
+    return true;
 }
 
 /**
@@ -347,489 +669,3664 @@ static void copybuf(char *dest, const char *buf, size_t num)
 }
 
 /**
- * move_delim - Move delimiter and pointer of buffer when parsing command.
+ * arena_alloc - Allocate size bytes in the arena, which are freed when the
+ *               arena is released to a mark taken before.
  */
-static void move_delim(char **buf, char **delim)
+static void *arena_alloc(size_t size)
 {
-    while (**buf == ' ' || **buf == '\t') {
-        ++*buf;
-    }
-    switch (**buf) {
-    case '\'':
-    case '\"':
-        ++*buf;
-        *delim = strchr(*buf, (*buf)[-1]);
-        break;
-    default:
-        *delim = strchr(*buf, ' ');
-        break;
+    size = (size + 7) & ~(size_t) 7;
+    if (arena == NULL || arena->size - arena->used < size) {
+        chunk_t *chunk = spare;
+
+        if (size > CHUNK_SIZE || chunk == NULL) {
+            size_t cap = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+
+            if ((chunk = malloc(sizeof(*chunk) + cap)) == NULL) {
+                unix_fatal("malloc error");
+            }
+            chunk->size = cap;
+        } else {
+            spare = NULL;
+        }
+        chunk->used = 0;
+        chunk->prev = arena;
+        arena = chunk;
     }
+    void *block = arena->data + arena->used;
+
+    arena->used += size;
+    return block;
 }
 
 /**
- * parseline - Parse the cmdline to return the parameters.
- * 
- * NOTE:
- * Assume the length of a line is less than MAXLINE and there's no string
- * consisting of more than one line. And it cannot deal with situations
- * where parameters are in quotes fully or partly while '-' before them is not,
- * such as `ls -"a"l`. And for redirecting, there should be no space in the item.
+ * arena_mark - Get the current position of the arena.
  */
-static void parseline(char *buf, char **argv, redirect_t *redirects)
+static mark_t arena_mark(void)
 {
-    buf[strlen(buf)-1] = ' ';
-    // the 2d array to store filenames in current directory when a '*' is the parameter
-    static char files[MAXARGS][NAME_MAX];
-    static char path[PATH_MAX] = {'\0'};
-    int argc = 0;
-    char *delim = buf;
-
-    move_delim(&buf, &delim);
-    size_t redirect_num = 0;
-
-    while (delim != NULL) {
-        *delim = '\0';
-        enum REDIRECT type;
-
-        switch (*buf) {
-        case '~': {
-            char *home = getenv("HOME");
-
-            if (home == NULL) {
-                unix_error("cannot find home directory");
-            }
-            copybuf(path, home, PATH_MAX);
-            size_t len = strlen(buf+1) + 1;
-            size_t n = len > PATH_MAX / 2 ? PATH_MAX / 2 : len;
-
-            strncat(path, buf+1, n);
-            argv[argc++] = path;
-            break;
-        } case '>':
-            if (buf[1] == '>') {
-                redirects[redirect_num].type = APPEND | OUT;
-                copybuf(redirects[redirect_num++].filename, &buf[2], NAME_MAX);
-                break;
-            } else {
-                // NOTE: this branch shares code with case '<'
-            }
-        case '<':
-            type = *buf == '>' ? OUT : IN;
-            redirects[redirect_num].type = type;
-            copybuf(redirects[redirect_num++].filename, &buf[1], NAME_MAX);
-            break;
-        case '1':
-        case '2':
-            type = *buf == '1' ? OUT : ERR;
-            if (buf[1] == '>') {
-                if (buf[2] == '&' && buf[3] == '-') {
-                    redirects[redirect_num].type = CLOSE | type;
-                    *redirects[redirect_num++].filename = '\0';
-                } else if (buf[2] == '>') {
-                    redirects[redirect_num].type = APPEND | type;
-                    copybuf(redirects[redirect_num++].filename, &buf[3], NAME_MAX);
-                } else {
-                    redirects[redirect_num].type = type;
-                    copybuf(redirects[redirect_num++].filename, &buf[2], NAME_MAX);
-                }
-                break;
-            }
-            goto do_nothing;
-        case '*': {
-            if (buf[1] == '\0') {
-                DIR *dp = opendir(".");
+    mark_t mark = {arena, arena == NULL ? 0 : arena->used};
 
-                if (dp == NULL) {
-                    unix_fatal("can't get all files and directories");
-                }
-                struct dirent *dirp = NULL;
-                size_t file_number = 0;
-
-                errno = 0;
-                while ((dirp = readdir(dp)) != NULL) {
-                    if (dirp->d_name[0] != '.') {
-                        copybuf(files[file_number], dirp->d_name, NAME_MAX);
-                        argv[argc++] = files[file_number++];
-                    }
-                }
-                if (errno != 0) {
-                    unix_fatal("readdir error");
-                }
-                if (closedir(dp) < 0) {
-                    unix_fatal("closedir error");
-                }
-                break;
-            }
-        } default:
-do_nothing:
-            argv[argc++] = buf;
-            break;
-        }
-        buf = delim + 1;
-        move_delim(&buf, &delim);
-    }
-    argv[argc] = NULL;
-    redirects[redirect_num].type = NO;
+    return mark;
 }
 
-#ifndef DEBUG
 /**
- * addjob - Add a job to the job list.
+ * arena_release - Free everything allocated in the arena after mark.
  */
-static void addjob(job_t *jobs, pid_t pid, enum STATE state, const char *cmd, unsigned num)
+static void arena_release(mark_t mark)
 {
-    if (pid < 1) {
-        return;
-    }
-    for (size_t i = 0; i < MAXARGS; ++i) {
-        if (jobs[i].pid == 0) {
-            jobs[i].num = num;
-            jobs[i].pid = pid;
-            jobs[i].jid = i + 1;
-            jobs[i].state = state;
-            copybuf(jobs[i].name, cmd, MAXLINE);
-            return;
+    while (arena != mark.chunk) {
+        chunk_t *chunk = arena;
+
+        arena = chunk->prev;
+        if (chunk->size == CHUNK_SIZE && spare == NULL) {
+            spare = chunk;
+        } else {
+            free(chunk);
         }
     }
-    printf("Too many jobs now!");
+    if (arena != NULL) {
+        arena->used = mark.used;
+    }
 }
-#endif
 
-#ifndef DEBUG
 /**
- * waitfg - Wait process in foreground to stop.
+ * arena_strndup - Copy n bytes of s into the arena with a terminating '\0'.
  */
-static void waitfg(const job_t jobs[])
+static char *arena_strndup(const char *s, size_t n)
 {
-    while (fgpid(jobs) != 0) {
-        pause();
-    }
+    char *copy = arena_alloc(n + 1);
+
+    memcpy(copy, s, n);
+    copy[n] = '\0';
+    return copy;
 }
 
 /**
- * listjobs - List present jobs.
+ * vec_push - Append s to vec, which is kept NULL-terminated.
  */
-static void listjobs(const job_t jobs[])
+static void vec_push(strvec_t *vec, char *s)
 {
-    for (size_t i = 0; i < MAXARGS; ++i) {
-        if (jobs[i].pid != 0) {
-            print_job(&jobs[i], jobs[i].state);
+    if (vec->n + 1 >= vec->cap) {
+        size_t cap = vec->cap == 0 ? 16 : vec->cap * 2;
+        char **v = arena_alloc(cap * sizeof(*v));
+
+        if (vec->n > 0) {
+            memcpy(v, vec->v, vec->n * sizeof(*v));
         }
+        vec->v = v;
+        vec->cap = cap;
     }
+    vec->v[vec->n++] = s;
+    vec->v[vec->n] = NULL;
 }
 
 /**
- * do_bgfg - Execute bg of fg command.
+ * read_all - Read everything from fd into a growable chunk pushed into the
+ *            arena. Return the length of content, which is followed by a '\0'.
  */
-static void do_bgfg(char *argv[], job_t jobs[])
+static size_t read_all(int fd, char **out)
 {
-    int jid = 1;
-
-    if (argv[1] != NULL) {
-        if (argv[1][0] != '%') {
-            fputs("There must be '%%' before job id.\n", stdout);
-            return;
-        }
-        jid = atoi(argv[1] + 1);
-    }
-    job_t *job = getjob(jobs, jid);
+    size_t cap = 4096;
+    size_t len = 0;
+    chunk_t *chunk = malloc(sizeof(*chunk) + cap);
 
-    if (job == NULL) {
-        printf("%%%d: No such job.\n", jid);
-        return;
+    if (chunk == NULL) {
+        unix_fatal("malloc error");
     }
-    pid_t pid = job->pid;
+    while (true) {
+        // keep one byte for the terminating '\0'
+        if (cap - len < 2) {
+            cap *= 2;
+            chunk_t *tmp = realloc(chunk, sizeof(*chunk) + cap);
 
-    switch (strcmp(argv[0], "bg")) {
-    case 0:
-        if (job->state == BG) {
-            app_error("Job already in background.");
-            return;
-        }
-        job->state = BG;
-        if (kill(-pid, SIGCONT) < 0) {
-            unix_fatal("kill error");
+            if (tmp == NULL) {
+                unix_fatal("realloc error");
+            }
+            chunk = tmp;
         }
-        print_job(job, CONTINUED);
-        break;
-    default:
-        job->state = FG;
-        set_terminal(job->pid);
-        if (kill(-pid, SIGCONT) < 0) {
-            unix_fatal("kill error");
+        ssize_t n = read(fd, chunk->data + len, cap - len - 1);
+
+        if (n == 0) {
+            break;
+        } else if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unix_error("read error");
+            break;
         }
-        waitfg(jobs);
-        set_terminal(getpid());
-        break;
+        len += n;
     }
+    chunk->data[len] = '\0';
+    // the chunk is full, so later allocations go to a new one
+    chunk->size = cap;
+    chunk->used = cap;
+    chunk->prev = arena;
+    arena = chunk;
+    *out = chunk->data;
+    return len;
 }
-#endif
 
 /**
- * builtin_cmd - Judge whether the command is a builtin command.
+ * exp_init - Begin expanding a word, reusing a buffer of fields if possible.
  */
-static bool builtin_cmd(char **argv)
+static void exp_init(expand_t *e, strvec_t *fields, enum EXPAND mode)
 {
-    if (strcmp(*argv, "exit") == 0) {
-        kill_bg(jobs);
-        exit(0);
-    } else if (strcmp(*argv, "cd") == 0) {
-        if (argv[1] == NULL) {
-            char *home = getenv("HOME");
-
-            argv[1] = home == NULL ? "" : home;
-        }
-        if (chdir(argv[1]) != 0) {
-            switch (errno) {
-            case EACCES :
-                app_error("cd: Permission denied.");
-                break;
-            case ENOENT:
-                app_error("cd: No such directory.");
-                break;
-            default:
-                unix_error("chdir error");
-                break;
-            }
-        }
-        return true;
-    } else if (strcmp(*argv, "jobs") == 0) {
-#ifndef DEBUG
-        listjobs(jobs);
-#endif
-        return true;
-    } else if (strcmp(*argv, "fg") == 0 || strcmp(*argv, "bg") == 0) {
-#ifndef DEBUG
-        do_bgfg(argv, jobs);
-#endif
-        return true;
+    memset(e, 0, sizeof(*e));
+    e->fields = fields;
+    e->mode = mode;
+    if (scratch_depth < SCRATCH_NUM) {
+        e->buf = scratch[scratch_depth];
+        e->cap = scratch_cap[scratch_depth];
     }
-    return false;
+    ++scratch_depth;
 }
 
 /**
- * preprocess - Judge whether it's run on background.
+ * exp_done - Finish expanding a word, keeping its buffer for the next one.
  */
-static bool preprocess(char *cmdline)
+static void exp_done(expand_t *e)
 {
-    char *tmp = cmdline + strlen(cmdline);
-
-    while (isspace(*--tmp) && tmp >= cmdline) {
-        ;
-    }
-    if (tmp < cmdline) {
-        return false;
-    }
-    if (*tmp == '&') {
-        *tmp = ' ';
-        return true;;
+    if (--scratch_depth < SCRATCH_NUM) {
+        scratch[scratch_depth] = e->buf;
+        scratch_cap[scratch_depth] = e->cap;
+    } else {
+        free(e->buf);
     }
-    return false;
 }
 
 /**
- * split - Split the cmdline according to delim.
+ * put - Append n bytes of s to the current field.
  */
-static int split(char *buf, char delim, char *argv[])
+static void put(expand_t *e, const char *s, size_t n)
 {
-    size_t argc = 0;
-    char *bond = NULL;
+    if (e->len + n + 1 > e->cap) {
+        size_t cap = (e->len + n + 1) * 2;
+        char *tmp = realloc(e->buf, cap < 64 ? 64 : cap);
 
-    while ((bond = strchr(buf, delim)) != NULL) {
-        *bond = '\0';
-        if (!isspace(bond[-1])) {
-            app_error("There must be space before a delimiter.");
-            return -1;
+        if (tmp == NULL) {
+            unix_fatal("realloc error");
         }
-        argv[argc++] = buf;
-        buf = bond + 1;
+        e->buf = tmp;
+        e->cap = cap < 64 ? 64 : cap;
     }
-    argv[argc++] = buf;
-    argv[argc] = NULL;
-    return argc;
+    memcpy(e->buf + e->len, s, n);
+    e->len += n;
+    e->buf[e->len] = '\0';
 }
 
-#ifndef DEBUG
 /**
- * closepipes - Close useless pipes in a specific process.
+ * put_quoted - Append quoted text, which is escaped in a pattern or a field
+ *              which may be a pattern later.
  */
-static void closepipes(int pipes[][2], int pipes_num, int number)
+static void put_quoted(expand_t *e, const char *s, size_t n)
 {
-    for (int i = 0; i < pipes_num; ++i) {
-        if (i != number) {
-            close(pipes[i][1]);
+    if (!(e->mode & EXP_PATTERN) && e->fields == NULL) {
+        put(e, s, n);
+        return;
+    }
+    while (n > 0) {
+        size_t plain = 0;
+
+        while (plain < n && strchr("*?[]\\", s[plain]) == NULL) {
+            ++plain;
         }
-        if (i != number - 1) {
-            close(pipes[i][0]);
+        put(e, s, plain);
+        if (plain < n) {
+            put(e, "\\", 1);
+            put(e, s + plain++, 1);
+            e->escaped = true;
         }
+        s += plain;
+        n -= plain;
     }
 }
 
 /**
- * block_child - Block signal.
+ * unescape - Remove backslashes quoting characters of s in place. Return the
+ *            length left.
  */
-static void block_sig(sigset_t *mask)
+static size_t unescape(char *s, size_t len)
 {
-    if (sigemptyset(mask) < 0) {
-        unix_fatal("sigemptyset error");
-    }
-    if (sigaddset(mask, SIGCHLD) < 0) {
-        unix_fatal("sigadset error");
-    }
-    if (sigprocmask(SIG_BLOCK, mask, NULL) < 0) {
-        unix_fatal("sigprocmask error");
+    size_t n = 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        if (s[i] == '\\' && i + 1 < len) {
+            ++i;
+        }
+        s[n++] = s[i];
     }
+    s[n] = '\0';
+    return n;
 }
 
 /**
- * unblock_sig : Unblock signals in mask.
+ * field_glob - Judge whether the current field is a pattern. A '[' without a
+ *              ']' closing it isn't one, so "[" never reads the directory.
  */
-static void unblock_sig(sigset_t *mask)
+static bool field_glob(const expand_t *e)
 {
-    if (sigprocmask(SIG_UNBLOCK, mask, NULL) < 0) {
-        unix_fatal("sigprocmask error");
-    }
+    return e->glob || (e->bracket && glob_pattern(e->buf));
 }
 
 /**
- * connect_pipes - Connect stdin and stdout of this process to related pipes.
+ * end_field - End the current field. An empty one is dropped unless it's
+ *             quoted or force is true.
  */
-static void connect_pipes(int number, int pipes[][2], int pipes_num)
+static void end_field(expand_t *e, bool force)
 {
-    if (number < pipes_num) {
-        do_dup(pipes[number][1], STDOUT_FILENO);
+    if (e->fields == NULL) {
+        return;
     }
-    if (number > 0) {
-        do_dup(pipes[number-1][0], STDIN_FILENO);
+    if (e->len > 0 || e->quoted || force) {
+        char **paths = NULL;
+        size_t n = 0;
+
+        if (field_glob(e)) {
+            // files matching may differ next time
+            rc_pure = false;
+            n = glob_paths(e->buf, &paths);
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            vec_push(e->fields, arena_strndup(paths[i], strlen(paths[i])));
+        }
+        free_paths(paths, n);
+        // a pattern matching nothing is kept as it is
+        if (n == 0) {
+            if (e->escaped) {
+                e->len = unescape(e->buf, e->len);
+            }
+            vec_push(e->fields, arena_strndup(e->len == 0 ? "" : e->buf, e->len));
+        }
     }
+    e->len = 0;
+    e->quoted = false;
+    e->glob = false;
+    e->bracket = false;
+    e->escaped = false;
 }
 
 /**
- * set_group - Call setpgid in the parent process.
+ * put_value - Append the value of an expansion, which is split into fields
+ *             by IFS out of double quotes.
  */
-static void set_group(const pid_t pids[], int sum)
+static void put_value(expand_t *e, const char *s, size_t n, bool dquote)
 {
-    for (int i = 0; i < sum; ++i) {
-        grps[pids[i]] = pids[0];
-        if (setpgid(pids[i], pids[0]) < 0 && errno != EACCES) {
-            unix_fatal("setpgid error");
+    if (dquote) {
+        put_quoted(e, s, n);
+        return;
+    }
+    if (e->fields == NULL || !(e->mode & EXP_SPLIT)) {
+        put(e, s, n);
+        return;
+    }
+    const char *ifs = get_var("IFS", 3);
+
+    if (ifs == NULL) {
+        ifs = " \t\n";
+    }
+    for (size_t i = 0; i < n; ++i) {
+        char ch = s[i];
+
+        if (ch != '\0' && strchr(ifs, ch) != NULL) {
+            // blanks in IFS never make empty fields
+            end_field(e, !isspace((unsigned char) ch));
+            continue;
         }
+        if (ch == '*' || ch == '?') {
+            e->glob = true;
+        } else if (ch == '[') {
+            e->bracket = true;
+        } else if (ch == '\\') {
+            // it's not quoting anything
+            put(e, "\\", 1);
+            e->escaped = true;
+        }
+        put(e, &ch, 1);
     }
 }
 
 /**
- * add_newjob - Add a new job in foreground or background.
+ * expand_string - Expand text to a single string in the arena.
  */
-static void add_newjob(int pid, bool bg, unsigned num, sigset_t *mask)
+static char *expand_string(const char *s, size_t len, enum EXPAND mode)
 {
-    if (!bg) {
-        addjob(jobs, pid, FG, original_cmd, num);
-        set_terminal(pid);
+    expand_t e;
+
+    exp_init(&e, NULL, mode);
+    // a here-document is expanded as if it's in double quotes
+    expand_text(&e, s, len, mode & EXP_HEREDOC);
+    char *str = arena_strndup(e.len == 0 ? "" : e.buf, e.len);
+
+    exp_done(&e);
+    return str;
+}
+
+/**
+ * param_value - Get the value of a variable or a special parameter. buf
+ *               holds a number converted. Return NULL if it's unset.
+ */
+static const char *param_value(const char *name, size_t len, char buf[32])
+{
+    if (isdigit((unsigned char) name[0])) {
+        return get_param(atoi(name));
+    }
+    if (len == 1 && (name[0] == '$' || name[0] == '!' || name[0] == '0')) {
+        // they differ from one shell to another
+        rc_pure = false;
+    }
+    if (len == 1) {
+        switch (name[0]) {
+        case '?':
+            snprintf(buf, 32, "%d", last_status);
+            return buf;
+        case '$':
+            snprintf(buf, 32, "%d", shell_pid);
+            return buf;
+        case '!':
+            if (last_bg == 0) {
+                return NULL;
+            }
+            snprintf(buf, 32, "%d", last_bg);
+            return buf;
+        case '#':
+            snprintf(buf, 32, "%d", param_num());
+            return buf;
+        case '-':
+            return "";
+        case '*':
+        case '@': {
+            size_t total = 1;
+
+            for (int i = 1; i <= param_num(); ++i) {
+                total += strlen(get_param(i)) + 1;
+            }
+            char *all = arena_alloc(total);
+
+            all[0] = '\0';
+            for (int i = 1; i <= param_num(); ++i) {
+                if (i > 1) {
+                    strcat(all, " ");
+                }
+                strcat(all, get_param(i));
+            }
+            return all;
+        } default:
+            break;
+        }
+    }
+    return get_var(name, len);
+}
+
+/**
+ * name_length - Get the length of the parameter name at the beginning of s.
+ */
+static size_t name_length(const char *s, size_t len)
+{
+    size_t n = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (isdigit((unsigned char) s[0])) {
+        while (n < len && isdigit((unsigned char) s[n])) {
+            ++n;
+        }
+        return n;
+    }
+    if (strchr("?$!#-*@", s[0]) != NULL) {
+        return 1;
+    }
+    while (n < len && (isalnum((unsigned char) s[n]) || s[n] == '_')) {
+        ++n;
+    }
+    return n;
+}
+
+/**
+ * trim - Remove the shortest or longest prefix ('#') or suffix ('%') of value
+ *        matching pattern. The length left is set in n.
+ */
+static const char *trim(const char *value, const char *pattern, char kind, bool longest, size_t *n)
+{
+    size_t len = strlen(value);
+
+    if (kind == '#') {
+        char *head = arena_strndup(value, len);
+
+        for (size_t i = 0; i <= len; ++i) {
+            size_t cut = longest ? len - i : i;
+            char ch = head[cut];
+
+            head[cut] = '\0';
+            bool match = fnmatch(pattern, head, 0) == 0;
+
+            head[cut] = ch;
+            if (match) {
+                *n = len - cut;
+                return value + cut;
+            }
+        }
+    } else {
+        for (size_t i = 0; i <= len; ++i) {
+            size_t cut = longest ? i : len - i;
+
+            if (fnmatch(pattern, value + cut, 0) == 0) {
+                *n = cut;
+                return value;
+            }
+        }
+    }
+    *n = len;
+    return value;
+}
+
+/**
+ * expand_brace - Expand a parameter in braces, the body of which is s.
+ */
+static void expand_brace(expand_t *e, const char *s, size_t len, bool dquote)
+{
+    char buf[32];
+    const char *value = NULL;
+
+    if (len > 1 && s[0] == '#') {
+        // length of the value
+        value = param_value(s + 1, len - 1, buf);
+        snprintf(buf, sizeof(buf), "%zu", value == NULL ? 0 : strlen(value));
+        put(e, buf, strlen(buf));
+        return;
+    }
+    size_t n = name_length(s, len);
+
+    if (n == 0) {
+        app_error("bad substitution");
+        return;
+    }
+    value = param_value(s, n, buf);
+    if (n == len) {
+        if (value != NULL) {
+            put_value(e, value, strlen(value), dquote);
+        }
+        return;
+    }
+    bool colon = s[n] == ':';
+    char kind = n + colon < len ? s[n+colon] : '\0';
+    const char *word = s + n + colon + 1;
+    size_t word_len = len - (n + colon + 1);
+    bool set = value != NULL && (!colon || *value != '\0');
+
+    switch (kind) {
+    case '-':
+        if (set) {
+            put_value(e, value, strlen(value), dquote);
+        } else {
+            expand_text(e, word, word_len, dquote);
+        }
+        break;
+    case '=':
+        if (!set) {
+            value = expand_string(word, word_len, EXP_TILDE);
+            if (is_name(s, n)) {
+                set_var(s, n, value, false);
+            }
+        }
+        put_value(e, value, strlen(value), dquote);
+        break;
+    case '+':
+        if (set) {
+            expand_text(e, word, word_len, dquote);
+        }
+        break;
+    case '?':
+        if (set) {
+            put_value(e, value, strlen(value), dquote);
+        } else {
+            printf("%.*s: %s\n", (int) n, s, word_len == 0
+                    ? "parameter null or not set" : expand_string(word, word_len, 0));
+        }
+        break;
+    case '#':
+    case '%': {
+        bool longest = word_len > 0 && word[0] == kind;
+
+        if (colon) {
+            app_error("bad substitution");
+            break;
+        }
+        if (longest) {
+            ++word;
+            --word_len;
+        }
+        const char *pattern = expand_string(word, word_len, EXP_PATTERN);
+        size_t left = 0;
+
+        value = trim(value == NULL ? "" : value, pattern, kind, longest, &left);
+        put_value(e, value, left, dquote);
+        break;
+    } default:
+        app_error("bad substitution");
+        break;
+    }
+}
+
+/**
+ * expand_dollar - Expand a parameter, a command substitution or an arithmetic
+ *                 expansion beginning at pos. Return the position after it.
+ */
+static size_t expand_dollar(expand_t *e, const char *s, size_t len, size_t pos, bool dquote)
+{
+    char buf[32];
+    char ch = pos + 1 < len ? s[pos+1] : '\0';
+
+    if (ch == '(' || ch == '{') {
+        size_t end = lex_skip(s, len, pos);
+
+        if (end == LEX_OPEN) {
+            put(e, s + pos, len - pos);
+            return len;
+        }
+        if (ch == '{') {
+            expand_brace(e, s + pos + 2, end - pos - 3, dquote);
+        } else if (pos + 2 < len && s[pos+2] == '(' && s[end-2] == ')') {
+            bool ok = true;
+            const char *expr = expand_string(s + pos + 3, end - pos - 5, 0);
+            long value = arith_eval(expr, &ok);
+
+            if (!ok) {
+                expand_failed = true;
+            }
+            snprintf(buf, sizeof(buf), "%ld", value);
+            put(e, buf, strlen(buf));
+        } else {
+            char *out = NULL;
+            size_t n = capture(s + pos + 2, end - pos - 3, &out);
+
+            put_value(e, out, n, dquote);
+        }
+        return end;
+    }
+    size_t n = name_length(s + pos + 1, len - pos - 1);
+
+    if (n == 0) {
+        put(e, "$", 1);
+        return pos + 1;
+    }
+    // only a single digit follows '$' without braces
+    if (isdigit((unsigned char) ch)) {
+        n = 1;
+    }
+    if (ch == '@' && dquote && e->fields != NULL) {
+        // every parameter is a field
+        e->no_at = param_num() == 0;
+        for (int i = 1; i <= param_num(); ++i) {
+            if (i > 1) {
+                end_field(e, true);
+            }
+            put_quoted(e, get_param(i), strlen(get_param(i)));
+        }
+        return pos + 2;
+    }
+    const char *value = ch == '0' ? get_param(0) : param_value(s + pos + 1, n, buf);
+
+    if (value != NULL) {
+        put_value(e, value, strlen(value), dquote);
+    }
+    return pos + 1 + n;
+}
+
+/**
+ * expand_backquote - Expand "`...`" beginning at pos. Return the position
+ *                    after it.
+ */
+static size_t expand_backquote(expand_t *e, const char *s, size_t len, size_t pos, bool dquote)
+{
+    size_t end = lex_skip(s, len, pos);
+
+    if (end == LEX_OPEN) {
+        put(e, s + pos, len - pos);
+        return len;
+    }
+    // '\' only quotes '$', '`' and '\' inside
+    char *body = arena_alloc(end - pos);
+    size_t n = 0;
+
+    for (size_t i = pos + 1; i < end - 1; ++i) {
+        if (s[i] == '\\' && i + 1 < end - 1 && strchr("$`\\", s[i+1]) != NULL) {
+            ++i;
+        }
+        body[n++] = s[i];
+    }
+    char *out = NULL;
+    size_t out_len = capture(body, n, &out);
+
+    put_value(e, out, out_len, dquote);
+    return end;
+}
+
+/**
+ * expand_tilde - Expand "~" or "~user" at the beginning of a word. Return the
+ *                length of the prefix expanded.
+ */
+static size_t expand_tilde(expand_t *e, const char *s, size_t len)
+{
+    size_t end = 1;
+
+    if (len == 0 || s[0] != '~') {
+        return 0;
+    }
+    while (end < len && s[end] != '/') {
+        if (!isalnum((unsigned char) s[end]) && strchr("._-", s[end]) == NULL) {
+            return 0;
+        }
+        ++end;
+    }
+    const char *dir = NULL;
+
+    if (end == 1) {
+        if ((dir = get_var("HOME", 4)) == NULL) {
+            app_error("cannot find home directory");
+            dir = "";
+        }
+    } else {
+        char *name = arena_strndup(s + 1, end - 1);
+        struct passwd *pw = getpwnam(name);
+
+        // so may the user database
+        rc_pure = false;
+        if (pw == NULL) {
+            return 0;
+        }
+        dir = pw->pw_dir;
+    }
+    put_quoted(e, dir, strlen(dir));
+    return end;
+}
+
+/**
+ * expand_text - Expand raw text of a word, removing quotes. dquote tells
+ *               whether it's inside double quotes.
+ */
+static void expand_text(expand_t *e, const char *s, size_t len, bool dquote)
+{
+    size_t i = 0;
+
+    if (!dquote && (e->mode & EXP_TILDE)) {
+        i = expand_tilde(e, s, len);
+    }
+    while (i < len) {
+        char ch = s[i];
+
+        switch (ch) {
+        case '\\':
+            if (i + 1 == len) {
+                put(e, s + i++, 1);
+            } else if (s[i+1] == '\n') {
+                i += 2;
+            } else if (dquote && strchr(e->mode & EXP_HEREDOC ? "$`\\" : "$`\"\\", s[i+1]) == NULL) {
+                put_quoted(e, s + i++, 1);
+            } else {
+                put_quoted(e, s + i + 1, 1);
+                i += 2;
+            }
+            break;
+        case '\'': {
+            if (dquote) {
+                put(e, s + i++, 1);
+                break;
+            }
+            const char *quote = memchr(s + i + 1, '\'', len - i - 1);
+            size_t end = quote == NULL ? len : (size_t) (quote - s);
+
+            put_quoted(e, s + i + 1, end - i - 1);
+            e->quoted = true;
+            i = end + 1;
+            break;
+        } case '\"': {
+            if (e->mode & EXP_HEREDOC) {
+                put(e, s + i++, 1);
+                break;
+            }
+            size_t end = lex_skip(s, len, i);
+            bool quoted = e->quoted;
+
+            if (end == LEX_OPEN) {
+                end = len + 1;
+            }
+            e->quoted = true;
+            expand_text(e, s + i + 1, end - i - 2, true);
+            if (e->no_at) {
+                // "$@" without parameters makes no field
+                e->quoted = quoted || e->len > 0;
+                e->no_at = false;
+            }
+            i = end;
+            break;
+        } case '`':
+            i = expand_backquote(e, s, len, i, dquote);
+            break;
+        case '$':
+            i = expand_dollar(e, s, len, i, dquote);
+            break;
+        default:
+            if (dquote) {
+                put_quoted(e, s + i, 1);
+            } else {
+                if (ch == '*' || ch == '?') {
+                    e->glob = true;
+                } else if (ch == '[') {
+                    e->bracket = true;
+                }
+                put(e, s + i, 1);
+            }
+            ++i;
+            break;
+        }
+    }
+}
+
+/**
+ * expand_word - Expand a word into fields.
+ */
+static void expand_word(const char *s, size_t len, strvec_t *fields)
+{
+    expand_t e;
+
+    exp_init(&e, fields, EXP_SPLIT | EXP_TILDE);
+    expand_text(&e, s, len, false);
+    end_field(&e, false);
+    exp_done(&e);
+}
+
+/**
+ * expand_words - Expand n words of prog from first on into fields.
+ */
+static void expand_words(const prog_t *prog, uint32_t first, uint32_t n, strvec_t *fields)
+{
+    for (uint32_t i = first; i < first + n; ++i) {
+        expand_word(word_text(prog, prog->words[i]), prog->words[i].len, fields);
+    }
+}
+
+/**
+ * expand_args - Expand words of cmd after its assignments into argv.
+ */
+static void expand_args(const prog_t *prog, const cmd_t *cmd, strvec_t *argv)
+{
+    expand_words(prog, cmd->word + cmd->nassigns, cmd->nwords - cmd->nassigns, argv);
+}
+
+/**
+ * assign - Do assignments before the command. Variables are exported if
+ *          export is true. Return false if a value can't be expanded, which
+ *          is left unassigned with those after it.
+ */
+static bool assign(const prog_t *prog, const cmd_t *cmd, bool export)
+{
+    for (uint32_t i = cmd->word; i < cmd->word + cmd->nassigns; ++i) {
+        const char *text = word_text(prog, prog->words[i]);
+        const char *equal = strchr(text, '=');
+        mark_t mark = arena_mark();
+        const char *value = expand_string(equal + 1, prog->words[i].len - (equal + 1 - text), EXP_TILDE);
+
+        if (expand_failed) {
+            arena_release(mark);
+            return false;
+        }
+        set_var(text, equal - text, value, export);
+        arena_release(mark);
+    }
+    return true;
+}
+
+/**
+ * save_assigns - Keep old values of variables assigned before a builtin in
+ *                old, and do the assignments. Return false if they fail.
+ */
+static bool save_assigns(const prog_t *prog, const cmd_t *cmd, char *old[])
+{
+    for (uint32_t i = 0; i < cmd->nassigns; ++i) {
+        const char *text = word_text(prog, prog->words[cmd->word+i]);
+        const char *value = get_var(text, strchr(text, '=') - text);
+
+        old[i] = value == NULL ? NULL : strdup(value);
+    }
+    return assign(prog, cmd, false);
+}
+
+/**
+ * restore_assigns - Restore variables assigned before a builtin.
+ */
+static void restore_assigns(const prog_t *prog, const cmd_t *cmd, char *old[])
+{
+    for (uint32_t i = 0; i < cmd->nassigns; ++i) {
+        const char *text = word_text(prog, prog->words[cmd->word+i]);
+        size_t len = strchr(text, '=') - text;
+
+        if (old[i] != NULL) {
+            set_var(text, len, old[i], false);
+            free(old[i]);
+        } else {
+            mark_t mark = arena_mark();
+
+            unset_var(arena_strndup(text, len));
+            arena_release(mark);
+        }
+    }
+}
+
+/**
+ * rotate_target - Return whether redir is ">|rotate:...", writing a log
+ *                 rotated by size.
+ */
+static bool rotate_target(const prog_t *prog, const redir_t *redir)
+{
+    return redir->kind == R_CLOBBER && strncmp(word_text(prog, redir->target), "rotate:", 7) == 0;
+}
+
+/**
+ * open_log - Open a pipe to the rotating log redir writes, which the shell
+ *            pumps. Return the write end, or -1 on failure.
+ */
+static int open_log(const prog_t *prog, const redir_t *redir)
+{
+    mark_t mark = arena_mark();
+    const char *target = expand_string(word_text(prog, redir->target), redir->target.len, EXP_TILDE);
+    int fd = strncmp(target, "rotate:", 7) == 0 ? rotate_open(target + 7) : -1;
+
+    arena_release(mark);
+    return fd;
+}
+
+/**
+ * open_logs - Open pipes to rotating logs for redirects of cmd before a
+ *             child runs it, since the pump must stay in the shell. fds
+ *             gets -1 for other redirects.
+ */
+static void open_logs(const prog_t *prog, const cmd_t *cmd, int fds[])
+{
+    for (uint32_t i = 0; i < cmd->nredirs; ++i) {
+        const redir_t *redir = &prog->redirs[cmd->redir + i];
+
+        fds[i] = rotate_target(prog, redir) ? open_log(prog, redir) : -1;
+    }
+}
+
+/**
+ * close_logs - Close pipes of the shell opened by open_logs.
+ */
+static void close_logs(const int fds[], size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+}
+
+/**
+ * make_redirects - Expand targets of redirects of cmd into redirects, which
+ *                  ends with NO. Return false if some can't be done.
+ */
+static bool make_redirects(const prog_t *prog, const cmd_t *cmd, redirect_t *redirects)
+{
+    size_t n = 0;
+
+    for (uint32_t i = cmd->redir; i < cmd->redir + cmd->nredirs; ++i) {
+        const redir_t *redir = &prog->redirs[i];
+        bool doc = redir->kind == R_HEREDOC || redir->kind == R_HEREDOC_RAW;
+        bool input = redir->kind == R_IN || redir->kind == R_DUPIN || doc;
+        int fd = redir->fd >= 0 ? redir->fd : input ? STDIN_FILENO : STDOUT_FILENO;
+        unsigned type = input ? (fd == 0 ? IN : IN | FD) : fd == 1 ? OUT : fd == 2 ? ERR : FD;
+
+        redirects[n].fd = fd;
+        if (doc) {
+            const char *body = word_text(prog, redir->target);
+
+            // a quoted delimiter keeps the body as it is
+            if (redir->kind == R_HEREDOC) {
+                body = expand_string(body, redir->target.len, EXP_HEREDOC);
+            }
+            if (expand_failed) {
+                redirects[n].type = NO;
+                return drop_logs(redirects);
+            }
+            redirects[n].type = type | HEREDOC;
+            redirects[n].filename[0] = '\0';
+            redirects[n].doc = body;
+            redirects[n++].doc_len = redir->kind == R_HEREDOC ? strlen(body) : redir->target.len;
+            continue;
+        }
+        if (rotate_target(prog, redir)) {
+            // opened by the shell already if it's run in a child
+            int log = cmd == log_cmd ? log_fds[i - cmd->redir] : open_log(prog, redir);
+
+            if (log < 0) {
+                redirects[n].type = NO;
+                return drop_logs(redirects);
+            }
+            redirects[n].type = type | PIPE;
+            redirects[n].filename[0] = '\0';
+            redirects[n++].from = log;
+            continue;
+        }
+        const char *target = expand_string(word_text(prog, redir->target), redir->target.len, EXP_TILDE);
+
+        if (expand_failed) {
+            redirects[n].type = NO;
+            return drop_logs(redirects);
+        }
+        if (redir->kind == R_APPEND) {
+            type |= APPEND;
+        } else if (redir->kind == R_DUPIN || redir->kind == R_DUPOUT) {
+            char *end = NULL;
+            long from = strtol(target, &end, 10);
+
+            if (strcmp(target, "-") == 0) {
+                type |= CLOSE;
+                target = "";
+            } else if (end == target || *end != '\0' || from < 0 || from > INT_MAX) {
+                printf("%s: bad file descriptor\n", target);
+                redirects[n].type = NO;
+                return drop_logs(redirects);
+            } else if (from == fd) {
+                continue;
+            } else {
+                type |= DUP;
+                redirects[n].from = from;
+            }
+        }
+        redirects[n].type = type;
+        copybuf(redirects[n++].filename, target, NAME_MAX - 1);
+    }
+    redirects[n].type = NO;
+    return true;
+}
+
+/**
+ * push_redirects - Apply redirects of cmd to the shell itself until the
+ *                  matching pop_redirects. Return false on failure.
+ */
+static bool push_redirects(const prog_t *prog, const cmd_t *cmd)
+{
+    if (redir_depth == redir_cap) {
+        size_t cap = redir_cap == 0 ? 8 : redir_cap * 2;
+        redir_frame_t *tmp = realloc(redir_stack, cap * sizeof(*tmp));
+
+        if (tmp == NULL) {
+            unix_fatal("realloc error");
+        }
+        redir_stack = tmp;
+        redir_cap = cap;
+    }
+    redir_frame_t *frame = &redir_stack[redir_depth++];
+    mark_t mark = arena_mark();
+    redirect_t redirects[cmd->nredirs + 1];
+
+    memset(&frame->saved, 0, sizeof(frame->saved));
+    fflush(stdout);
+    frame->logs = rotate_mark();
+    bool ok = make_redirects(prog, cmd, redirects) && redirect(redirects, &frame->saved);
+
+    arena_release(mark);
+    return ok;
+}
+
+/**
+ * pop_redirects - Undo the last push_redirects.
+ */
+static void pop_redirects(void)
+{
+    redir_frame_t *frame = &redir_stack[--redir_depth];
+
+    fflush(stdout);
+    restore_fds(&frame->saved);
+    rotate_sync(frame->logs);
+}
+
+/**
+ * str2sig - Convert name or number of a signal to the number. Return -1 if
+ *           it's not a signal.
+ */
+static int str2sig(const char *str)
+{
+    if (isdigit((unsigned char) *str)) {
+        int sig = atoi(str);
+
+        return sig < NSIG ? sig : -1;
+    }
+    if (strncmp(str, "SIG", 3) == 0) {
+        str += 3;
+    }
+    for (int sig = 1; sig < NSIG; ++sig) {
+        const char *name = sigabbrev_np(sig);
+
+        if (name != NULL && strcmp(name, str) == 0) {
+            return sig;
+        }
+    }
+    return -1;
+}
+
+/**
+ * running_jobs - Count background jobs running now.
+ */
+static unsigned running_jobs(void)
+{
+    unsigned n = 0;
+
+    if (jobctl) {
+#ifndef DEBUG
+        for (size_t i = 0; i < MAXARGS; ++i) {
+            n += jobs[i].state == BG;
+        }
+#endif
+        return n;
+    }
+    if (nbg_fds == 0) {
+        return 0;
+    }
+    // a pidfd is readable once its process has finished
+    struct pollfd fds[nbg_fds];
+
+    for (size_t i = 0; i < nbg_fds; ++i) {
+        fds[i].fd = bg_fds[i];
+        fds[i].events = POLLIN;
+    }
+    if (poll(fds, nbg_fds, 0) < 0) {
+        unix_fatal("poll error");
+    }
+    for (size_t i = 0; i < nbg_fds; ++i) {
+        if (fds[i].revents != 0) {
+            close(fds[i].fd);
+        } else {
+            bg_fds[n++] = fds[i].fd;
+        }
+    }
+    nbg_fds = n;
+    return n;
+}
+
+/**
+ * admit_job - Judge whether one more background job can start now. One can
+ *             always start when none is running, so that the queue moves.
+ */
+static bool admit_job(void)
+{
+    unsigned running = running_jobs();
+
+    if (running == 0) {
+        return true;
+    }
+    return (admit_jobs == 0 || running < admit_jobs)
+        && (admit_pressure <= 0 || cpu_pressure() < admit_pressure)
+        && (admit_load <= 0 || cpu_load() < admit_load);
+}
+
+/**
+ * track_job - Keep a pidfd of the last process of a background job started
+ *             without job control, to count it while it runs.
+ */
+static void track_job(pid_t pid)
+{
+    int fd = fd_shell(syscall(SYS_pidfd_open, pid, 0));
+
+    if (fd < 0) {
+        unix_error("pidfd_open error");
+        return;
+    }
+    if (nbg_fds == bg_fds_cap) {
+        bg_fds_cap = bg_fds_cap == 0 ? 16 : bg_fds_cap * 2;
+        int *tmp = realloc(bg_fds, bg_fds_cap * sizeof(*bg_fds));
+
+        if (tmp == NULL) {
+            unix_fatal("realloc error");
+        }
+        bg_fds = tmp;
+    }
+    bg_fds[nbg_fds++] = fd;
+}
+
+/**
+ * wait_admission - Wait until a background job can start without job
+ *                  control. Deadlines passing meanwhile are enforced.
+ */
+static void wait_admission(void)
+{
+    while (!admit_job()) {
+        struct pollfd fds[nbg_fds + 1];
+
+        for (size_t i = 0; i < nbg_fds; ++i) {
+            fds[i].fd = bg_fds[i];
+            fds[i].events = POLLIN;
+        }
+        fds[nbg_fds].fd = wheel_fd();
+        fds[nbg_fds].events = POLLIN;
+        fds[nbg_fds].revents = 0;
+        if (poll(fds, nbg_fds + 1, ADMIT_INTERVAL) < 0 && errno != EINTR) {
+            unix_fatal("poll error");
+        }
+        if (fds[nbg_fds].revents & POLLIN) {
+            wheel_expire();
+        }
+    }
+}
+
+#ifndef DEBUG
+/**
+ * queued_jobs - Judge whether any job is waiting to be admitted.
+ */
+static bool queued_jobs(void)
+{
+    for (size_t i = 0; i < MAXARGS; ++i) {
+        if (jobs[i].state == QUEUED) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * admit_queued - Start queued jobs in the order they came, while they can be
+ *                admitted.
+ */
+static void admit_queued(void)
+{
+    sigset_t mask;
+    sigset_t prev;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    while (true) {
+        job_t *first = NULL;
+
+        for (size_t i = 0; i < MAXARGS; ++i) {
+            if (jobs[i].state == QUEUED && (first == NULL || jobs[i].seq < first->seq)) {
+                first = &jobs[i];
+            }
+        }
+        if (first == NULL || !admit_job()) {
+            break;
+        }
+        first->state = BG;
+        jobshm_update(first - jobs);
+        open_gate(first);
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+#endif
+
+#ifndef DEBUG
+/**
+ * addjob - Add a job to the job list. Return it, or NULL if it can't.
+ */
+static job_t *addjob(job_t *jobs, pid_t pid, pid_t last, enum STATE state, const char *cmd, unsigned num)
+{
+    if (pid < 1) {
+        return NULL;
+    }
+    for (size_t i = 0; i < MAXARGS; ++i) {
+        if (jobs[i].pid == 0) {
+            struct timespec ts;
+
+            clock_gettime(CLOCK_REALTIME, &ts);
+            jobs[i].num = num;
+            jobs[i].pid = pid;
+            jobs[i].last = last;
+            jobs[i].jid = i + 1;
+            jobs[i].state = state;
+            jobs[i].deadline = 0;
+            jobs[i].status = 0;
+            jobs[i].start = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+            copybuf(jobs[i].name, cmd, MAXLINE - 1);
+            jobstat_add(last);
+            jobshm_update(i);
+            return &jobs[i];
+        }
+    }
+    printf("Too many jobs now!");
+    return NULL;
+}
+#endif
+
+#ifndef DEBUG
+/**
+ * wait_event - Sleep until a signal is caught, with signals unblocked as in
+ *              mask meanwhile unless it's NULL. Deadlines of jobs passing
+ *              meanwhile are enforced, and queued jobs are admitted if they
+ *              can start.
+ */
+static void wait_event(const sigset_t *mask)
+{
+    struct pollfd pfd = {wheel_fd(), POLLIN, 0};
+    // queued jobs are checked from time to time, as pressure may go down
+    struct timespec interval = {0, ADMIT_INTERVAL * 1000000L};
+
+    if (ppoll(&pfd, 1, queued_jobs() ? &interval : NULL, mask) > 0) {
+        wheel_expire();
+    }
+    admit_queued();
+}
+
+/**
+ * waitfg - Wait process in foreground to stop.
+ */
+static void waitfg(const job_t jobs[])
+{
+    while (fgpid(jobs) != 0) {
+        wait_event(NULL);
+    }
+}
+
+/**
+ * listjobs - List present jobs.
+ */
+static void listjobs(const job_t jobs[])
+{
+    long long now = monotonic_ms();
+
+    for (size_t i = 0; i < MAXARGS; ++i) {
+        if (jobs[i].pid != 0) {
+            if (jobs[i].deadline > 0) {
+                // round it up as the deadline has not come yet
+                printf("(%llds left) ", (jobs[i].deadline - now + 999) / 1000);
+            }
+            print_job(&jobs[i], jobs[i].state);
+        }
+    }
+}
+
+/**
+ * arg2job - Get the job referred to by "%jid".
+ */
+static job_t *arg2job(const char *arg)
+{
+    if (arg[0] != '%') {
+        fputs("There must be '%' before job id.\n", stdout);
+        return NULL;
+    }
+    job_t *job = getjob(jobs, atoi(arg + 1));
+
+    if (job == NULL) {
+        printf("%s: No such job.\n", arg);
+    }
+    return job;
+}
+
+/**
+ * do_bgfg - Execute bg of fg command.
+ */
+static int do_bgfg(char *argv[])
+{
+    job_t *job = arg2job(argv[1] != NULL ? argv[1] : "%1");
+
+    if (job == NULL) {
+        return 1;
+    }
+    pid_t pid = job->pid;
+
+    switch (strcmp(argv[0], "bg")) {
+    case 0:
+        if (job->state == BG) {
+            app_error("Job already in background.");
+            return 1;
+        }
+        job->state = BG;
+        jobshm_update(job - jobs);
+        open_gate(job);
+        if (kill(-pid, SIGCONT) < 0) {
+            unix_fatal("kill error");
+        }
+        print_job(job, CONTINUED);
+        break;
+    default:
+        job->state = FG;
+        jobshm_update(job - jobs);
+        open_gate(job);
+        fg_status = 0;
+        set_terminal(job->pid);
+        if (kill(-pid, SIGCONT) < 0) {
+            unix_fatal("kill error");
+        }
+        waitfg(jobs);
+        set_terminal(getpid());
+        return fg_status;
+    }
+    return 0;
+}
+
+/**
+ * do_kill - Send a signal to processes or jobs.
+ */
+static int do_kill(char *argv[])
+{
+    int sig = SIGTERM;
+    int status = 0;
+
+    ++argv;
+    if (*argv != NULL && strcmp(*argv, "-l") == 0) {
+        for (sig = 1; sig < NSIG; ++sig) {
+            if (sigabbrev_np(sig) != NULL) {
+                printf("%2d) SIG%s\n", sig, sigabbrev_np(sig));
+            }
+        }
+        return 0;
+    }
+    if (*argv != NULL && (*argv)[0] == '-') {
+        const char *name = strcmp(*argv, "-s") == 0 || strcmp(*argv, "-n") == 0
+            ? *++argv : *argv + 1;
+
+        if (name == NULL || (sig = str2sig(name)) < 0) {
+            printf("kill: %s: invalid signal specification\n", name == NULL ? "" : name);
+            return 2;
+        }
+        ++argv;
+    }
+    if (*argv == NULL) {
+        app_error("kill: usage: kill [-s sigspec | -sigspec] pid | %jid ...");
+        return 2;
+    }
+    for (; *argv != NULL; ++argv) {
+        pid_t pid = 0;
+
+        if ((*argv)[0] == '%') {
+            job_t *job = arg2job(*argv);
+
+            if (job == NULL) {
+                status = 1;
+                continue;
+            }
+            pid = -job->pid;
+        } else if ((pid = atoi(*argv)) == 0 && strcmp(*argv, "0") != 0) {
+            printf("kill: %s: arguments must be process or job IDs\n", *argv);
+            status = 1;
+            continue;
+        }
+        if (kill(pid, sig) < 0) {
+            unix_error("kill");
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/**
+ * bgjob_left - Judge whether a job to be waited for is still running. Job jid
+ *              is waited for, or all jobs if jid is 0.
+ */
+static bool bgjob_left(unsigned jid)
+{
+    for (size_t i = 0; i < MAXARGS; ++i) {
+        if ((jobs[i].state == BG || jobs[i].state == QUEUED) && (jid == 0 || jobs[i].jid == jid)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * wait_target - Get the pid of the last process of the job arg refers to as
+ *               "%jid" or a pid. Return 0 if there's no such job.
+ */
+static pid_t wait_target(const char *arg)
+{
+    pid_t pid = 0;
+
+    if (arg[0] == '%' && jobctl) {
+        job_t *job = getjob(jobs, atoi(arg + 1));
+
+        pid = job == NULL ? 0 : job->last;
+    } else if (arg[0] == '%') {
+        pid = jobstat_find(atoi(arg + 1));
+    } else if ((pid = atoi(arg)) > 0 && jobctl) {
+        // a job is known by its group as well
+        for (size_t i = 0; i < MAXARGS; ++i) {
+            if (jobs[i].pid == pid) {
+                pid = jobs[i].last;
+                break;
+            }
+        }
+    }
+    if (pid <= 0) {
+        printf("%s: No such job.\n", arg);
+        return 0;
+    }
+    return pid;
+}
+
+/**
+ * job_output - Print the last output of jobs given as "%jid" or a pid, kept
+ *              with "ring". Return 1 if any has none.
+ */
+static int job_output(char *argv[])
+{
+    int status = 0;
+
+    if (*argv == NULL) {
+        app_error("jobs: usage: jobs [-o %jid | pid ...]");
+        return 2;
+    }
+    for (; *argv != NULL; ++argv) {
+        pid_t pid = wait_target(*argv);
+        char *data = NULL;
+        size_t len = 0;
+
+        if (pid == 0) {
+            status = 1;
+        } else if (!jobring_copy(pid, &data, &len)) {
+            printf("%s: No output kept.\n", *argv);
+            status = 1;
+        } else {
+            fwrite(data, 1, len, stdout);
+            free(data);
+        }
+    }
+    return status;
+}
+
+/**
+ * do_jobs - List present jobs, or print the last output of some with "-o".
+ */
+static int do_jobs(char *argv[])
+{
+    if (argv[1] != NULL && strcmp(argv[1], "-o") == 0) {
+        return job_output(argv + 2);
+    }
+    listjobs(jobs);
+    return 0;
+}
+
+/**
+ * do_wait - Wait for background jobs with "wait", for each job given as
+ *           "%jid" or a pid, or for the first job to finish with "wait -n".
+ *           Statuses of jobs are kept as they finish, so a wakeup costs no
+ *           scan of them. Return the status of the last job waited for.
+ */
+static int do_wait(char *argv[])
+{
+    sigset_t mask;
+    sigset_t prev;
+    int status = 0;
+    bool all = argv[1] == NULL;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, &prev) < 0) {
+        unix_fatal("sigprocmask error");
+    }
+    if (argv[1] != NULL && strcmp(argv[1], "-n") == 0) {
+        pid_t pid = 0;
+
+        while ((pid = jobstat_next(&status)) == 0) {
+            wait_event(&prev);
+        }
+        if (pid < 0) {
+            status = 127;
+        }
+    } else if (argv[1] != NULL) {
+        for (++argv; *argv != NULL; ++argv) {
+            pid_t pid = wait_target(*argv);
+
+            while (pid > 0 && (status = jobstat_get(pid)) == JOBSTAT_RUNNING) {
+                wait_event(&prev);
+            }
+            if (pid > 0 && status == JOBSTAT_UNKNOWN) {
+                printf("%s: Not a job of this shell.\n", *argv);
+            }
+            if (pid == 0 || status == JOBSTAT_UNKNOWN) {
+                status = 127;
+            }
+        }
+    } else if (!jobctl) {
+        // other processes of pipelines are waited for as well
+        pid_t child = 0;
+
+        while ((child = wait_child(-1, &status)) > 0 || errno == EINTR) {
+            if (child > 0) {
+                wheel_cancel(child);
+                jobstat_done(child, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+            }
+        }
+    } else {
+        while (bgjob_left(0)) {
+            wait_event(&prev);
+        }
+    }
+    if (all) {
+        // they are all waited for
+        while (jobstat_next(&status) > 0) {
+        }
+        status = 0;
+    }
+    if (sigprocmask(SIG_SETMASK, &prev, NULL) < 0) {
+        unix_fatal("sigprocmask error");
+    }
+    // logs of the jobs waited for are complete as well
+    rotate_sync(0);
+    return status;
+}
+#endif
+
+/**
+ * do_exit - Exit the shell.
+ */
+static int do_exit(char *argv[])
+{
+#ifndef DEBUG
+    if (jobctl) {
+        kill_bg(jobs);
+    }
+#endif
+    exit(argv[1] == NULL ? last_status : atoi(argv[1]));
+}
+
+/**
+ * do_exec - Replace the shell with a command. Without one, redirects of exec
+ *           are kept by the shell, so descriptors opened by them are held
+ *           and inherited by commands from then on.
+ */
+static int do_exec(char *argv[])
+{
+    if (argv[1] == NULL) {
+        keep_redirects = true;
+        return 0;
+    }
+    fflush(stdout);
+    mysignal(SIGINT, SIG_DFL);
+    mysignal(SIGTSTP, SIG_DFL);
+    change_ttyio(SIG_DFL);
+    int status = exec_command(argv + 1);
+
+    // a script can't go on without what it's replaced with
+    if (!jobctl) {
+        exit(status);
+    }
+#ifndef DEBUG
+    mysignal(SIGINT, sigint_handler);
+    mysignal(SIGTSTP, sigint_handler);
+    change_ttyio(SIG_IGN);
+#endif
+    return status;
+}
+
+/**
+ * do_cd - Change current directory.
+ */
+static int do_cd(char *argv[])
+{
+    const char *dir = argv[1];
+
+    if (dir == NULL) {
+        const char *home = get_var("HOME", 4);
+
+        dir = home == NULL ? "" : home;
+    }
+    if (chdir(dir) != 0) {
+        switch (errno) {
+        case EACCES :
+            app_error("cd: Permission denied.");
+            break;
+        case ENOENT:
+            app_error("cd: No such directory.");
+            break;
+        default:
+            unix_error("chdir error");
+            break;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * do_export - Export variables, assigning them if "=value" follows.
+ */
+static int do_export(char *argv[])
+{
+    int status = 0;
+
+    if (argv[1] == NULL) {
+        extern char **environ;
+
+        for (char **env = environ; *env != NULL; ++env) {
+            printf("export %s\n", *env);
+        }
+        return 0;
+    }
+    for (++argv; *argv != NULL; ++argv) {
+        const char *equal = strchr(*argv, '=');
+        size_t len = equal == NULL ? strlen(*argv) : (size_t) (equal - *argv);
+
+        if (!is_name(*argv, len)) {
+            printf("export: `%s': not a valid identifier\n", *argv);
+            status = 1;
+        } else if (equal == NULL) {
+            export_var(*argv, len);
+        } else {
+            set_var(*argv, len, equal + 1, true);
+        }
+    }
+    return status;
+}
+
+/**
+ * do_unset - Remove variables.
+ */
+static int do_unset(char *argv[])
+{
+    for (++argv; *argv != NULL; ++argv) {
+        unset_var(*argv);
+    }
+    return 0;
+}
+
+/**
+ * do_shift - Drop positional parameters.
+ */
+static int do_shift(char *argv[])
+{
+    int n = argv[1] == NULL ? 1 : atoi(argv[1]);
+
+    if (n < 0 || n > param_num()) {
+        return 1;
+    }
+    shift_params(n);
+    return 0;
+}
+
+/**
+ * read_byte - Read a byte from standard input. Regular files are read by
+ *             blocks and the file offset is moved back after the line, so
+ *             that nothing after it is taken from other commands.
+ */
+static int read_byte(bool seekable, char *buf, size_t *pos, size_t *len)
+{
+    if (*pos == *len) {
+        ssize_t n = 0;
+
+        while ((n = read(STDIN_FILENO, buf, seekable ? 128 : 1)) < 0 && errno == EINTR) {
+            ;
+        }
+        if (n <= 0) {
+            return EOF;
+        }
+        *pos = 0;
+        *len = n;
+    }
+    return (unsigned char) buf[(*pos)++];
+}
+
+/**
+ * do_read - Read a line from standard input, and split it into variables by
+ *           IFS. The last variable takes the rest of the line.
+ */
+static int do_read(char *argv[])
+{
+    bool raw = argv[1] != NULL && strcmp(argv[1], "-r") == 0;
+    bool seekable = lseek(STDIN_FILENO, 0, SEEK_CUR) >= 0;
+    char buf[128];
+    size_t pos = 0;
+    size_t len = 0;
+    int ch = 0;
+    expand_t e;
+
+    fflush(stdout);
+    exp_init(&e, NULL, 0);
+    put(&e, "", 0);
+    while ((ch = read_byte(seekable, buf, &pos, &len)) != EOF && ch != '\n') {
+        char c = ch;
+
+        if (c == '\\' && !raw) {
+            if ((ch = read_byte(seekable, buf, &pos, &len)) == EOF) {
+                break;
+            } else if (ch == '\n') {
+                continue;
+            }
+            c = ch;
+        }
+        put(&e, &c, 1);
+    }
+    if (pos < len) {
+        lseek(STDIN_FILENO, (off_t) pos - (off_t) len, SEEK_CUR);
+    }
+    char **names = argv + 1 + raw;
+    const char *ifs = get_var("IFS", 3);
+    char *line = e.buf;
+
+    if (ifs == NULL) {
+        ifs = " \t\n";
+    }
+    if (*names == NULL) {
+        set_var("REPLY", 5, line, false);
+    }
+    for (; *names != NULL; ++names) {
+        line += strspn(line, ifs);
+        size_t n = names[1] == NULL ? strlen(line) : strcspn(line, ifs);
+
+        if (names[1] == NULL) {
+            // trailing blanks are not kept
+            while (n > 0 && strchr(ifs, line[n-1]) != NULL) {
+                --n;
+            }
+        }
+        char saved = line[n];
+
+        line[n] = '\0';
+        set_var(*names, strlen(*names), line, false);
+        line[n] = saved;
+        line += n;
+        if (*line != '\0' && names[1] != NULL) {
+            ++line;
+        }
+    }
+    exp_done(&e);
+    return ch == EOF && e.len == 0 ? 1 : 0;
+}
+
+/**
+ * pin_prefix - Judge whether argv is "pin [-m] CPULIST command ...", which
+ *              pins and runs the command in a child.
+ */
+static bool pin_prefix(char *argv[])
+{
+    if (strcmp(argv[0], "pin") != 0) {
+        return false;
+    }
+    int i = 1 + (argv[1] != NULL && strcmp(argv[1], "-m") == 0);
+
+    return argv[i] != NULL && argv[i+1] != NULL;
+}
+
+/**
+ * pin_command - Pin this process to CPUs given after "pin" in argv. Return
+ *               the command following them, or NULL on failure.
+ */
+static char **pin_command(char *argv[])
+{
+    bool mem = argv[1] != NULL && strcmp(argv[1], "-m") == 0;
+    const char *list = argv[1+mem];
+    cpu_set_t set;
+
+    if (list == NULL) {
+        app_error("pin: usage: pin [-m] CPULIST [command ...] | [-m] auto | off");
+        return NULL;
+    }
+    if (!parse_cpus(list, &set)) {
+        printf("pin: %s: invalid CPU list\n", list);
+        return NULL;
+    }
+    return pin_cpus(&set, mem) ? argv + 2 + mem : NULL;
+}
+
+/**
+ * timeout_prefix - Judge whether the first word of cmd is "timeout", so that
+ *                  its words are expanded in the shell to set a deadline.
+ */
+static bool timeout_prefix(const prog_t *prog, const cmd_t *cmd)
+{
+    const word_t *word = &prog->words[cmd->word+cmd->nassigns];
+
+    return cmd->code == NO_CODE && cmd->nwords > cmd->nassigns
+        && word->len == 7 && memcmp(word_text(prog, *word), "timeout", 7) == 0;
+}
+
+/**
+ * timeout_command - Parse "timeout [-s SIG] [-k DURATION] DURATION command
+ *                   ..." in argv into limit. A job ignoring SIG is killed 5s
+ *                   later by default. Return the command, or NULL if it's
+ *                   malformed.
+ */
+static char **timeout_command(char *argv[], limit_t *limit)
+{
+    limit->sig = SIGTERM;
+    limit->grace = 5000;
+    for (++argv; *argv != NULL && (*argv)[0] == '-'; argv += 2) {
+        if (argv[1] == NULL) {
+            break;
+        } else if (strcmp(*argv, "-s") == 0) {
+            if ((limit->sig = str2sig(argv[1])) <= 0) {
+                printf("timeout: %s: invalid signal specification\n", argv[1]);
+                return NULL;
+            }
+        } else if (strcmp(*argv, "-k") != 0 || !parse_duration(argv[1], &limit->grace)) {
+            break;
+        }
+    }
+    if (*argv == NULL || argv[1] == NULL || !parse_duration(*argv, &limit->ms)) {
+        app_error("timeout: usage: timeout [-s signal] [-k duration] duration command ...");
+        return NULL;
+    }
+    return argv + 1;
+}
+
+/**
+ * coproc_prefix - Judge whether cmd is "coproc NAME command ...", which runs
+ *                 the command in background with its input and output
+ *                 connected to pipes kept by the shell.
+ */
+static bool coproc_prefix(const prog_t *prog, const cmd_t *cmd)
+{
+    const word_t *word = &prog->words[cmd->word+cmd->nassigns];
+
+    return cmd->code == NO_CODE && cmd->nwords > cmd->nassigns
+        && word->len == 6 && memcmp(word_text(prog, *word), "coproc", 6) == 0;
+}
+
+/**
+ * coproc_command - Take NAME of "coproc NAME command ..." in argv. Return the
+ *                  command, or NULL if it's malformed.
+ */
+static char **coproc_command(char *argv[], const char **name)
+{
+    if (argv[1] == NULL || argv[2] == NULL || !is_name(argv[1], strlen(argv[1]))) {
+        app_error("coproc: usage: coproc NAME command ...");
+        return NULL;
+    }
+    *name = argv[1];
+    return argv + 2;
+}
+
+/**
+ * set_coproc - Set NAME_IN, NAME_OUT or NAME_PID of a coprocess to value, or
+ *              unset it if value is -1.
+ */
+static void set_coproc(const char *name, const char *suffix, long value)
+{
+    char var[strlen(name) + 5];
+    char buf[32];
+
+    snprintf(var, sizeof(var), "%s_%s", name, suffix);
+    if (value < 0) {
+        unset_var(var);
+        return;
+    }
+    snprintf(buf, sizeof(buf), "%ld", value);
+    set_var(var, strlen(var), buf, false);
+}
+
+/**
+ * add_coproc - Keep the ends of the shell of pipes of a coprocess called
+ *              name, whose last process is pid. They are moved out of the
+ *              range users pick and added to the table, so that redirects of
+ *              later commands like ">&$NAME_IN" reach them, while they are
+ *              still closed on exec otherwise. Pipes of the last coprocess
+ *              called name are closed, so that it sees the end of input.
+ */
+static void add_coproc(const char *name, int in, int out, pid_t pid)
+{
+    coproc_t *coproc = NULL;
+
+    for (size_t i = 0; i < ncoprocs && coproc == NULL; ++i) {
+        if (strcmp(coprocs[i].name, name) == 0) {
+            coproc = &coprocs[i];
+            fdtab_del(coproc->in);
+            fdtab_del(coproc->out);
+            close(coproc->in);
+            close(coproc->out);
+        }
+    }
+    if (coproc == NULL) {
+        if (ncoprocs == coprocs_cap) {
+            coprocs_cap = coprocs_cap == 0 ? 4 : coprocs_cap * 2;
+            if ((coprocs = realloc(coprocs, coprocs_cap * sizeof(*coprocs))) == NULL) {
+                unix_fatal("realloc error");
+            }
+        }
+        coproc = &coprocs[ncoprocs++];
+        if ((coproc->name = strdup(name)) == NULL) {
+            unix_fatal("strdup error");
+        }
+    }
+    coproc->in = fd_shell(in);
+    coproc->out = fd_shell(out);
+    coproc->pid = pid;
+    coproc->gone = false;
+    fdtab_add(coproc->in);
+    fdtab_add(coproc->out);
+    set_coproc(name, "IN", coproc->in);
+    set_coproc(name, "OUT", coproc->out);
+    set_coproc(name, "PID", pid);
+}
+
+/**
+ * close_coprocs - Close the ends of the shell of pipes of coprocesses which
+ *                 have exited, and unset their variables, so that no later
+ *                 command writes to a pipe nobody reads.
+ */
+static void close_coprocs(void)
+{
+    sigset_t mask;
+    sigset_t prev;
+
+    // the handler of SIGCHLD looks through them
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    coprocs_gone = false;
+    for (size_t i = 0; i < ncoprocs; ) {
+        coproc_t *coproc = &coprocs[i];
+
+        if (!coproc->gone) {
+            ++i;
+            continue;
+        }
+        fdtab_del(coproc->in);
+        fdtab_del(coproc->out);
+        close(coproc->in);
+        close(coproc->out);
+        set_coproc(coproc->name, "IN", -1);
+        set_coproc(coproc->name, "OUT", -1);
+        set_coproc(coproc->name, "PID", -1);
+        free(coproc->name);
+        *coproc = coprocs[--ncoprocs];
+    }
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/**
+ * to_coproc - Judge whether redirects send an output to a pipe of a
+ *             coprocess.
+ */
+static bool to_coproc(const redirect_t *redirects)
+{
+    for (; redirects->type != NO; ++redirects) {
+        for (size_t i = 0; redirect_type(redirects->type) == DUP && i < ncoprocs; ++i) {
+            if (redirects->from == coprocs[i].in) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * do_pin - Show or set automatic placement of pipeline stages with "pin",
+ *          "pin [-m] auto" and "pin off", or pin the shell itself to CPUs.
+ */
+static int do_pin(char *argv[])
+{
+    bool mem = argv[1] != NULL && strcmp(argv[1], "-m") == 0;
+    const char *arg = argv[1+mem];
+
+    if (arg == NULL && !mem) {
+        printf("pin: %s\n", !auto_pin ? "off" : auto_pin_mem ? "auto -m" : "auto");
+    } else if (arg != NULL && strcmp(arg, "auto") == 0) {
+        auto_pin = true;
+        auto_pin_mem = mem;
+    } else if (arg != NULL && strcmp(arg, "off") == 0) {
+        auto_pin = false;
+    } else if (pin_command(argv) == NULL) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * do_ring - Show or set how many bytes of the last output of each background
+ *           job are kept, for "jobs -o", with "ring SIZE" or "ring off".
+ */
+static int do_ring(char *argv[])
+{
+    unsigned long long size = 0;
+
+    if (argv[1] == NULL) {
+        if (ring_size == 0) {
+            printf("ring: off\n");
+        } else {
+            printf("ring: %zu\n", ring_size);
+        }
+        return 0;
+    }
+    if (argv[2] == NULL && strcmp(argv[1], "off") == 0) {
+        ring_size = 0;
+        return 0;
+    }
+    if (argv[2] != NULL || !parse_size(argv[1], &size) || size > 1ULL << 30) {
+        app_error("ring: usage: ring SIZE | off");
+        return 2;
+    }
+    ring_size = size;
+    return 0;
+}
+
+/**
+ * do_admit - Show or set limits on background jobs running at once, with
+ *            "admit [-j JOBS] [-p PRESSURE] [-l LOAD]" or "admit off". Jobs
+ *            beyond them are queued, or held back in a script.
+ */
+static int do_admit(char *argv[])
+{
+    if (argv[1] == NULL) {
+        printf("admit -j %u -p %g -l %g\n", admit_jobs, admit_pressure, admit_load);
+        return 0;
+    }
+    if (strcmp(argv[1], "off") == 0 && argv[2] == NULL) {
+        admit_jobs = 0;
+        admit_pressure = 0;
+        admit_load = 0;
+        return 0;
+    }
+    for (++argv; *argv != NULL; argv += 2) {
+        char *end = NULL;
+        double value = argv[1] == NULL ? -1 : strtod(argv[1], &end);
+
+        if (value < 0 || end == argv[1] || *end != '\0') {
+            app_error("admit: usage: admit [-j jobs] [-p pressure%] [-l load] | off");
+            return 2;
+        }
+        if (strcmp(*argv, "-j") == 0) {
+            admit_jobs = value;
+        } else if (strcmp(*argv, "-p") == 0) {
+            admit_pressure = value;
+        } else if (strcmp(*argv, "-l") == 0) {
+            admit_load = value;
+        } else {
+            app_error("admit: usage: admit [-j jobs] [-p pressure%] [-l load] | off");
+            return 2;
+        }
+    }
+    return 0;
+}
+
+// builtin commands, run without forking
+static const builtin_t builtins[] = {
+    {"exit", do_exit, false},
+    {"exec", do_exec, false},
+    {"cd", do_cd, false},
+#ifndef DEBUG
+    {"jobs", do_jobs, true},
+    {"fg", do_bgfg, false},
+    {"bg", do_bgfg, false},
+    {"kill", do_kill, true},
+    {"wait", do_wait, false},
+#endif
+    {"export", do_export, false},
+    {"unset", do_unset, false},
+    {"shift", do_shift, false},
+    {"read", do_read, false},
+    {"pin", do_pin, false},
+    {"admit", do_admit, false},
+    {"ring", do_ring, false},
+    {":", do_true, true},
+    {"echo", do_echo, true},
+    {"printf", do_printf, true},
+    {"test", do_test, true},
+    {"[", do_bracket, true},
+    {"true", do_true, true},
+    {"false", do_false, true},
+    {"pwd", do_pwd, true},
+    {NULL, NULL, false},
+};
+
+/**
+ * find_builtin - Find the builtin command called name.
+ */
+static const builtin_t *find_builtin(const char *name)
+{
+    for (const builtin_t *builtin = builtins; builtin->name != NULL; ++builtin) {
+        if (strcmp(builtin->name, name) == 0) {
+            return builtin;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * builtin_cmd - Judge whether the command is a builtin command, and run it if
+ *               so. Its status is kept in last_status.
+ */
+static bool builtin_cmd(char **argv)
+{
+    const builtin_t *builtin = find_builtin(*argv);
+
+    if (builtin == NULL) {
+        return false;
+    }
+    trace_begin("builtin", builtin->name);
+    last_status = builtin->run(argv);
+    trace_end("builtin");
+    return true;
+}
+
+/**
+ * pure_builtin - Judge whether a builtin command leaves the shell unchanged,
+ *                so that it can run in the shell for command substitution.
+ */
+static bool pure_builtin(const char *name)
+{
+    const builtin_t *builtin = find_builtin(name);
+
+    return builtin != NULL && builtin->pure;
+}
+
+/**
+ * rc_builtin - Note a builtin command run by the rc file. Those changing
+ *              settings are run again from the snapshot, and those doing
+ *              anything else than changing variables keep it from being
+ *              taken.
+ */
+static void rc_builtin(char **argv)
+{
+    static const char *const keeps[] = {"export", "unset", ":", "true", "false", NULL};
+    static const char *const replays[] = {"pin", "admit", "ring", NULL};
+
+    for (size_t i = 0; replays[i] != NULL; ++i) {
+        if (strcmp(argv[0], replays[i]) == 0) {
+            size_t len = 0;
+
+            for (char **arg = argv; *arg != NULL; ++arg) {
+                len += strlen(*arg) + 1;
+            }
+            char words[len];
+            char *p = words;
+
+            for (char **arg = argv; *arg != NULL; ++arg) {
+                p = stpcpy(p, *arg) + 1;
+            }
+            snap_add(&rc_snap, SNAP_RUN, false, words, len, NULL, 0);
+            return;
+        }
+    }
+    for (size_t i = 0; keeps[i] != NULL; ++i) {
+        if (strcmp(argv[0], keeps[i]) == 0) {
+            return;
+        }
+    }
+    rc_pure = false;
+}
+
+/**
+ * run_builtin - Run a builtin command in the shell with its own redirects.
+ *               Return its status.
+ */
+static int run_builtin(char **argv, const redirect_t *redirects)
+{
+    saved_t saved = {NULL, 0, 0};
+    bool redirected = redirects->type != NO;
+    // a coprocess may exit before it's written to, which is then an error
+    // rather than SIGPIPE killing the shell
+    bool coproc = redirected && to_coproc(redirects);
+    handler_t *pipe_handler = coproc ? mysignal(SIGPIPE, SIG_IGN) : SIG_DFL;
+    int err = 0;
+
+    if (rc_running) {
+        rc_builtin(argv);
+    }
+
+    // output is flushed only when it's going elsewhere
+    if (redirected) {
+        fflush(stdout);
+    }
+    if (!redirect(redirects, &saved)) {
+        last_status = 1;
+    } else {
+        builtin_cmd(argv);
+    }
+    if (redirected && (fflush(stdout) == EOF || ferror(stdout))) {
+        err = errno;
+        // what's left isn't for the output restored
+        __fpurge(stdout);
+        clearerr(stdout);
+    }
+    if (coproc) {
+        mysignal(SIGPIPE, pipe_handler);
+    }
+    if (keep_redirects) {
+        keep_fds(&saved);
+    } else {
+        restore_fds(&saved);
+    }
+    keep_redirects = false;
+    if (err != 0) {
+        printf("%s: write error: %s\n", argv[0], strerror(err));
+        last_status = 1;
+    }
+    return last_status;
+}
+
+/**
+ * block_child - Block signal.
+ */
+static void block_sig(sigset_t *mask)
+{
+    if (sigemptyset(mask) < 0) {
+        unix_fatal("sigemptyset error");
+    }
+    if (sigaddset(mask, SIGCHLD) < 0) {
+        unix_fatal("sigadset error");
+    }
+    if (sigprocmask(SIG_BLOCK, mask, NULL) < 0) {
+        unix_fatal("sigprocmask error");
+    }
+}
+
+/**
+ * unblock_sig : Unblock signals in mask.
+ */
+static void unblock_sig(sigset_t *mask)
+{
+    if (sigprocmask(SIG_UNBLOCK, mask, NULL) < 0) {
+        unix_fatal("sigprocmask error");
+    }
+}
+
+#ifndef DEBUG
+/**
+ * set_group - Call setpgid in the parent process.
+ */
+static void set_group(const pid_t pids[], int sum)
+{
+    for (int i = 0; i < sum; ++i) {
+        grps[pids[i]] = pids[0];
+        if (setpgid(pids[i], pids[0]) < 0 && errno != EACCES) {
+            unix_fatal("setpgid error");
+        }
+    }
+}
+
+/**
+ * set_deadline - Give job a deadline according to limit.
+ */
+static void set_deadline(job_t *job, const limit_t *limit)
+{
+    if (job != NULL && limit->ms > 0) {
+        job->deadline = monotonic_ms() + limit->ms;
+        wheel_add(job->pid, job->deadline, limit->grace, limit->sig);
+    }
+}
+
+/**
+ * add_newjob - Add a new job in foreground, background or the queue, with a
+ *              deadline if limit has one. A queued job waits on the pipe whose
+ *              write end is gate. Return the status of a job in foreground.
+ */
+static int add_newjob(pid_t pid, pid_t last, enum STATE state, unsigned num, const char *name, const limit_t *limit, int gate, sigset_t *mask)
+{
+    if (state == FG) {
+        set_deadline(addjob(jobs, pid, last, FG, name, num), limit);
+        fg_status = 0;
+        set_terminal(pid);
         unblock_sig(mask);
         waitfg(jobs);
         set_terminal(getpid());
+        return fg_status;
+    }
+    job_t *job = addjob(jobs, pid, last, state, name, num);
+
+    if (job != NULL) {
+        job->gate = gate;
+    } else if (gate >= 0) {
+        close(gate);
+    }
+    set_deadline(job, limit);
+    unblock_sig(mask);
+    if (job != NULL && state == QUEUED) {
+        job->seq = ++queue_seq;
+        print_job(job, QUEUED);
+    } else {
+        printf("[%u] %d %s", pid2jid(pid), pid, name);
+    }
+    return 0;
+}
+
+/**
+ * wait_slot - Wait until the job list has room for one more job, unless no
+ *             job in background would make room.
+ */
+static void wait_slot(void)
+{
+    while (bgjob_left(0)) {
+        for (size_t i = 0; i < MAXARGS; ++i) {
+            if (jobs[i].pid == 0) {
+                return;
+            }
+        }
+        wait_event(NULL);
+    }
+}
+
+/**
+ * setpgid_pipe - Set pgid for a process in a pipe.
+ */
+static void setpgid_pipe(pid_t pids[], int number)
+{
+    if (number == 0) {
+        pids[0] = getpid();
+    }
+    grps[getpid()] = pids[0];
+    if (setpgid(getpid(), pids[0]) < 0) {
+        unix_fatal("setpgid error");
+    }
+}
+#endif
+
+/**
+ * hold_gate - Open a pipe for processes of a queued job to wait on, until the
+ *             shell closes gate[1] to admit the job.
+ */
+static void hold_gate(int gate[2])
+{
+    if (pipe2(gate, O_CLOEXEC) < 0) {
+        unix_fatal("pipe error");
+    }
+    gate[0] = fd_shell(gate[0]);
+    gate[1] = fd_shell(gate[1]);
+}
+
+/**
+ * pass_gate - Wait in a child of the shell until the job it's in is admitted,
+ *             before running anything.
+ */
+static void pass_gate(int gate[2])
+{
+    char c;
+
+    close(gate[1]);
+    while (read(gate[0], &c, 1) < 0 && errno == EINTR) {
+    }
+    close(gate[0]);
+}
+
+/**
+ * change_ttyio - Change SIGTTIN and SIGTTOU's handling way.
+ */
+static void change_ttyio(handler_t *handle_way)
+{
+    mysignal(SIGTTIN, handle_way);
+    mysignal(SIGTTOU, handle_way);
+}
+
+/**
+ * enter_subshell - Reset state of the shell in a forked child.
+ */
+static void enter_subshell(void)
+{
+    jobctl = false;
+    wheel_reset();
+    // background jobs of the shell are not the child's
+    for (size_t i = 0; i < nbg_fds; ++i) {
+        close(bg_fds[i]);
+    }
+    nbg_fds = 0;
+    jobstat_clear();
+#ifndef DEBUG
+    // nor are queued ones, which would wait for the child as well
+    for (size_t i = 0; i < MAXARGS; ++i) {
+        if (jobs[i].gate >= 0) {
+            close(jobs[i].gate);
+            jobs[i].gate = -1;
+        }
+    }
+#endif
+    pump_reset();
+    rotate_reset();
+    jobring_reset();
+    jobshm_reset();
+    trace_reset();
+    tail_source = false;
+    mysignal(SIGCHLD, SIG_DFL);
+    mysignal(SIGINT, SIG_DFL);
+    mysignal(SIGTSTP, SIG_DFL);
+    change_ttyio(SIG_DFL);
+}
+
+/**
+ * wait_child - Wait for a child like waitpid while SIGCHLD is blocked. Jobs
+ *              whose deadlines pass meanwhile are signalled.
+ */
+static pid_t wait_child(pid_t pid, int *status)
+{
+    static int sigfd = -1;
+
+    if (!wheel_active()) {
+        pid_t child = waitpid(pid, status, 0);
+
+        child_reaped(child, *status);
+        return child;
+    }
+    if (sigfd < 0) {
+        sigset_t mask;
+
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        if ((sigfd = fd_shell(signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC))) < 0) {
+            unix_fatal("signalfd error");
+        }
+    }
+    while (true) {
+        pid_t child = waitpid(pid, status, WNOHANG);
+
+        if (child != 0) {
+            child_reaped(child, *status);
+            return child;
+        }
+        // a pending SIGCHLD makes sigfd readable
+        struct pollfd fds[2] = {{sigfd, POLLIN, 0}, {wheel_fd(), POLLIN, 0}};
+        struct signalfd_siginfo info;
+
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            unix_fatal("poll error");
+        }
+        while (read(sigfd, &info, sizeof(info)) > 0) {
+            ;
+        }
+        if (fds[1].revents & POLLIN) {
+            wheel_expire();
+        }
+    }
+}
+
+/**
+ * wait_pids - Wait for processes of a pipe without job control. Return the
+ *             status of the last one.
+ */
+static int wait_pids(const pid_t pids[], int sum)
+{
+    int status = 0;
+
+    for (int i = 0; i < sum; ++i) {
+        while (wait_child(pids[i], &status) < 0) {
+            if (errno != EINTR) {
+                unix_fatal("waitpid error");
+            }
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+static int run(const prog_t *prog, uint32_t pc);
+
+/**
+ * tail_position - Judge whether the code from pc, through jumps, does
+ *                 nothing but end.
+ */
+static bool tail_position(const prog_t *prog, uint32_t pc)
+{
+    // a loop jumps back, so jumps followed are bounded
+    for (unsigned n = 0; n < 8 && prog->code[pc].op == OP_JMP; ++n) {
+        pc = prog->code[pc].a;
+    }
+    return prog->code[pc].op == OP_END;
+}
+
+// commands run in chunks when their arguments are too long for exec
+static const batchable_t batchables[] = {
+    {"rm", 0},
+    {"rmdir", 0},
+    {"mkdir", 0},
+    {"touch", 0},
+    {"chmod", 1},
+    {"chown", 1},
+    {"chgrp", 1},
+    {"gzip", 0},
+    {"bzip2", 0},
+    {"xz", 0},
+    {"zstd", 0},
+    {"md5sum", 0},
+    {"sha1sum", 0},
+    {"sha256sum", 0},
+    {"file", 0},
+    {NULL, 0},
+};
+
+/**
+ * arg_space - Return bytes taken by n strings of argv on the stack of a new
+ *             program, with their pointers.
+ */
+static size_t arg_space(char *argv[], size_t n)
+{
+    size_t space = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        space += strlen(argv[i]) + 1 + sizeof(char *);
+    }
+    return space;
+}
+
+/**
+ * arg_max - Return bytes which arguments of a new program may take, after
+ *           the environment.
+ */
+static size_t arg_max(void)
+{
+    extern char **environ;
+    long max = sysconf(_SC_ARG_MAX);
+    size_t env = 0;
+
+    while (environ[env] != NULL) {
+        ++env;
+    }
+    // leave some room as xargs does, and for the terminating pointers
+    size_t used = arg_space(environ, env) + 2048 + 2 * sizeof(char *);
+
+    if (max < 0) {
+        max = 131072;
+    }
+    return (size_t) max > used ? max - used : 0;
+}
+
+/**
+ * batch_fixed - Return the number of words of argv kept in every run of it:
+ *               the command, its options and the operands given by fixed.
+ */
+static size_t batch_fixed(char *argv[], size_t n, unsigned fixed)
+{
+    size_t i = 1;
+
+    while (i < n && argv[i][0] == '-' && argv[i][1] != '\0') {
+        if (strcmp(argv[i++], "--") == 0) {
+            break;
+        }
+    }
+    return i + fixed < n ? i + fixed : n;
+}
+
+/**
+ * chunk_end - Return the end of the chunk of argv beginning at i, when the
+ *             chunk may take space bytes. One word goes to a chunk anyway.
+ */
+static size_t chunk_end(char *argv[], size_t i, size_t n, size_t space)
+{
+    size_t end = i + 1;
+    size_t used = arg_space(argv + i, 1);
+
+    while (end < n && (used += arg_space(argv + end, 1)) <= space) {
+        ++end;
+    }
+    return end;
+}
+
+/**
+ * exec_command - Replace this process with argv. Return the status if it
+ *                fails.
+ */
+static int exec_command(char *argv[])
+{
+    // the process is replaced, so its events are written out first
+    trace_mark("exec", argv[0]);
+    trace_flush();
+    execvp(argv[0], argv);
+    if (errno == ENOENT) {
+        printf("%s: Command not found.\n", argv[0]);
+        return 127;
+    }
+    unix_error(argv[0]);
+    return 126;
+}
+
+/**
+ * run_batches - Run argv like xargs, in chunks small enough for exec. Each
+ *               gets the first fixed words of argv, and up to jobs of them
+ *               run at once. Return the first status which isn't 0, or 126 if
+ *               the fixed words leave no word or no room to run.
+ */
+static int run_batches(char *argv[], size_t fixed, unsigned jobs)
+{
+    size_t n = 0;
+    size_t max = arg_max();
+    size_t used = arg_space(argv, fixed);
+
+    while (argv[n] != NULL) {
+        ++n;
+    }
+    if (fixed >= n || used >= max) {
+        printf("%s: Argument list too long.\n", argv[0]);
+        return 126;
+    }
+    size_t space = max - used;
+    char **chunk = malloc((n + 1) * sizeof(char *));
+    unsigned running = 0;
+    int result = 0;
+
+    if (chunk == NULL) {
+        unix_fatal("malloc error");
+    }
+    memcpy(chunk, argv, fixed * sizeof(char *));
+    fflush(stdout);
+    for (size_t i = fixed; i < n || running > 0; ) {
+        if (i < n && running < jobs) {
+            size_t end = chunk_end(argv, i, n, space);
+
+            trace_begin("fork", NULL);
+            pid_t pid = fork();
+
+            if (pid < 0) {
+                unix_fatal("fork error");
+            } else if (pid == 0) {
+                trace_reset();
+                memcpy(chunk + fixed, argv + i, (end - i) * sizeof(char *));
+                chunk[fixed+end-i] = NULL;
+                fflush(stdout);
+                _exit(exec_command(chunk));
+            }
+            trace_end("fork");
+            trace_child(pid, argv[0]);
+            ++running;
+            i = end;
+            continue;
+        }
+        int status = 0;
+        pid_t pid = wait(&status);
+
+        if (pid < 0) {
+            unix_fatal("wait error");
+        }
+        child_reaped(pid, status);
+        --running;
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        if (result == 0) {
+            result = status;
+        }
+    }
+    free(chunk);
+    return result;
+}
+
+/**
+ * batch_prefix - Judge whether argv is "batch [-P JOBS] [-k FIXED] command
+ *                ...", which runs the command in chunks if its arguments are
+ *                too long for exec.
+ */
+static bool batch_prefix(char *argv[])
+{
+    return strcmp(argv[0], "batch") == 0;
+}
+
+/**
+ * batch_command - Parse options after "batch" in argv into jobs and fixed.
+ *                 Return the command, or NULL if it's malformed.
+ */
+static char **batch_command(char *argv[], unsigned *jobs, int *fixed)
+{
+    for (++argv; *argv != NULL && (*argv)[0] == '-' && argv[1] != NULL; argv += 2) {
+        char *end = NULL;
+        long value = strtol(argv[1], &end, 10);
+
+        if (end == argv[1] || *end != '\0' || value < 0) {
+            break;
+        } else if (strcmp(*argv, "-P") == 0) {
+            // as many as CPUs with 0
+            *jobs = value > 0 ? value : sysconf(_SC_NPROCESSORS_ONLN);
+        } else if (strcmp(*argv, "-k") == 0) {
+            *fixed = value;
+        } else {
+            break;
+        }
+    }
+    if (*argv == NULL || (*argv)[0] == '-') {
+        app_error("batch: usage: batch [-P jobs] [-k fixed] command [argument ...]");
+        return NULL;
+    }
+    return argv;
+}
+
+/**
+ * run_program - Run argv by exec. If its arguments are too long for exec,
+ *               it's run in chunks when it's batchable or batch is true.
+ *               fixed operands are kept in every chunk, or as many as the
+ *               command needs if it's -1. Return the status if it's not
+ *               replaced by exec.
+ */
+static int run_program(char *argv[], unsigned jobs, int fixed, bool batch)
+{
+    size_t n = 0;
+
+    while (argv[n] != NULL) {
+        ++n;
+    }
+    if (arg_space(argv, n) <= arg_max()) {
+        return exec_command(argv);
+    }
+    for (size_t i = 0; fixed < 0 && batchables[i].name != NULL; ++i) {
+        if (strcmp(argv[0], batchables[i].name) == 0) {
+            fixed = batchables[i].fixed;
+        }
+    }
+    if (fixed < 0 && batch) {
+        fixed = 0;
+    } else if (fixed < 0) {
+        printf("%s: Argument list too long, try \"batch %s ...\".\n", argv[0], argv[0]);
+        return 126;
+    }
+    return run_batches(argv, batch_fixed(argv, n, fixed), jobs);
+}
+
+/**
+ * run_command - Run argv, which may be a builtin or "batch ...", with the
+ *               assignments of cmd. Return the status if it's not replaced by
+ *               exec.
+ */
+static int run_command(const prog_t *prog, const cmd_t *cmd, char **argv)
+{
+    unsigned jobs = 1;
+    int fixed = -1;
+    bool batch = batch_prefix(argv);
+
+    if (batch && (argv = batch_command(argv, &jobs, &fixed)) == NULL) {
+        return 2;
+    }
+    if (!assign(prog, cmd, find_builtin(argv[0]) == NULL)) {
+        return 1;
+    }
+    if (builtin_cmd(argv)) {
+        return last_status;
+    }
+    return run_program(argv, jobs, fixed, batch);
+}
+
+/**
+ * memo_prefix - Judge whether argv is "memo [-i FILE]... [-e NAME]... command
+ *               ...", which replays output of the command if it has run with
+ *               the same words in the same directory, and nothing it depends
+ *               on has changed since. FILEs are inputs of the command, and
+ *               NAMEs are variables it reads. "memo -c" empties the store.
+ */
+static bool memo_prefix(char *argv[])
+{
+    return strcmp(argv[0], "memo") == 0;
+}
+
+/**
+ * memo_size - Return the cap on the size of the memo store, which is
+ *             $QSH_MEMO_SIZE bytes with an optional K, M or G, or 64M.
+ */
+static unsigned long long memo_size(void)
+{
+    const char *value = get_var("QSH_MEMO_SIZE", 13);
+    char *end = NULL;
+    unsigned long long size = value == NULL ? 0 : strtoull(value, &end, 10);
+
+    if (value == NULL || end == value) {
+        return 64ULL << 20;
+    }
+    switch (*end) {
+    case 'G':
+        size <<= 10;
+        // fall through
+    case 'M':
+        size <<= 10;
+        // fall through
+    case 'K':
+        size <<= 10;
+        break;
+    }
+    return size;
+}
+
+/**
+ * find_program - Find the file which exec runs for name in $PATH. Return
+ *                false if there's none.
+ */
+static bool find_program(const char *name, char *path, size_t size)
+{
+    const char *dirs = get_var("PATH", 4);
+
+    if (strchr(name, '/') != NULL || dirs == NULL) {
+        return false;
+    }
+    while (true) {
+        size_t len = strcspn(dirs, ":");
+
+        // an empty entry is the working directory
+        if ((size_t) snprintf(path, size, "%.*s%s%s", (int) len, dirs, len > 0 ? "/" : "", name) < size
+                && access(path, X_OK) == 0) {
+            return true;
+        }
+        if (dirs[len] == '\0') {
+            return false;
+        }
+        dirs += len + 1;
+    }
+}
+
+/**
+ * run_memo - Run "memo ..." in argv with the assignments of cmd. The command
+ *            is hashed with its words, the working directory, the NAMEs and
+ *            the FILEs, and the file of its program. If the store has output
+ *            for the hash, it's written as if the command wrote it, or else
+ *            the command is run and its output is kept on the way. Return the
+ *            status of the command.
+ */
+static int run_memo(const prog_t *prog, const cmd_t *cmd, char **argv)
+{
+    memo_key_t key = MEMO_SEED;
+    char path[PATH_MAX];
+
+    if (!assign(prog, cmd, true)) {
+        return 1;
+    }
+    for (++argv; *argv != NULL && (*argv)[0] == '-' && argv[1] != NULL; argv += 2) {
+        if (strcmp(*argv, "-i") == 0) {
+            memo_hash(&key, "-i", 2);
+            memo_hash_file(&key, argv[1]);
+        } else if (strcmp(*argv, "-e") == 0) {
+            const char *value = get_var(argv[1], strlen(argv[1]));
+
+            memo_hash(&key, "-e", 2);
+            memo_hash(&key, argv[1], strlen(argv[1]));
+            // unset and empty differ
+            memo_hash(&key, value, value == NULL ? 0 : strlen(value) + 1);
+        } else {
+            break;
+        }
+    }
+    if (argv[0] != NULL && strcmp(argv[0], "-c") == 0 && argv[1] == NULL) {
+        memo_trim(0);
+        return 0;
+    }
+    if (*argv == NULL || (*argv)[0] == '-') {
+        app_error("memo: usage: memo [-i file] [-e name] command [argument ...] | -c");
+        return 2;
+    }
+    for (char **arg = argv; *arg != NULL; ++arg) {
+        memo_hash(&key, *arg, strlen(*arg));
+    }
+    if (getcwd(path, sizeof(path)) != NULL) {
+        memo_hash(&key, path, strlen(path));
+    }
+    // a new version of the program may say something else
+    if (find_builtin(argv[0]) == NULL && find_program(argv[0], path, sizeof(path))) {
+        memo_hash_file(&key, path);
+    }
+    int status = 0;
+    int out[2];
+    int err[2];
+
+    fflush(stdout);
+    if (memo_replay(key, &status)) {
+        return status;
+    }
+    if (pipe2(out, O_CLOEXEC) < 0 || pipe2(err, O_CLOEXEC) < 0) {
+        unix_fatal("pipe error");
+    }
+    trace_begin("fork", NULL);
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        unix_fatal("fork error");
+    } else if (pid == 0) {
+        trace_reset();
+        if (dup2(out[1], STDOUT_FILENO) < 0 || dup2(err[1], STDERR_FILENO) < 0) {
+            unix_fatal("dup2 error");
+        }
+        close(out[0]);
+        close(out[1]);
+        close(err[0]);
+        close(err[1]);
+        status = run_command(prog, cmd, argv);
+        fflush(stdout);
+        trace_flush();
+        _exit(status);
+    }
+    trace_end("fork");
+    trace_child(pid, argv[0]);
+    close(out[1]);
+    close(err[1]);
+    // a closed output is seen as EPIPE rather than killing the shell
+    mysignal(SIGPIPE, SIG_IGN);
+    return memo_record(key, pid, out[0], err[0], memo_size());
+}
+
+/**
+ * run_stage - Run a stage of a pipeline in a forked child. argv is expanded
+ *             already if it's not NULL. Return the status if it's not
+ *             replaced by exec.
+ */
+static int run_stage(const prog_t *prog, const cmd_t *cmd, char **argv)
+{
+    redirect_t redirects[cmd->nredirs + 1];
+    strvec_t fields = {NULL, 0, 0};
+
+    expand_failed = false;
+    if (cmd->code == NO_CODE && argv == NULL) {
+        expand_args(prog, cmd, &fields);
+        argv = fields.v;
+    }
+    if (expand_failed || !make_redirects(prog, cmd, redirects) || !redirect(redirects, NULL)) {
+        return 1;
+    }
+    if (cmd->code != NO_CODE) {
+        return run(prog, cmd->code);
+    }
+    if (argv == NULL) {
+        return assign(prog, cmd, false) ? 0 : 1;
+    }
+    if (pin_prefix(argv) && (argv = pin_command(argv)) == NULL) {
+        return 1;
+    }
+    if (memo_prefix(argv)) {
+        return run_memo(prog, cmd, argv);
+    }
+    return run_command(prog, cmd, argv);
+}
+
+/**
+ * close_above - Close every descriptor above standard error but those in the
+ *               table commands inherit, the trace, and those in keep, which
+ *               are -1 or descriptors in no order. Return false if
+ *               close_range fails.
+ */
+static bool close_above(const int keep[], size_t nkeep)
+{
+    unsigned from = STDERR_FILENO + 1;
+    int traced = trace_fd();
+
+    for (;;) {
+        // the lowest descriptor kept from here on
+        int inherited = fdtab_next(from);
+        unsigned next = inherited < 0 ? ~0U : (unsigned) inherited;
+
+        if (traced >= (int) from && (unsigned) traced < next) {
+            next = traced;
+        }
+
+        for (size_t i = 0; i < nkeep; ++i) {
+            if (keep[i] >= (int) from && (unsigned) keep[i] < next) {
+                next = keep[i];
+            }
+        }
+        if (next > from && close_range(from, next == ~0U ? ~0U : next - 1, 0) < 0) {
+            return false;
+        }
+        if (next == ~0U) {
+            return true;
+        }
+        from = next + 1;
+    }
+}
+
+/**
+ * connect_stage - Connect stdin and stdout of a stage to its adjacent pipes,
+ *                 and close every other descriptor inherited from the shell
+ *                 but those commands inherit and the nkeep ones in keep.
+ */
+static void connect_stage(int in, int out, const int keep[], size_t nkeep)
+{
+    if (in >= 0 && dup2(in, STDIN_FILENO) < 0) {
+        unix_fatal("dup2 error");
+    }
+    if (out >= 0 && dup2(out, STDOUT_FILENO) < 0) {
+        unix_fatal("dup2 error");
+    }
+    if (!close_above(keep, nkeep)) {
+        // the rest are closed on exec anyway
+        if (in > STDERR_FILENO) {
+            close(in);
+        }
+        if (out > STDERR_FILENO) {
+            close(out);
+        }
+    }
+}
+
+/**
+ * stage_name - Name a stage in the trace by its first word which is not an
+ *              assignment.
+ */
+static const char *stage_name(const prog_t *prog, const cmd_t *cmd)
+{
+    if (cmd->code != NO_CODE) {
+        return "(...)";
+    }
+    return cmd->nwords > cmd->nassigns ? word_text(prog, prog->words[cmd->word+cmd->nassigns]) : "";
+}
+
+/**
+ * spawn - Fork a process for each stage of a pipeline. The first stage may
+ *         have argv expanded already. Only the pipe between the last stage
+ *         and the next one is open in the shell, so n stages need O(n)
+ *         system calls. "timeout" before the first stage gives the whole job
+ *         a deadline. Return the status of the pipeline.
+ */
+static int spawn(const prog_t *prog, const cmd_t *cmds, uint32_t n, bool bg, char **argv)
+{
+    mark_t mark = arena_mark();
+    pid_t *pids = arena_alloc(n * sizeof(*pids));
+    // pipes to rotating logs of each stage, one slot per redirect
+    int *logs = NULL;
+    size_t nlogs = 0;
+    // read end of the pipe from the last stage
+    int in = -1;
+    // stages are placed only if there's traffic between them
+    bool place = auto_pin && n > 1;
+    limit_t limit = {0, 0, 0};
+    sigset_t mask;
+    // the name of a coprocess, and pipes to its input and from its output
+    const char *coproc = NULL;
+    int to[2] = {-1, -1};
+    int from[2] = {-1, -1};
+    // the pipe of output of a background job to its ring
+    int ring_in = -1;
+    int ring_out = -1;
+
+    // what a job does is not state of the shell
+    rc_pure = false;
+    if (argv == NULL && (timeout_prefix(prog, &cmds[0]) || coproc_prefix(prog, &cmds[0]))) {
+        strvec_t fields = {NULL, 0, 0};
+
+        expand_args(prog, &cmds[0], &fields);
+        argv = fields.v;
+    }
+    if (argv != NULL && argv[0] != NULL && strcmp(argv[0], "coproc") == 0) {
+        if ((argv = coproc_command(argv, &coproc)) == NULL) {
+            arena_release(mark);
+            return 2;
+        }
+        if (pipe2(to, O_CLOEXEC) < 0 || pipe2(from, O_CLOEXEC) < 0) {
+            unix_fatal("pipe error");
+        }
+        // it's waited for by none, and never queued
+        bg = true;
+        in = to[0];
+    }
+    if (argv != NULL && argv[0] != NULL && strcmp(argv[0], "timeout") == 0
+            && (argv = timeout_command(argv, &limit)) == NULL) {
+        arena_release(mark);
+        return 125;
+    }
+    // a timed job has its own group to be signalled even without job control
+    bool timed = limit.ms > 0;
+#ifndef DEBUG
+    enum STATE state = bg ? BG : FG;
+#endif
+
+    // a coprocess is never held back, as the shell talks to it at once
+    if (bg && coproc == NULL && !jobctl) {
+        // a script is held back until the job can start
+        wait_admission();
+    } else if (bg && coproc == NULL) {
+#ifndef DEBUG
+        // an interactive shell goes on while the job waits in the queue
+        wait_slot();
+        state = admit_job() ? BG : QUEUED;
+#endif
+    }
+#ifndef DEBUG
+    int gate[2] = {-1, -1};
+
+    if (state == QUEUED) {
+        hold_gate(gate);
+    }
+#endif
+
+    if (bg && coproc == NULL && ring_size > 0) {
+        ring_out = jobring_pipe(&ring_in);
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        nlogs += cmds[i].nredirs;
+    }
+    logs = arena_alloc((nlogs + 1) * sizeof(*logs));
+    unsigned long logs_mark = rotate_mark();
+
+    for (uint32_t i = 0, k = 0; i < n; k += cmds[i++].nredirs) {
+        open_logs(prog, &cmds[i], logs + k);
+    }
+    block_sig(&mask);
+    // children must not flush what is buffered in the shell again
+    fflush(stdout);
+    for (uint32_t i = 0, k = 0; i < n; k += cmds[i++].nredirs) {
+        int fds[2] = {-1, -1};
+        int cpu = place ? sibling_cpu(i) : -1;
+
+        if (i + 1 < n && pipe2(fds, O_CLOEXEC) < 0) {
+            unix_fatal("pipe error");
+        } else if (i + 1 == n) {
+            fds[1] = coproc != NULL ? from[1] : ring_out;
+        }
+        trace_begin("fork", NULL);
+        if ((pids[i] = fork()) < 0) {
+            unix_fatal("fork error");
+        } else if (pids[i] == 0) {
+#ifndef DEBUG
+            if (jobctl || timed) {
+                setpgid_pipe(pids, i);
+            }
+#endif
+            if (cpu >= 0) {
+                cpu_set_t set;
+
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                pin_cpus(&set, auto_pin_mem);
+            }
+            enter_subshell();
+            unblock_sig(&mask);
+#ifndef DEBUG
+            if (gate[0] >= 0) {
+                pass_gate(gate);
+            }
+#endif
+            // redirects of the stage still apply over the ring
+            if (ring_out >= 0 && dup2(ring_out, STDERR_FILENO) < 0) {
+                unix_fatal("dup2 error");
+            }
+            connect_stage(in, fds[1], logs + k, cmds[i].nredirs);
+            log_cmd = &cmds[i];
+            log_fds = logs + k;
+            int status = run_stage(prog, &cmds[i], i == 0 ? argv : NULL);
+
+            // NOTE: exit() would rewind stdin shared with the shell if it's a file
+            fflush(stdout);
+            trace_flush();
+            _exit(status);
+        }
+        trace_end("fork");
+        trace_child(pids[i], i == 0 && argv != NULL ? argv[0] : stage_name(prog, &cmds[i]));
+        if ((in >= 0 && close(in) < 0) || (fds[1] >= 0 && fds[1] != ring_out && close(fds[1]) < 0)) {
+            unix_fatal("close error");
+        }
+        close_logs(logs + k, cmds[i].nredirs);
+        in = fds[0];
+    }
+    int status = 0;
+
+    if (bg) {
+        last_bg = pids[n-1];
+    }
+    if (coproc != NULL) {
+        add_coproc(coproc, to[1], from[0], pids[n-1]);
+    }
+    if (ring_out >= 0) {
+        close(ring_out);
+        jobring_add(ring_in, pids[n-1], ring_size);
+    }
+    if (!jobctl) {
+        if (timed) {
+#ifndef DEBUG
+            set_group(pids, n);
+#endif
+            wheel_add(pids[0], monotonic_ms() + limit.ms, limit.grace, limit.sig);
+        }
+        if (bg && coproc == NULL && (admit_jobs > 0 || admit_pressure > 0 || admit_load > 0)) {
+            track_job(pids[n-1]);
+        }
+        if (bg) {
+            jobstat_add(pids[n-1]);
+        }
+        // reap them before SIGCHLD handler can do it
+        status = bg ? 0 : wait_pids(pids, n);
+        if (timed && !bg && wheel_cancel(pids[0]) && status != 128 + SIGKILL) {
+            status = 124;
+        }
+        unblock_sig(&mask);
+        if (!bg) {
+            rotate_sync(logs_mark);
+        }
     } else {
-        addjob(jobs, pid, BG, original_cmd, num);
-        unblock_sig(mask);
-        printf("[%u] %d %s", pid2jid(pid), pid, original_cmd);
+#ifndef DEBUG
+        set_group(pids, n);
+        if (gate[0] >= 0) {
+            close(gate[0]);
+        }
+        status = add_newjob(pids[0], pids[n-1], state, n, prog->pool + cmds[0].text, &limit, gate[1], &mask);
+        if (state == FG) {
+            rotate_sync(logs_mark);
+        }
+#endif
     }
+    arena_release(mark);
+    return status;
 }
 
 /**
- * change_ttyio - Change SIGTTIN and SIGTTOU's handling way.
+ * can_replace - Judge whether a simple command of argv can replace the shell
+ *               by exec, as nothing is left for the shell to do after it.
+ *               Deadlines and rotating logs are the shell's to keep, and
+ *               "timeout" and "coproc" need the shell as well.
  */
-static void change_ttyio(handler_t *handle_way)
+static bool can_replace(const prog_t *prog, const cmd_t *cmd, char **argv)
 {
-    mysignal(SIGTTIN, handle_way);
-    mysignal(SIGTTOU, handle_way);
+    if (strcmp(argv[0], "timeout") == 0 || strcmp(argv[0], "coproc") == 0
+            || wheel_active() || rotate_mark() > 0) {
+        return false;
+    }
+    for (uint32_t i = 0; i < cmd->nredirs; ++i) {
+        if (rotate_target(prog, &prog->redirs[cmd->redir+i])) {
+            return false;
+        }
+    }
+    return true;
 }
 
 /**
- * setpgid_pipe - Set pgid for a process in a pipe.
+ * run_simple - Run a simple command in foreground. Builtins and assignments
+ *              are done in the shell. A command in tail position replaces
+ *              the shell if it can, instead of being forked and waited for.
+ *              Return its status.
  */
-static void setpgid_pipe(pid_t pids[], int number)
+static int run_simple(const prog_t *prog, const cmd_t *cmd, bool tail)
 {
-    if (number == 0) {
-        pids[0] = getpid();
-    }
-    grps[getpid()] = pids[0];
-    if (setpgid(getpid(), pids[0]) < 0) {
-        unix_fatal("setpgid error");
+    mark_t mark = arena_mark();
+    strvec_t argv = {NULL, 0, 0};
+    redirect_t redirects[cmd->nredirs + 1];
+    int status = 0;
+
+    subst_status = -1;
+    expand_failed = false;
+    expand_args(prog, cmd, &argv);
+    if (expand_failed) {
+        // nothing is assigned or run
+        status = 1;
+    } else if (argv.n == 0 && !assign(prog, cmd, false)) {
+        status = 1;
+    } else if (argv.n == 0) {
+        // the status is the one of the last command substitution
+        status = subst_status < 0 ? 0 : subst_status;
+        if (cmd->nredirs > 0) {
+            saved_t saved = {NULL, 0, 0};
+            unsigned long logs = rotate_mark();
+
+            if (!make_redirects(prog, cmd, redirects) || !redirect(redirects, &saved)) {
+                status = 1;
+            }
+            restore_fds(&saved);
+            rotate_sync(logs);
+        }
+    } else if (find_builtin(argv.v[0]) != NULL && !pin_prefix(argv.v)) {
+        // assignments before a builtin last until it returns
+        char *old[cmd->nassigns + 1];
+        unsigned long logs = rotate_mark();
+
+        bool assigned = save_assigns(prog, cmd, old);
+
+        status = assigned && make_redirects(prog, cmd, redirects) ? run_builtin(argv.v, redirects) : 1;
+        rotate_sync(logs);
+        restore_assigns(prog, cmd, old);
+    } else if (tail && can_replace(prog, cmd, argv.v)) {
+        // what the shell has buffered must not be lost by exec
+        fflush(stdout);
+        status = run_stage(prog, cmd, argv.v);
+    } else {
+        status = spawn(prog, cmd, 1, false, argv.v);
     }
+    arena_release(mark);
+    return status;
 }
 
 /**
- * eval - Evaluate the cmdline. Parameter firsttime set to judge whether it's
- *          the top parent process.
- *
- * NOTE: There should be no embedded command in a pipe.
+ * fill_slot - Copy n words into one block owned by slot.
  */
-static void eval(char *cmdline)
+static void fill_slot(slot_t *slot, char **words, size_t n)
 {
-    char *cmds[MAXARGS] = {NULL};
-    bool bg = preprocess(cmdline);
+    size_t size = n * sizeof(char *) + 1;
 
-    copybuf(original_cmd, cmdline, MAXLINE);
-    int pipes_num = split(cmdline, '|', cmds) - 1;
+    for (size_t i = 0; i < n; ++i) {
+        size += strlen(words[i]) + 1;
+    }
+    char **block = realloc(slot->words, size);
 
-    if (pipes_num < 0) {
-        return;
+    if (block == NULL) {
+        unix_fatal("realloc error");
     }
-    // to judge whether to redirect later
-    redirect_t redirects[MAXARGS];
-    int pipes[pipes_num][2];
-    // to tell which command to execute
-    int number = pipes_num + 1;
-    pid_t pids[pipes_num+2];
+    char *p = (char *) (block + n);
 
-    pids[pipes_num+1] = getpid();
-    char *argv[MAXARGS] = {NULL};
+    for (size_t i = 0; i < n; ++i) {
+        size_t len = strlen(words[i]) + 1;
 
-    if (pipes_num == 0) {
-        parseline(cmds[0], argv, redirects);
-        if (argv[0] == NULL || builtin_cmd(argv)) {
-            return;
+        block[i] = memcpy(p, words[i], len);
+        p += len;
+    }
+    slot->words = block;
+    slot->n = n;
+    slot->i = 0;
+}
+
+/**
+ * run - The interpreter loop running code of prog from pc until OP_END.
+ *       Return the last status.
+ */
+static int run(const prog_t *prog, uint32_t pc)
+{
+    slot_t *slots = NULL;
+
+    if (prog->nslots > 0 && (slots = calloc(prog->nslots, sizeof(*slots))) == NULL) {
+        unix_fatal("calloc error");
+    }
+    while (true) {
+        const insn_t *insn = &prog->code[pc++];
+
+        switch (insn->op) {
+        case OP_END:
+            for (unsigned i = 0; i < prog->nslots; ++i) {
+                free(slots[i].words);
+            }
+            free(slots);
+            return last_status;
+        case OP_PIPE: {
+            const cmd_t *cmd = &prog->cmds[insn->a];
+
+            if (coprocs_gone) {
+                close_coprocs();
+            }
+
+            if (insn->b == 1 && !(insn->flags & PIPE_BG) && cmd->code == NO_CODE) {
+                last_status = run_simple(prog, cmd, tail_source && tail_position(prog, pc));
+            } else {
+                last_status = spawn(prog, cmd, insn->b, insn->flags & PIPE_BG, NULL);
+            }
+            break;
+        } case OP_JMP:
+            pc = insn->a;
+            break;
+        case OP_JZ:
+            if (last_status == 0) {
+                pc = insn->a;
+            }
+            break;
+        case OP_JNZ:
+            if (last_status != 0) {
+                pc = insn->a;
+            }
+            break;
+        case OP_NOT:
+            last_status = !last_status;
+            break;
+        case OP_SET:
+            last_status = insn->a;
+            break;
+        case OP_FOR: {
+            const cmd_t *cmd = &prog->cmds[insn->a];
+            mark_t mark = arena_mark();
+            strvec_t list = {NULL, 0, 0};
+
+            expand_words(prog, cmd->word + 1, cmd->nwords - 1, &list);
+            fill_slot(&slots[insn->slot], list.v, list.n);
+            arena_release(mark);
+            last_status = 0;
+            break;
+        } case OP_NEXT: {
+            slot_t *slot = &slots[insn->slot];
+            word_t name = prog->words[prog->cmds[insn->a].word];
+
+            if (slot->i == slot->n) {
+                pc = insn->b;
+            } else {
+                set_var(word_text(prog, name), name.len, slot->words[slot->i++], false);
+            }
+            break;
+        } case OP_CASE: {
+            mark_t mark = arena_mark();
+            word_t word = prog->words[insn->a];
+            char *subject = expand_string(word_text(prog, word), word.len, EXP_TILDE);
+
+            fill_slot(&slots[insn->slot], &subject, 1);
+            arena_release(mark);
+            break;
+        } case OP_MATCH: {
+            mark_t mark = arena_mark();
+            word_t word = prog->words[insn->a];
+            char *pattern = expand_string(word_text(prog, word), word.len, EXP_PATTERN | EXP_TILDE);
+
+            if (fnmatch(pattern, slots[insn->slot].words[0], 0) == 0) {
+                pc = insn->b;
+            }
+            arena_release(mark);
+            break;
+        } case OP_REDIR:
+            if (!push_redirects(prog, &prog->cmds[insn->a])) {
+                // skip the command to undo redirects at once
+                last_status = 1;
+                pc = insn->b;
+            }
+            break;
+        case OP_UNREDIR:
+            pop_redirects();
+            break;
+        default:
+            break;
         }
     }
-    sigset_t mask;
+}
 
-    block_sig(&mask);
-    for (int i = 0; i < pipes_num + 1; ++i) {
-        if (i < pipes_num) {
-            if (pipe(pipes[i]) < 0) {
-                unix_fatal("pipe error");
+/**
+ * blank - Judge whether s has nothing but blanks and newlines.
+ */
+static bool blank(const char *s, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        if (s[i] != ' ' && s[i] != '\t' && s[i] != '\n') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * run_source - Compile and run complete commands in src one by one. Unless
+ *              final is true, a command which is not complete yet is left,
+ *              and the length of source run is set in consumed. Return false
+ *              on syntax errors.
+ */
+static bool run_source(const char *src, size_t len, bool final, size_t *consumed)
+{
+    prog_t prog;
+    size_t done = 0;
+    bool ok = true;
+    // source run inside is not at the end of "qsh -c"
+    bool tail = tail_source;
+
+    tail_source = false;
+    memset(&prog, 0, sizeof(prog));
+    while (done < len) {
+        size_t n = 0;
+
+        trace_begin("parse", NULL);
+        enum COMPILE result = compile(&prog, src + done, len - done, &n);
+
+        trace_end("parse");
+        if (result == COMPILE_INCOMPLETE && !final) {
+            break;
+        } else if (result != COMPILE_OK) {
+            if (result == COMPILE_INCOMPLETE) {
+                app_error("syntax error: unexpected end of file");
             }
+            last_status = 2;
+            ok = false;
+            done = len;
+            break;
         }
-        if ((pids[i] = fork()) <= 0) {
-            number = i;
+        done += n;
+        tail_source = tail && blank(src + done, len - done);
+        run(&prog, 0);
+        tail_source = false;
+        if (n == 0) {
             break;
         }
     }
-    closepipes(pipes, pipes_num, number);
-    if (pids[number] < 0) {
-        unix_fatal("fork error");
-    } else if (pids[number] == 0) {
-        setpgid_pipe(pids, number);
-        // if (number == 0 && !bg) {
-        //     set_terminal(getpid());
-        // }
-        change_ttyio(SIG_DFL);
-        if (pipes_num > 0) {
-            parseline(cmds[number], argv, redirects);
-            if (argv[0] == NULL) {
-                app_fatal("no content for pipe");
+    prog_free(&prog);
+    if (consumed != NULL) {
+        *consumed = done;
+    }
+    return ok;
+}
+
+/**
+ * capture_builtin - Run a builtin command which leaves the shell unchanged
+ *                   without forking, collecting its output through a memfd.
+ *                   Return false if cmdline is not such a simple command.
+ */
+static bool capture_builtin(const char *cmdline, size_t cmdlen, char **out, size_t *len)
+{
+    prog_t prog;
+    size_t consumed = 0;
+    bool done = false;
+
+    memset(&prog, 0, sizeof(prog));
+    if (compile(&prog, cmdline, cmdlen, &consumed) == COMPILE_OK && consumed == cmdlen
+            && prog.ncode == 2 && prog.code[0].op == OP_PIPE && prog.code[0].b == 1
+            && prog.code[0].flags == 0) {
+        const cmd_t *cmd = &prog.cmds[prog.code[0].a];
+
+        // the name is checked before expanding words, which may fork
+        if (cmd->code == NO_CODE && cmd->nwords > 0 && cmd->nassigns == 0
+                && cmd->nredirs == 0 && pure_builtin(word_text(&prog, prog.words[cmd->word]))) {
+            strvec_t argv = {NULL, 0, 0};
+            int memfd = memfd_create("qsh-capture", MFD_CLOEXEC);
+
+            if (memfd < 0) {
+                unix_fatal("memfd_create error");
+            }
+            expand_args(&prog, cmd, &argv);
+            // what echo and printf print depends on their words alone, but
+            // "pwd" or "test" look outside the shell
+            if (rc_running && strcmp(argv.v[0], "echo") != 0 && strcmp(argv.v[0], "printf") != 0) {
+                rc_builtin(argv.v);
+            }
+            fflush(stdout);
+            int saved = dup(STDOUT_FILENO);
+
+            if (saved < 0 || dup2(memfd, STDOUT_FILENO) < 0) {
+                unix_fatal("dup error");
+            }
+            builtin_cmd(argv.v);
+            fflush(stdout);
+            do_dup(saved, STDOUT_FILENO);
+            if (lseek(memfd, 0, SEEK_SET) < 0) {
+                unix_fatal("lseek error");
             }
+            *len = read_all(memfd, out);
+            if (close(memfd) < 0) {
+                unix_fatal("close error");
+            }
+            subst_status = last_status;
+            done = true;
+        }
+    }
+    prog_free(&prog);
+    return done;
+}
+
+/**
+ * capture - Run cmdline in a subshell and collect its standard output into
+ *           a single buffer kept in the arena. Trailing newlines are removed.
+ *           Return the length of output.
+ */
+static size_t capture(const char *cmdline, size_t cmdlen, char **out)
+{
+    size_t len = 0;
+
+    if (!capture_builtin(cmdline, cmdlen, out, &len)) {
+        int fds[2];
+        sigset_t mask;
+
+        // what a program prints may differ next time
+        rc_pure = false;
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            unix_fatal("pipe error");
+        }
+        block_sig(&mask);
+        fflush(stdout);
+        trace_begin("fork", NULL);
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            unix_fatal("fork error");
+        } else if (pid == 0) {
+            enter_subshell();
+            unblock_sig(&mask);
+            close(fds[0]);
+            do_dup(fds[1], STDOUT_FILENO);
+            run_source(cmdline, cmdlen, true, NULL);
+            fflush(stdout);
+            trace_flush();
+            _exit(last_status);
+        }
+        trace_end("fork");
+        trace_child(pid, "$(...)");
+        if (close(fds[1]) < 0) {
+            unix_fatal("close error");
+        }
+        len = read_all(fds[0], out);
+        if (close(fds[0]) < 0) {
+            unix_fatal("close error");
         }
+        subst_status = wait_pids(&pid, 1);
         unblock_sig(&mask);
-        redirect(redirects);
-        connect_pipes(number, pipes, pipes_num);
-        if (execvp(argv[0], argv) < 0) {
-            printf("%s: Command not found.\n", argv[0]);
-            exit(3);
+    }
+    while (len > 0 && (*out)[len-1] == '\n') {
+        (*out)[--len] = '\0';
+    }
+    return len;
+}
+
+#ifndef DEBUG
+/**
+ * wait_input - Wait for fd to be readable. Background jobs whose deadlines
+ *              pass meanwhile are signalled, and queued jobs are admitted
+ *              once they can start.
+ */
+static void wait_input(int fd)
+{
+    admit_queued();
+    while (wheel_active() || queued_jobs()) {
+        struct pollfd fds[2] = {{fd, POLLIN, 0}, {wheel_fd(), POLLIN, 0}};
+
+        if (poll(fds, 2, queued_jobs() ? ADMIT_INTERVAL : -1) < 0 && errno != EINTR) {
+            unix_fatal("poll error");
+        }
+        if (fds[1].revents & POLLIN) {
+            wheel_expire();
+        }
+        admit_queued();
+        if (fds[0].revents != 0) {
+            return;
+        }
+    }
+}
+
+/**
+ * read_line - Append a line read from fd to *line, including its newline.
+ *             What's read after the line is given back to a seekable fd, so
+ *             that commands reading it get the rest. Return false at the end
+ *             of input.
+ */
+static bool read_line(int fd, char **line, size_t *len, size_t *cap)
+{
+    static char buf[4096];
+    static size_t pos = 0;
+    static size_t end = 0;
+    bool got = false;
+
+    while (true) {
+        if (pos == end) {
+            wait_input(fd);
+            ssize_t n = read(fd, buf, sizeof(buf));
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0) {
+                unix_error("read error");
+            }
+            if (n <= 0) {
+                return got;
+            }
+            pos = 0;
+            end = n;
+        }
+        char *newline = memchr(buf + pos, '\n', end - pos);
+        size_t n = (newline == NULL ? end : (size_t) (newline - buf) + 1) - pos;
+
+        if (*len + n + 1 > *cap) {
+            *cap = (*len + n + 1) * 2;
+            char *tmp = realloc(*line, *cap);
+
+            if (tmp == NULL) {
+                unix_fatal("realloc error");
+            }
+            *line = tmp;
+        }
+        memcpy(*line + *len, buf + pos, n);
+        *len += n;
+        (*line)[*len] = '\0';
+        pos += n;
+        got = true;
+        if (newline != NULL) {
+            if (pos < end && lseek(fd, (off_t) pos - (off_t) end, SEEK_CUR) >= 0) {
+                end = pos;
+            }
+            return true;
         }
     }
-    set_group(pids, pipes_num+1);
-    add_newjob(pids[0], bg, pipes_num+1, &mask);
 }
 
 /**
@@ -840,48 +4337,297 @@ static void initjobs(job_t jobs[])
     for (size_t i = 0; i < MAXARGS; ++i) {
         jobs[i].num = 1;
         jobs[i].state = UNDEF;
+        jobs[i].gate = -1;
         clearjob(&jobs[i]);
     }
 }
 
+// variables the rc file has read or written
+static rc_var_t *rc_vars;
+static size_t rc_nvars;
+static size_t rc_vars_cap;
+
 /**
- * main - The shell's main loop.
+ * trace_rc - Note a variable read or written by the rc file. Its value is
+ *            recorded if it's read before it's written, since the snapshot
+ *            holds only as long as it's the same.
  */
-int main(void)
+static void trace_rc(const char *name, size_t len, bool write)
 {
-    const char *name = getenv("LOGNAME");
-    char *args[MAXARGS] = {NULL};
+    for (size_t i = 0; i < rc_nvars; ++i) {
+        if (strncmp(rc_vars[i].name, name, len) == 0 && rc_vars[i].name[len] == '\0') {
+            rc_vars[i].written = rc_vars[i].written || write;
+            return;
+        }
+    }
+    if (rc_nvars == rc_vars_cap) {
+        rc_vars_cap = rc_vars_cap == 0 ? 64 : rc_vars_cap * 2;
+        if ((rc_vars = realloc(rc_vars, rc_vars_cap * sizeof(*rc_vars))) == NULL) {
+            unix_fatal("realloc error");
+        }
+    }
+    if ((rc_vars[rc_nvars].name = strndup(name, len)) == NULL) {
+        unix_fatal("strndup error");
+    }
+    rc_vars[rc_nvars++].written = write;
+    if (!write) {
+        trace_vars(NULL);
+        const char *value = get_var(name, len);
 
-    if (name == NULL) {
-        name = "";
+        snap_add(&rc_snap, SNAP_READ, false, name, len, value, value == NULL ? 0 : strlen(value));
+        trace_vars(trace_rc);
+    }
+}
+
+/**
+ * load_rc - Set variables and settings from the snapshot of an rc file,
+ *           unless a variable it read differs now. Return false if so.
+ */
+static bool load_rc(const snap_t *snap)
+{
+    snap_rec_t rec;
+    size_t pos = 0;
+
+    while (snap_next(snap, &pos, &rec)) {
+        const char *value = rec.kind == SNAP_READ ? get_var(rec.name, rec.name_len) : NULL;
+
+        if (rec.kind == SNAP_READ && (value == NULL ? rec.value != NULL : rec.value == NULL
+                    || strlen(value) != rec.value_len || memcmp(value, rec.value, rec.value_len) != 0)) {
+            return false;
+        }
+    }
+    for (pos = 0; snap_next(snap, &pos, &rec); ) {
+        // the snapshot is mapped read-only, and its strings aren't terminated
+        char *name = malloc(rec.name_len + 1);
+        char *value = malloc(rec.value_len + 1);
+
+        if (name == NULL || value == NULL) {
+            unix_fatal("malloc error");
+        }
+        memcpy(name, rec.name, rec.name_len);
+        name[rec.name_len] = '\0';
+        memcpy(value, rec.value == NULL ? "" : rec.value, rec.value_len);
+        value[rec.value_len] = '\0';
+        if (rec.kind == SNAP_SET) {
+            set_var(name, rec.name_len, value, rec.exported);
+        } else if (rec.kind == SNAP_UNSET) {
+            unset_var(name);
+        } else if (rec.kind == SNAP_RUN) {
+            char *words[rec.name_len + 1];
+            size_t n = 0;
+
+            for (char *p = name; p < name + rec.name_len; p += strlen(p) + 1) {
+                words[n++] = p;
+            }
+            words[n] = NULL;
+            builtin_cmd(words);
+        }
+        free(name);
+        free(value);
+    }
+    return true;
+}
+
+/**
+ * rc_path - Get the absolute path of the rc file, which is $QSHRC, or
+ *           ~/.qshrc in an interactive shell. Return false if there's none.
+ */
+static bool rc_path(bool interactive, char path[PATH_MAX])
+{
+    const char *rc = get_var("QSHRC", 5);
+    const char *home = get_var("HOME", 4);
+    char buf[PATH_MAX];
+
+    if (rc == NULL && interactive && home != NULL) {
+        snprintf(buf, sizeof(buf), "%s/.qshrc", home);
+        rc = buf;
+    }
+    return rc != NULL && rc[0] != '\0' && realpath(rc, path) != NULL;
+}
+
+/**
+ * source_rc - Run the rc file at path, or set what it would set from its
+ *             snapshot if it's up to date. A snapshot is taken if the rc
+ *             file only sets variables and settings of the shell.
+ */
+static void source_rc(const char *path)
+{
+    snap_t snap = {NULL, 0, 0, NULL, 0};
+
+    if (snap_load(&snap, path)) {
+        bool loaded = load_rc(&snap);
+
+        snap_free(&snap);
+        if (loaded) {
+            return;
+        }
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        unix_error(path);
+        return;
+    }
+    mark_t mark = arena_mark();
+    char *src = NULL;
+    size_t len = read_all(fd, &src);
+
+    close(fd);
+    rc_running = true;
+    rc_pure = true;
+    trace_vars(trace_rc);
+    run_source(src, len, true, NULL);
+    trace_vars(NULL);
+    rc_running = false;
+    for (size_t i = 0; i < rc_nvars; ++i) {
+        const char *name = rc_vars[i].name;
+        size_t n = strlen(name);
+        const char *value = get_var(name, n);
+
+        if (rc_vars[i].written) {
+            snap_add(&rc_snap, value == NULL ? SNAP_UNSET : SNAP_SET, var_exported(name, n),
+                    name, n, value, value == NULL ? 0 : strlen(value));
+        }
+        free(rc_vars[i].name);
+    }
+    if (rc_pure) {
+        snap_save(&rc_snap, path);
+    }
+    free(rc_vars);
+    rc_vars = NULL;
+    rc_nvars = 0;
+    snap_free(&rc_snap);
+    arena_release(mark);
+}
+
+/**
+ * start_trace - Trace the shell to $QSH_TRACE if it's set. Shells it runs
+ *               add to the same file, as $QSH_TRACE_ROOT tells them.
+ */
+static void start_trace(void)
+{
+    const char *path = get_var("QSH_TRACE", 9);
+    char pid[32];
+
+    if (path == NULL || path[0] == '\0' || !trace_open(path, get_var("QSH_TRACE_ROOT", 14) != NULL)) {
+        return;
+    }
+    if (get_var("QSH_TRACE_ROOT", 14) == NULL) {
+        snprintf(pid, sizeof(pid), "%d", (int) shell_pid);
+        set_var("QSH_TRACE_ROOT", 14, pid, true);
+    }
+}
+
+/**
+ * main - The shell's main loop. A script file with its arguments may be
+ *        given instead of reading commands from standard input, or a
+ *        command line with "-c".
+ */
+int main(int argc, char *argv[])
+{
+    extern char **environ;
+    int fd = STDIN_FILENO;
+    // the command line of "qsh -c"
+    const char *cmdline = NULL;
+
+    shell_pid = getpid();
+    import_env(environ);
+    fdtab_inherit();
+    start_trace();
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            app_error("-c: option requires an argument");
+            return 2;
+        }
+        cmdline = argv[2];
+        // as in sh -c, $0 is the word after the command line
+        set_params(argc > 3 ? argc - 3 : 1, argc > 3 ? argv + 3 : argv);
+    } else if (argc > 1) {
+        // the script is read from a descriptor users don't pick
+        if ((fd = fd_shell(open(argv[1], O_RDONLY | O_CLOEXEC))) < 0) {
+            unix_error(argv[1]);
+            return 127;
+        }
+        set_params(argc - 1, argv + 1);
+    } else {
+        const char *name = getenv("LOGNAME");
+
+        strcat(prompt, name == NULL ? "" : name);
+        strcat(prompt, ":");
+        set_params(1, argv);
+        mysignal(SIGINT, sigint_handler);
+        mysignal(SIGTSTP, sigint_handler);
+        change_ttyio(SIG_IGN);
     }
-    strcat(prompt, name);
-    strcat(prompt, ":");
-    mysignal(SIGINT, sigint_handler);
-    mysignal(SIGTSTP, sigint_handler);
     mysignal(SIGCHLD, sigchld_handler);
-    mysignal(SIGHUP, sighup_handler);
-    change_ttyio(SIG_IGN);
+    // "qsh -c" does no job control, and leaves terminals alone
+    if (cmdline == NULL) {
+        mysignal(SIGHUP, sighup_handler);
+        jobctl = fd == STDIN_FILENO && isatty(STDIN_FILENO);
+        initjobs(jobs);
+    }
+    // monitors see jobs of interactive shells, if the file can be made
+    if (jobctl) {
+        jobshm_open(jobs, MAXARGS);
+    }
+    char rc[PATH_MAX];
+
+    if (rc_path(jobctl, rc)) {
+        // the rc file gets no arguments, so that its snapshot holds for any
+        set_params(1, argv);
+        source_rc(rc);
+        if (argc > 1) {
+            set_params(argc - 1, argv + 1);
+        }
+    }
+    if (cmdline != NULL) {
+        // its last command may replace the shell
+        tail_source = true;
+        run_source(cmdline, strlen(cmdline), true, NULL);
+        return last_status;
+    }
+    if (fd != STDIN_FILENO) {
+        char *script = NULL;
+
+        trace_begin("read", NULL);
+        size_t len = read_all(fd, &script);
+
+        trace_end("read");
+        close(fd);
+        run_source(script, len, true, NULL);
+        return last_status;
+    }
+    char *line = NULL;
+    size_t len = 0;
+    size_t cap = 0;
 
-    initjobs(jobs);
     while (true) {
-        set_prompt();
-        fputs(prompt, stdout);
-        if (fgets(cmd, MAXLINE, stdin) == NULL && ferror(stdin)) {
-            app_fatal("fgets error");
-        }
-        if (feof(stdin)) {
-            fputs("\n", stdout);
-            kill_bg(jobs);
-            return 0;
+        if (len == 0) {
+            set_prompt();
+            fputs(prompt, stdout);
+        } else {
+            // the command is continued
+            fputs("> ", stdout);
         }
-        if (split(cmd, ';', args) > 0) {
-            // NOTE: There must be space before ';'
-            for (size_t i = 0; args[i] != NULL; ++i) {
-                eval(args[i]);
-            }
+        fflush(stdout);
+        trace_begin("read", NULL);
+        bool got = read_line(STDIN_FILENO, &line, &len, &cap);
+
+        trace_end("read");
+        if (!got) {
+            break;
         }
+        size_t consumed = 0;
+
+        run_source(line, len, false, &consumed);
+        memmove(line, line + consumed, len - consumed);
+        len -= consumed;
     }
-    return 0;
+    if (len > 0) {
+        run_source(line, len, true, NULL);
+    }
+    fputs("\n", stdout);
+    kill_bg(jobs);
+    return last_status;
 }
 #endif
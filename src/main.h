@@ -4,7 +4,9 @@
 #pragma once
 
 #include <limits.h>
+#include <signal.h>
 #include <unistd.h>
+#include <stdbool.h>
 #include <stdio.h>
 
 #define UNUSED(x) (void) (x)
@@ -16,33 +18,133 @@
 // set new file mode
 #define RWRWR (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH)
 
-// to the type of redirecting
-enum REDIRECT { NO = 0, OUT = 1, ERR = 2, IN = 4, CLOSE = 8, APPEND = 16, };
+// to the type of redirecting, with FD if the descriptor isn't the standard one
+// of its direction
+enum REDIRECT {
+    NO = 0, OUT = 1, ERR = 2, IN = 4, CLOSE = 8, APPEND = 16, HEREDOC = 32, PIPE = 64, DUP = 128,
+    FD = 256,
+};
 
-enum STATE { UNDEF, FG, BG, STOP, DONE, KILLED, CONTINUED, };
+enum STATE { UNDEF, FG, BG, STOP, DONE, KILLED, CONTINUED, QUEUED, };
 
 typedef struct _redirect_t {
     char filename[NAME_MAX];
     unsigned type;
+    // the descriptor redirected
+    int fd;
+    // body of a here-document
+    const char *doc;
+    size_t doc_len;
+    // the descriptor duplicated by DUP, or the write end of a pipe to a
+    // rotating log
+    int from;
 } redirect_t;
 
+// a descriptor the shell redirects for itself, saved to be restored
+typedef struct _saved_fd_t {
+    int fd;
+    // a copy of it, or -1 if it was closed
+    int copy;
+    // whether it was in the table of descriptors commands inherit
+    bool inherited;
+} saved_fd_t;
+
+typedef struct _saved_t {
+    saved_fd_t *fds;
+    size_t n;
+    size_t cap;
+} saved_t;
+
 typedef struct _job_t {
     char name[MAXLINE];
     pid_t pid;
+    // the last process of the pipeline, whose status is the job's
+    pid_t last;
     enum STATE state;
     unsigned jid;
     unsigned num;
+    // when it's timed out in milliseconds of CLOCK_MONOTONIC, or 0
+    long long deadline;
+    // order of being queued, so that queued jobs start in turn
+    unsigned long seq;
+    // the write end of the pipe its processes wait on while it's queued, or -1
+    int gate;
+    // status of the last process once it's done
+    int status;
+    // when it started in nanoseconds of CLOCK_REALTIME
+    long long start;
 } job_t;
 
+// a deadline set by "timeout" for a job
+typedef struct _limit_t {
+    // milliseconds from the start, or 0 for no deadline
+    long long ms;
+    // milliseconds between sig and SIGKILL, or 0 for no SIGKILL
+    long long grace;
+    int sig;
+} limit_t;
+
 typedef void handler_t(int);
 
-/**
- * type2fd - Map type of redirect to file descriptor.
- */
-static inline int type2fd(const enum REDIRECT redirect)
-{
-    return redirect % 4;
-}
+// a block of the arena holding words expanded for commands being run
+typedef struct _chunk_t {
+    struct _chunk_t *prev;
+    size_t size;
+    size_t used;
+    char data[];
+} chunk_t;
+
+// a position of the arena to release memory back to
+typedef struct _mark_t {
+    chunk_t *chunk;
+    size_t used;
+} mark_t;
+
+// a NULL-terminated vector of strings allocated in the arena
+typedef struct _strvec_t {
+    char **v;
+    size_t n;
+    size_t cap;
+} strvec_t;
+
+// words of a for loop, or the subject of a case, in the interpreter
+typedef struct _slot_t {
+    // one block of pointers followed by strings
+    char **words;
+    size_t n;
+    size_t i;
+} slot_t;
+
+// a command whose operands can be split among runs of it
+typedef struct _batchable_t {
+    const char *name;
+    // operands kept in every run, such as the mode of chmod
+    unsigned fixed;
+} batchable_t;
+
+// a variable read or written by the rc file
+typedef struct _rc_var_t {
+    char *name;
+    bool written;
+} rc_var_t;
+
+// a coprocess started by "coproc NAME command ..."
+typedef struct _coproc_t {
+    char *name;
+    // ends of the shell of pipes to its input and from its output
+    int in;
+    int out;
+    pid_t pid;
+    // set by the handler of SIGCHLD once it has exited
+    volatile sig_atomic_t gone;
+} coproc_t;
+
+typedef struct _builtin_t {
+    const char *name;
+    int (*run)(char *argv[]);
+    // whether it leaves the shell unchanged
+    bool pure;
+} builtin_t;
 
 /**
  * get_direction - Get direction of redirect.
@@ -57,7 +159,7 @@ static inline int get_direction(const enum REDIRECT redirect)
  */
 static inline int redirect_type(const enum REDIRECT redirect)
 {
-    return redirect & 24;
+    return redirect & 248;
 }
 
 /**
@@ -84,6 +186,9 @@ static inline const char *state2str(const enum STATE state)
     case CONTINUED:
         return "Continued";
         break;
+    case QUEUED:
+        return "Queued";
+        break;
     default:
         return NULL;
         break;
@@ -0,0 +1,482 @@
+/**
+ * Description: A store of memoized output of commands, addressed by hashes of
+ *              what the commands depend on. An entry keeps stdout, stderr and
+ *              the exit status of a run. It's replayed by sendfile, and kept by
+ *              tee while the command writes to its output, so the output
+ *              isn't copied through the shell in either case. Entries used
+ *              least recently are evicted once the store is too large.
+ *
+ *              The store is $XDG_CACHE_HOME/qsh/memo, or ~/.cache/qsh/memo.
+ */
+#include "memo.h"
+#include "trace.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// hex digits of a key, which names its entry
+#define KEY_LEN 32
+// bytes moved by a read when splice can't move them
+#define BUF_SIZE 65536
+// bytes moved by a splice at most
+#define SPLICE_MAX (1 << 20)
+// seconds after which files left by a killed shell are removed
+#define STALE_S 3600
+
+// head of an entry, followed by stdout and then stderr
+typedef struct _header_t {
+    char magic[8];
+    int32_t status;
+    uint32_t unused;
+    uint64_t out_len;
+    uint64_t err_len;
+} header_t;
+
+// output of a command passed on and kept
+typedef struct _stream_t {
+    // the pipe from the command, or -1 at its end
+    int in;
+    // where the output goes
+    int to;
+    // where it's kept from off on
+    int file;
+    loff_t off;
+    // the pipe taking copies by tee, or -1 if it's not kept any more
+    int copy[2];
+    // whether the output got everything
+    bool ok;
+} stream_t;
+
+// an entry to be evicted or not
+typedef struct _used_t {
+    char name[KEY_LEN+1];
+    off_t size;
+    struct timespec mtime;
+} used_t;
+
+static const char magic[8] = "qshmemo1";
+
+/**
+ * memo_hash - Add data to key. The length goes first, so that "ab" and "c"
+ *             differ from "a" and "bc".
+ */
+void memo_hash(memo_key_t *key, const void *data, size_t len)
+{
+    static const memo_key_t prime = (memo_key_t) 1 << 88 | 0x13b;
+    uint64_t n = len;
+
+    for (size_t i = 0; i < sizeof(n); ++i) {
+        *key = (*key ^ ((n >> (8 * i)) & 0xff)) * prime;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        *key = (*key ^ ((const unsigned char *) data)[i]) * prime;
+    }
+}
+
+/**
+ * memo_hash_file - Add path to key, with what tells whether the file at path
+ *                  has changed.
+ */
+void memo_hash_file(memo_key_t *key, const char *path)
+{
+    struct stat st;
+
+    memo_hash(key, path, strlen(path));
+    if (stat(path, &st) < 0) {
+        memo_hash(key, NULL, 0);
+        return;
+    }
+    long long id[] = {
+        st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+    };
+
+    memo_hash(key, id, sizeof(id));
+}
+
+/**
+ * key_name - Write the name of the entry of key.
+ */
+static void key_name(memo_key_t key, char name[KEY_LEN+1])
+{
+    for (int i = KEY_LEN - 1; i >= 0; --i) {
+        name[i] = "0123456789abcdef"[(unsigned) key & 15];
+        key >>= 4;
+    }
+    name[KEY_LEN] = '\0';
+}
+
+/**
+ * open_cache - Open directory sub in the cache of qsh, making it if it's not
+ *              there. Return -1 if it can't be.
+ */
+int open_cache(const char *sub)
+{
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char path[PATH_MAX];
+    int len = 0;
+
+    if (cache != NULL && cache[0] == '/') {
+        len = snprintf(path, sizeof(path), "%s/qsh/%s", cache, sub);
+    } else if (home != NULL && home[0] == '/') {
+        len = snprintf(path, sizeof(path), "%s/.cache/qsh/%s", home, sub);
+    } else {
+        return -1;
+    }
+    if (len < 0 || (size_t) len >= sizeof(path)) {
+        return -1;
+    }
+    int dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dir >= 0 || errno != ENOENT) {
+        return dir;
+    }
+    for (char *p = path + 1; ; ++p) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+
+            *p = '\0';
+            if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+                return -1;
+            }
+            if ((*p = c) == '\0') {
+                break;
+            }
+        }
+    }
+    return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+ * write_all - Write n bytes of buf to fd at *off, or where fd is if off is
+ *             NULL. Return false if it fails.
+ */
+static bool write_all(int fd, const char *buf, size_t n, loff_t *off)
+{
+    while (n > 0) {
+        ssize_t m = off == NULL ? write(fd, buf, n) : pwrite(fd, buf, n, *off);
+
+        if (m < 0 && errno == EINTR) {
+            continue;
+        } else if (m <= 0) {
+            return false;
+        }
+        if (off != NULL) {
+            *off += m;
+        }
+        buf += m;
+        n -= m;
+    }
+    return true;
+}
+
+/**
+ * send_file - Write len bytes of file fd from off on to fd to. Return false
+ *             if it fails.
+ */
+static bool send_file(int to, int fd, off_t off, size_t len)
+{
+    char buf[BUF_SIZE];
+
+    while (len > 0) {
+        ssize_t n = sendfile(to, fd, &off, len);
+
+        if (n < 0 && errno == EINVAL) {
+            // files opened to append take no sendfile
+            if ((n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), off)) > 0) {
+                off += n;
+                if (!write_all(to, buf, n, NULL)) {
+                    return false;
+                }
+            }
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * splice_all - Move len bytes in pipe in to fd to at *off, or where to is if
+ *              off is NULL. Return false if it fails.
+ */
+static bool splice_all(int in, int to, loff_t *off, size_t len)
+{
+    char buf[BUF_SIZE];
+
+    while (len > 0) {
+        ssize_t n = splice(in, NULL, to, off, len, 0);
+
+        if (n < 0 && errno == EINVAL) {
+            // such as terminals, and files opened to append
+            if ((n = read(in, buf, len < sizeof(buf) ? len : sizeof(buf))) > 0
+                    && !write_all(to, buf, n, off)) {
+                return false;
+            }
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * memo_replay - Write stdout and stderr kept for key to their descriptors,
+ *               and get the exit status. Return false if there's no entry.
+ */
+bool memo_replay(memo_key_t key, int *status)
+{
+    char name[KEY_LEN+1];
+    int dir = open_cache("memo");
+    header_t header;
+    struct stat st;
+
+    if (dir < 0) {
+        return false;
+    }
+    key_name(key, name);
+    int fd = openat(dir, name, O_RDONLY | O_CLOEXEC);
+
+    close(dir);
+    if (fd < 0) {
+        return false;
+    }
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || memcmp(header.magic, magic, sizeof(magic)) != 0 || fstat(fd, &st) < 0
+            || (uint64_t) st.st_size != sizeof(header) + header.out_len + header.err_len) {
+        close(fd);
+        return false;
+    }
+    send_file(STDOUT_FILENO, fd, sizeof(header), header.out_len);
+    send_file(STDERR_FILENO, fd, sizeof(header) + header.out_len, header.err_len);
+    // it's used just now
+    futimens(fd, NULL);
+    close(fd);
+    *status = header.status;
+    return true;
+}
+
+/**
+ * stop_copy - Stop keeping output of s.
+ */
+static void stop_copy(stream_t *s)
+{
+    if (s->copy[0] >= 0) {
+        close(s->copy[0]);
+        close(s->copy[1]);
+        s->copy[0] = -1;
+        s->copy[1] = -1;
+    }
+}
+
+/**
+ * pump - Pass what's in the pipe of s to its output, and keep a copy of it
+ *        unless it's over cap. Return false at the end of the pipe, or if
+ *        the output is gone.
+ */
+static bool pump(stream_t *s, unsigned long long cap)
+{
+    ssize_t n = 0;
+
+    if (s->copy[0] < 0) {
+        // splice tells the end of the pipe, but not every output takes it
+        n = splice(s->in, NULL, s->to, NULL, SPLICE_MAX, 0);
+        if (n < 0 && errno == EINVAL) {
+            char buf[BUF_SIZE];
+
+            if ((n = read(s->in, buf, sizeof(buf))) > 0 && !write_all(s->to, buf, n, NULL)) {
+                n = -1;
+            }
+        }
+        s->ok = s->ok && (n >= 0 || errno == EINTR);
+        return n > 0 || (n < 0 && errno == EINTR);
+    }
+    // the copy is taken before the output consumes the data
+    n = tee(s->in, s->copy[1], SPLICE_MAX, SPLICE_F_NONBLOCK);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return true;
+    } else if (n <= 0) {
+        s->ok = s->ok && n == 0;
+        return false;
+    }
+    if (!splice_all(s->in, s->to, NULL, n)) {
+        s->ok = false;
+        return false;
+    }
+    if (!splice_all(s->copy[0], s->file, &s->off, n) || (unsigned long long) s->off > cap) {
+        stop_copy(s);
+    }
+    return true;
+}
+
+/**
+ * memo_record - Pass stdout and stderr of child pid from pipes out and err
+ *               to the descriptors of the shell, keeping them for key with
+ *               the exit status if it exits. The store is trimmed to cap.
+ *               Return the status.
+ */
+int memo_record(memo_key_t key, pid_t pid, int out, int err, unsigned long long cap)
+{
+    char name[KEY_LEN+1];
+    char tmp[KEY_LEN+16];
+    int dir = open_cache("memo");
+    stream_t streams[2] = {
+        {out, STDOUT_FILENO, -1, sizeof(header_t), {-1, -1}, true},
+        {err, STDERR_FILENO, -1, 0, {-1, -1}, true},
+    };
+    int status = 0;
+
+    key_name(key, name);
+    snprintf(tmp, sizeof(tmp), "%s.%d", name, (int) getpid());
+    if (dir >= 0) {
+        streams[0].file = openat(dir, tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        // stderr is appended to stdout at the end
+        streams[1].file = openat(dir, ".", O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+    }
+    for (int i = 0; i < 2; ++i) {
+        if (streams[0].file >= 0 && streams[1].file >= 0) {
+            pipe2(streams[i].copy, O_CLOEXEC);
+        }
+    }
+    while (streams[0].in >= 0 || streams[1].in >= 0) {
+        struct pollfd fds[2] = {{streams[0].in, POLLIN, 0}, {streams[1].in, POLLIN, 0}};
+
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (fds[i].revents != 0 && !pump(&streams[i], cap)) {
+                // the command gets SIGPIPE if the output is gone
+                close(streams[i].in);
+                streams[i].in = -1;
+            }
+        }
+    }
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    bool keep = WIFEXITED(status) && streams[0].ok && streams[1].ok
+        && streams[0].copy[0] >= 0 && streams[1].copy[0] >= 0;
+
+    status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    trace_reaped(pid, status);
+    if (keep) {
+        header_t header = {{0}, status, 0, streams[0].off - sizeof(header_t), streams[1].off};
+
+        memcpy(header.magic, magic, sizeof(magic));
+        keep = lseek(streams[0].file, streams[0].off, SEEK_SET) >= 0
+            && send_file(streams[0].file, streams[1].file, 0, header.err_len)
+            && pwrite(streams[0].file, &header, sizeof(header), 0) == sizeof(header)
+            && renameat(dir, tmp, dir, name) == 0;
+    }
+    if (!keep && streams[0].file >= 0) {
+        unlinkat(dir, tmp, 0);
+    }
+    for (int i = 0; i < 2; ++i) {
+        stop_copy(&streams[i]);
+        if (streams[i].file >= 0) {
+            close(streams[i].file);
+        }
+    }
+    if (dir >= 0) {
+        close(dir);
+    }
+    if (keep) {
+        memo_trim(cap);
+    }
+    return status;
+}
+
+/**
+ * compare_used - Order entries from the one used least recently.
+ */
+static int compare_used(const void *a, const void *b)
+{
+    const struct timespec *x = &((const used_t *) a)->mtime;
+    const struct timespec *y = &((const used_t *) b)->mtime;
+
+    if (x->tv_sec != y->tv_sec) {
+        return (x->tv_sec > y->tv_sec) - (x->tv_sec < y->tv_sec);
+    }
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/**
+ * memo_trim - Evict entries used least recently until the store takes cap
+ *             bytes at most.
+ */
+void memo_trim(unsigned long long cap)
+{
+    int dir = open_cache("memo");
+    DIR *dp = dir < 0 ? NULL : fdopendir(dir);
+    used_t *used = NULL;
+    size_t n = 0;
+    size_t used_cap = 0;
+    unsigned long long total = 0;
+    time_t now = time(NULL);
+    struct dirent *ent = NULL;
+
+    if (dp == NULL) {
+        if (dir >= 0) {
+            close(dir);
+        }
+        return;
+    }
+    while ((ent = readdir(dp)) != NULL) {
+        struct stat st;
+
+        if (ent->d_name[0] == '.'
+                || fstatat(dir, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (strlen(ent->d_name) != KEY_LEN) {
+            // left by a shell killed while it kept output
+            if (now - st.st_mtime > STALE_S) {
+                unlinkat(dir, ent->d_name, 0);
+            }
+            continue;
+        }
+        if (n == used_cap) {
+            used_cap = used_cap == 0 ? 64 : used_cap * 2;
+            used_t *grown = realloc(used, used_cap * sizeof(*used));
+
+            if (grown == NULL) {
+                break;
+            }
+            used = grown;
+        }
+        memcpy(used[n].name, ent->d_name, KEY_LEN + 1);
+        used[n].size = st.st_size;
+        used[n].mtime = st.st_mtim;
+        total += st.st_size;
+        ++n;
+    }
+    if (total > cap && n > 1) {
+        qsort(used, n, sizeof(*used), compare_used);
+    }
+    for (size_t i = 0; i < n && total > cap; ++i) {
+        if (unlinkat(dir, used[i].name, 0) == 0) {
+            total -= used[i].size;
+        }
+    }
+    free(used);
+    closedir(dp);
+}
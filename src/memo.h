@@ -0,0 +1,20 @@
+/**
+ * Description: Declarations of the store of memoized output of commands.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// a 128-bit FNV-1a hash of what a command depends on
+typedef unsigned __int128 memo_key_t;
+
+#define MEMO_SEED ((memo_key_t) 0x6c62272e07bb0142ULL << 64 | 0x62b821756295c58dULL)
+
+int open_cache(const char *sub);
+void memo_hash(memo_key_t *key, const void *data, size_t len);
+void memo_hash_file(memo_key_t *key, const char *path);
+bool memo_replay(memo_key_t key, int *status);
+int memo_record(memo_key_t key, pid_t pid, int out, int err, unsigned long long cap);
+void memo_trim(unsigned long long cap);
@@ -0,0 +1,215 @@
+/**
+ * Description: CPU affinity and NUMA memory placement. Stages of a pipeline
+ *              can be spread over sibling CPUs of one package, so that data
+ *              in pipes stays in a shared cache.
+ */
+#include "error.h"
+#include "pin.h"
+#include <ctype.h>
+#include <linux/mempolicy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// bits of the node mask given to set_mempolicy
+#define MAX_NODES 1024
+#define LONG_BITS (8 * sizeof(unsigned long))
+
+typedef struct _cpu_t {
+    int cpu;
+    int package;
+    int core;
+} cpu_t;
+
+// allowed CPUs ordered by package and core, so that siblings are adjacent
+static cpu_t *cpus;
+static int ncpus = -1;
+
+/**
+ * read_int - Read a number from a file of sysfs. Return -1 if it can't.
+ */
+static int read_int(const char *path)
+{
+    FILE *fp = fopen(path, "re");
+    int value = -1;
+
+    if (fp != NULL) {
+        if (fscanf(fp, "%d", &value) != 1) {
+            value = -1;
+        }
+        fclose(fp);
+    }
+    return value;
+}
+
+/**
+ * parse_cpus - Parse a list of CPUs such as "0-3,8,10-11" into set. Return
+ *              false if it's malformed.
+ */
+bool parse_cpus(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    while (true) {
+        char *end = NULL;
+
+        if (!isdigit((unsigned char) *list)) {
+            return false;
+        }
+        long first = strtol(list, &end, 10);
+        long last = first;
+
+        if (*end == '-') {
+            if (!isdigit((unsigned char) end[1])) {
+                return false;
+            }
+            last = strtol(end + 1, &end, 10);
+        }
+        if (last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, set);
+        }
+        if (*end == '\0') {
+            return true;
+        } else if (*end != ',') {
+            return false;
+        }
+        list = end + 1;
+    }
+}
+
+/**
+ * bind_nodes - Bind memory of this process to NUMA nodes having CPUs in set.
+ *              Return false on failure.
+ */
+static bool bind_nodes(const cpu_set_t *set)
+{
+    unsigned long mask[MAX_NODES / LONG_BITS] = {0};
+    bool found = false;
+
+    for (int node = 0; node < MAX_NODES; ++node) {
+        char path[64];
+        char list[4096];
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *fp = fopen(path, "re");
+
+        if (fp == NULL) {
+            continue;
+        }
+        cpu_set_t node_cpus;
+        bool ok = fscanf(fp, "%4095s", list) == 1 && parse_cpus(list, &node_cpus);
+
+        fclose(fp);
+        CPU_AND(&node_cpus, &node_cpus, set);
+        if (ok && CPU_COUNT(&node_cpus) > 0) {
+            mask[node/LONG_BITS] |= 1UL << (node % LONG_BITS);
+            found = true;
+        }
+    }
+    // without NUMA there's nothing to bind
+    if (!found) {
+        return true;
+    }
+    if (syscall(SYS_set_mempolicy, MPOL_BIND, mask, MAX_NODES) < 0) {
+        unix_error("set_mempolicy error");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * pin_cpus - Run this process only on CPUs in set. Its memory is bound to the
+ *            NUMA nodes of them too if mem is true. Return false on failure.
+ */
+bool pin_cpus(const cpu_set_t *set, bool mem)
+{
+    if (sched_setaffinity(0, sizeof(*set), set) < 0) {
+        unix_error("sched_setaffinity error");
+        return false;
+    }
+    return !mem || bind_nodes(set);
+}
+
+/**
+ * compare_cpu - Order CPUs by package, core and number.
+ */
+static int compare_cpu(const void *a, const void *b)
+{
+    const cpu_t *x = a;
+    const cpu_t *y = b;
+
+    if (x->package != y->package) {
+        return x->package - y->package;
+    }
+    if (x->core != y->core) {
+        return x->core - y->core;
+    }
+    return x->cpu - y->cpu;
+}
+
+/**
+ * load_topology - Read packages and cores of CPUs allowed for the shell.
+ */
+static void load_topology(void)
+{
+    cpu_set_t set;
+
+    ncpus = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        unix_error("sched_getaffinity error");
+        return;
+    }
+    if ((cpus = malloc(CPU_COUNT(&set) * sizeof(*cpus))) == NULL) {
+        unix_fatal("malloc error");
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+            char path[96];
+            cpu_t *info = &cpus[ncpus++];
+
+            info->cpu = cpu;
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+            info->package = read_int(path);
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+            info->core = read_int(path);
+        }
+    }
+    qsort(cpus, ncpus, sizeof(*cpus), compare_cpu);
+}
+
+/**
+ * sibling_cpu - Choose the CPU for a stage of a pipeline. Adjacent stages go
+ *               to sibling CPUs in the package the shell runs on. Return -1
+ *               if the topology is unknown.
+ */
+int sibling_cpu(unsigned stage)
+{
+    if (ncpus < 0) {
+        load_topology();
+    }
+    if (ncpus == 0) {
+        return -1;
+    }
+    int current = sched_getcpu();
+    int package = cpus[0].package;
+    int first = 0;
+    int n = 0;
+
+    for (int i = 0; i < ncpus; ++i) {
+        if (cpus[i].cpu == current) {
+            package = cpus[i].package;
+            break;
+        }
+    }
+    for (int i = 0; i < ncpus; ++i) {
+        if (cpus[i].package == package) {
+            if (n++ == 0) {
+                first = i;
+            }
+        }
+    }
+    return cpus[first + stage % n].cpu;
+}
@@ -0,0 +1,12 @@
+/**
+ * Description: Declarations of CPU affinity and NUMA memory placement for
+ *              commands and stages of pipelines.
+ */
+#pragma once
+
+#include <sched.h>
+#include <stdbool.h>
+
+bool parse_cpus(const char *list, cpu_set_t *set);
+bool pin_cpus(const cpu_set_t *set, bool mem);
+int sibling_cpu(unsigned stage);
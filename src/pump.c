@@ -0,0 +1,204 @@
+/**
+ * Description: One thread of the shell reading pipes for it, waiting for all
+ *              of them in one epoll set, and calling what's to be done with
+ *              a pipe once it's readable. Rotating logs and rings of output
+ *              of jobs share it and its lock, so the shell runs one such
+ *              thread at most. It's started when the first pipe is added.
+ *
+ *              A pass of the thread goes through every pipe which was ready
+ *              when it started. The shell waits for a pass to be sure that
+ *              what's in pipes by now has been read.
+ */
+#include "error.h"
+#include "fdtab.h"
+#include "pump.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define EVENTS 16
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// signalled when a pass is over, or by users of the pump for their own ends
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static int epfd = -1;
+// an eventfd waking the thread for pump_request
+static int wake = -1;
+// the last request, and the last one served by a pass which started after it
+static unsigned long requests;
+static unsigned long served;
+
+/**
+ * pump - Call what's to be done with every pipe readable until the shell
+ *        exits.
+ */
+static void *pump(void *arg)
+{
+    struct epoll_event events[EVENTS];
+
+    (void) arg;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        unsigned long start = requests;
+
+        pthread_mutex_unlock(&lock);
+        int n = epoll_wait(epfd, events, EVENTS, -1);
+
+        if (n < 0 && errno != EINTR) {
+            unix_fatal("epoll_wait error");
+        }
+        pthread_mutex_lock(&lock);
+        for (int i = 0; i < n; ++i) {
+            pump_src_t *src = events[i].data.ptr;
+            uint64_t count;
+
+            if (src == NULL) {
+                // left to wake the next pass if it has to serve a request
+                if (start == requests && n < EVENTS && read(wake, &count, sizeof(count)) < 0) {
+                    unix_fatal("read error");
+                }
+            } else {
+                src->ready(src);
+            }
+        }
+        // every pipe ready when the pass started has been gone through
+        if (n >= 0 && n < EVENTS && served < start) {
+            served = start;
+            pthread_cond_broadcast(&changed);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+/**
+ * start_pump - Start the thread if it's not running.
+ */
+static void start_pump(void)
+{
+    pthread_t thread;
+    sigset_t all;
+    sigset_t old;
+
+    if (epfd >= 0) {
+        return;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+
+    epfd = fd_shell(epoll_create1(EPOLL_CLOEXEC));
+    wake = fd_shell(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    if (epfd < 0 || wake < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, wake, &event) < 0) {
+        unix_fatal("epoll error");
+    }
+    // signals are for the main thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&thread, NULL, pump, NULL) != 0) {
+        unix_fatal("pthread_create error");
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_detach(thread);
+}
+
+/**
+ * pump_lock - Take the lock the pump holds while it calls what's to be done.
+ */
+void pump_lock(void)
+{
+    pthread_mutex_lock(&lock);
+}
+
+/**
+ * pump_unlock - Release the lock of the pump.
+ */
+void pump_unlock(void)
+{
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * pump_add - Watch the pipe of src, which is made nonblocking, with the lock
+ *            held.
+ */
+void pump_add(pump_src_t *src)
+{
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = src};
+
+    start_pump();
+    fcntl(src->fd, F_SETFL, O_NONBLOCK);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, src->fd, &event) < 0) {
+        unix_fatal("epoll_ctl error");
+    }
+}
+
+/**
+ * pump_del - Stop watching the pipe of src, with the lock held. It's left
+ *            open.
+ */
+void pump_del(pump_src_t *src)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, src->fd, NULL);
+}
+
+/**
+ * pump_request - Ask for a pass of the pump, with the lock held. Return the
+ *                request for pump_served.
+ */
+unsigned long pump_request(void)
+{
+    uint64_t one = 1;
+    unsigned long request = ++requests;
+
+    if (write(wake, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        unix_fatal("write error");
+    }
+    return request;
+}
+
+/**
+ * pump_served - Judge whether a pass which started after request is over.
+ */
+bool pump_served(unsigned long request)
+{
+    return served >= request;
+}
+
+/**
+ * pump_wait - Wait with the lock held until a pass is over, or a user of the
+ *             pump calls pump_broadcast.
+ */
+void pump_wait(void)
+{
+    pthread_cond_wait(&changed, &lock);
+}
+
+/**
+ * pump_broadcast - Wake those in pump_wait, with the lock held.
+ */
+void pump_broadcast(void)
+{
+    pthread_cond_broadcast(&changed);
+}
+
+/**
+ * pump_reset - Forget the pump in a forked child, where the thread doesn't
+ *              run. The lock may have been held by it when the shell forked.
+ */
+void pump_reset(void)
+{
+    if (epfd < 0) {
+        return;
+    }
+    close(epfd);
+    close(wake);
+    epfd = -1;
+    wake = -1;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&changed, NULL);
+}
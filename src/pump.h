@@ -0,0 +1,23 @@
+/**
+ * Description: Declarations of the thread of the shell reading pipes for it.
+ */
+#pragma once
+
+#include <stdbool.h>
+
+// a pipe watched by the pump, put first in what its user keeps for it
+typedef struct _pump_src_t {
+    int fd;
+    // called by the pump with its lock held when fd is readable
+    void (*ready)(struct _pump_src_t *src);
+} pump_src_t;
+
+void pump_lock(void);
+void pump_unlock(void);
+void pump_add(pump_src_t *src);
+void pump_del(pump_src_t *src);
+unsigned long pump_request(void);
+bool pump_served(unsigned long request);
+void pump_wait(void);
+void pump_broadcast(void);
+void pump_reset(void);
@@ -0,0 +1,409 @@
+/**
+ * Description: Logs rotated by size, written by ">|rotate:FILE:SIZE:COUNT".
+ *              A command writes into a pipe whose read end the shell keeps,
+ *              and the pump moves data from every such pipe to its log with
+ *              splice. Once a log has SIZE bytes, FILE.1 is renamed to FILE.2
+ *              and so on, FILE becomes FILE.1 and a new FILE is started, so
+ *              COUNT old logs are kept. What's in a pipe is moved as a whole
+ *              so writes aren't cut, and a log may go past SIZE by what a
+ *              pipe holds, which is 64K by default.
+ *
+ *              Pipes writing the same file share its log. After a command
+ *              in foreground, the shell waits for the pump to go through
+ *              pipes whose writers are gone, so the logs are complete before
+ *              the next command reads them. It keeps pumping until every
+ *              writer is gone before it exits.
+ */
+#include "error.h"
+#include "fdtab.h"
+#include "pump.h"
+#include "rotate.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// at least what a pipe holds
+#define MOVE_SIZE (1 << 20)
+#define COPY_SIZE 65536
+
+typedef struct _log_t {
+    char path[PATH_MAX];
+    int fd;
+    // what identifies the file being written now
+    dev_t dev;
+    ino_t ino;
+    loff_t size;
+    unsigned long long limit;
+    unsigned count;
+    // set if the file can't be spliced to, so data is copied
+    bool copy;
+    // pipes writing to it
+    unsigned refs;
+    struct _log_t *next;
+} log_t;
+
+typedef struct _source_t {
+    pump_src_t src;
+    log_t *log;
+} source_t;
+
+static log_t *logs;
+static unsigned nsources;
+// pipes opened so far
+static unsigned long opened;
+// set once a pipe has been opened by this process
+static bool active;
+// set once rotate_finish is to run at exit
+static bool registered;
+
+/**
+ * parse_size - Parse a size with an optional suffix K, M or G. Return false if
+ *              it's not one.
+ */
+bool parse_size(const char *str, unsigned long long *size)
+{
+    char *end = NULL;
+
+    errno = 0;
+    *size = strtoull(str, &end, 10);
+    if (end == str || errno != 0) {
+        return false;
+    }
+    switch (*end) {
+    case 'G':
+        *size <<= 10;
+        // fall through
+    case 'M':
+        *size <<= 10;
+        // fall through
+    case 'K':
+        *size <<= 10;
+        ++end;
+        break;
+    }
+    return *end == '\0' && *size > 0;
+}
+
+/**
+ * open_file - Open the file of log to write at its end. Return false on
+ *             failure.
+ */
+static bool open_file(log_t *log, int flags)
+{
+    struct stat st;
+
+    // splice can't write a file opened to append, so log keeps the offset
+    log->fd = fd_shell(open(log->path, O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0664));
+    if (log->fd < 0) {
+        unix_error(log->path);
+        return false;
+    }
+    if (fstat(log->fd, &st) < 0) {
+        unix_error("fstat error");
+        close(log->fd);
+        log->fd = -1;
+        return false;
+    }
+    log->dev = st.st_dev;
+    log->ino = st.st_ino;
+    log->size = st.st_size;
+    return true;
+}
+
+/**
+ * rotate - Move old files of log one place on and start a new file. Return
+ *          false if it can't be started.
+ */
+static bool rotate(log_t *log)
+{
+    char from[PATH_MAX + 16];
+    char to[PATH_MAX + 16];
+
+    close(log->fd);
+    for (unsigned i = log->count; i > 0; --i) {
+        if (i == 1) {
+            snprintf(from, sizeof(from), "%s", log->path);
+        } else {
+            snprintf(from, sizeof(from), "%s.%u", log->path, i - 1);
+        }
+        snprintf(to, sizeof(to), "%s.%u", log->path, i);
+        if (rename(from, to) < 0 && errno != ENOENT) {
+            unix_error(from);
+        }
+    }
+    return open_file(log, O_TRUNC);
+}
+
+/**
+ * close_source - Stop pumping source, and close its log if no pipe is left.
+ */
+static void close_source(source_t *source)
+{
+    log_t *log = source->log;
+
+    pump_del(&source->src);
+    close(source->src.fd);
+    free(source);
+    if (--log->refs == 0) {
+        for (log_t **p = &logs; *p != NULL; p = &(*p)->next) {
+            if (*p == log) {
+                *p = log->next;
+                break;
+            }
+        }
+        if (log->fd >= 0) {
+            close(log->fd);
+        }
+        free(log);
+    }
+    if (--nsources == 0) {
+        pump_broadcast();
+    }
+}
+
+/**
+ * copy - Copy at most len bytes from fd to log, for files splice can't write.
+ */
+static ssize_t copy(int fd, log_t *log, size_t len)
+{
+    char buf[COPY_SIZE];
+    ssize_t n = read(fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+
+    for (ssize_t done = 0; n > 0 && done < n; ) {
+        ssize_t m = pwrite(log->fd, buf + done, n - done, log->size);
+
+        if (m < 0) {
+            return -1;
+        }
+        done += m;
+        log->size += m;
+    }
+    return n;
+}
+
+/**
+ * drain - Move what's in the pipe of source to its log, rotating the log once
+ *         it's at its limit. Return false once the pipe is closed.
+ */
+static bool drain(source_t *source)
+{
+    log_t *log = source->log;
+    int ready = 0;
+
+    for (;;) {
+        // a log isn't started until there's something to write to it
+        if ((unsigned long long) log->size >= log->limit
+                && ioctl(source->src.fd, FIONREAD, &ready) == 0 && ready > 0 && !rotate(log)) {
+            return false;
+        }
+        ssize_t n = log->copy ? copy(source->src.fd, log, MOVE_SIZE)
+            : splice(source->src.fd, NULL, log->fd, &log->size, MOVE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (n > 0) {
+            continue;
+        } else if (n == 0) {
+            return false;
+        } else if (errno == EAGAIN) {
+            return true;
+        } else if (errno == EINVAL && !log->copy) {
+            log->copy = true;
+        } else if (errno != EINTR) {
+            // the writer sees EPIPE rather than losing output silently
+            unix_error(log->path);
+            return false;
+        }
+    }
+}
+
+/**
+ * ready - Move what's in a pipe readable to its log, and stop pumping it once
+ *         it's closed.
+ */
+static void ready(pump_src_t *src)
+{
+    source_t *source = (source_t *) src;
+
+    if (!drain(source)) {
+        close_source(source);
+    }
+}
+
+/**
+ * find_log - Find the log writing the file fd is open for, or add one with
+ *            fd. Return NULL on failure.
+ */
+static log_t *find_log(const char *path, int fd, unsigned long long limit, unsigned count)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+        unix_error("fstat error");
+        return NULL;
+    }
+    for (log_t *log = logs; log != NULL; log = log->next) {
+        if (log->dev == st.st_dev && log->ino == st.st_ino) {
+            close(fd);
+            return log;
+        }
+    }
+    log_t *log = calloc(1, sizeof(*log));
+
+    if (log == NULL) {
+        unix_fatal("calloc error");
+    }
+    strcpy(log->path, path);
+    log->fd = fd;
+    log->dev = st.st_dev;
+    log->ino = st.st_ino;
+    log->size = st.st_size;
+    log->limit = limit;
+    log->count = count;
+    log->next = logs;
+    logs = log;
+    return log;
+}
+
+/**
+ * rotate_open - Open a pipe writing the log spec describes, which is
+ *               "FILE:SIZE:COUNT". Return the write end, or -1 on failure.
+ */
+int rotate_open(const char *spec)
+{
+    const char *colon = strrchr(spec, ':');
+    const char *size_at = colon;
+    char path[PATH_MAX];
+    char size[32];
+    unsigned long long limit = 0;
+    char *end = NULL;
+
+    while (size_at != NULL && size_at > spec && size_at[-1] != ':') {
+        --size_at;
+    }
+    if (colon == NULL || size_at == NULL || size_at - 1 <= spec
+            || (size_t) (size_at - 1 - spec) >= sizeof(path)
+            || (size_t) (colon - size_at) >= sizeof(size)) {
+        printf("rotate:%s: expected rotate:FILE:SIZE:COUNT\n", spec);
+        return -1;
+    }
+    memcpy(path, spec, size_at - 1 - spec);
+    path[size_at - 1 - spec] = '\0';
+    memcpy(size, size_at, colon - size_at);
+    size[colon - size_at] = '\0';
+    unsigned long count = strtoul(colon + 1, &end, 10);
+
+    if (!parse_size(size, &limit) || end == colon + 1 || *end != '\0' || count > 1000) {
+        printf("rotate:%s: expected rotate:FILE:SIZE:COUNT\n", spec);
+        return -1;
+    }
+    int fd = fd_shell(open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0664));
+    int fds[2] = {-1, -1};
+
+    if (fd < 0) {
+        unix_error(path);
+        return -1;
+    }
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        unix_error("pipe error");
+        close(fd);
+        return -1;
+    }
+    // neither end takes a descriptor users may pick
+    fds[0] = fd_shell(fds[0]);
+    fds[1] = fd_shell(fds[1]);
+    pump_lock();
+    log_t *log = find_log(path, fd, limit, count);
+    source_t *source = malloc(sizeof(*source));
+
+    if (source == NULL) {
+        unix_fatal("malloc error");
+    }
+    if (log == NULL) {
+        pump_unlock();
+        free(source);
+        close(fd);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    source->src = (pump_src_t) {fds[0], ready};
+    source->log = log;
+    ++opened;
+    ++log->refs;
+    ++nsources;
+    pump_add(&source->src);
+    // a child forked before has it registered already
+    if (!registered) {
+        registered = true;
+        atexit(rotate_finish);
+    }
+    active = true;
+    pump_unlock();
+    return fds[1];
+}
+
+/**
+ * rotate_mark - Return the number of pipes opened so far, to be given to
+ *               rotate_sync.
+ */
+unsigned long rotate_mark(void)
+{
+    return opened;
+}
+
+/**
+ * rotate_sync - Wait until what's written to pipes whose writers are gone is
+ *               in logs, if a pipe has been opened since mark. Pipes still
+ *               written aren't waited for.
+ */
+void rotate_sync(unsigned long mark)
+{
+    if (opened == mark || !active) {
+        return;
+    }
+    pump_lock();
+    unsigned long request = pump_request();
+
+    while (!pump_served(request) && nsources > 0) {
+        pump_wait();
+    }
+    pump_unlock();
+}
+
+/**
+ * rotate_finish - Wait until every pipe writing a log is closed. The shell's
+ *                 own standard descriptors are closed first, since they may be
+ *                 such pipes.
+ */
+void rotate_finish(void)
+{
+    if (!active) {
+        return;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    for (int fd = 0; fd < 3; ++fd) {
+        close(fd);
+    }
+    pump_lock();
+    while (nsources > 0) {
+        pump_wait();
+    }
+    pump_unlock();
+}
+
+/**
+ * rotate_reset - Forget logs in a forked child, where the pump doesn't run.
+ */
+void rotate_reset(void)
+{
+    logs = NULL;
+    nsources = 0;
+    active = false;
+}
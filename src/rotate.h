@@ -0,0 +1,14 @@
+/**
+ * Description: Declarations of logs rotated by size, pumped from pipes by the
+ *              shell.
+ */
+#pragma once
+
+#include <stdbool.h>
+
+int rotate_open(const char *spec);
+unsigned long rotate_mark(void);
+void rotate_sync(unsigned long mark);
+void rotate_finish(void);
+void rotate_reset(void);
+bool parse_size(const char *str, unsigned long long *size);
@@ -0,0 +1,242 @@
+/**
+ * Description: Snapshots of the state an rc file leaves, so that the next
+ *              shell maps it instead of running the rc file again. A snapshot
+ *              is a header identifying the rc file, followed by records which
+ *              hold lengths rather than pointers, so it's read in place from
+ *              a read-only mapping. It's out of date once the rc file is
+ *              changed.
+ *
+ *              Snapshots are kept in $XDG_CACHE_HOME/qsh/snap, or
+ *              ~/.cache/qsh/snap.
+ */
+#include "error.h"
+#include "memo.h"
+#include "snapshot.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// a value length meaning that the variable is unset
+#define UNSET UINT32_MAX
+
+// head of a snapshot, followed by the path of the rc file and records
+typedef struct _snap_header_t {
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t path_len;
+    uint32_t unused;
+} snap_header_t;
+
+// head of a record, followed by its name and value
+typedef struct _rec_header_t {
+    uint8_t kind;
+    uint8_t exported;
+    uint16_t unused;
+    uint32_t name_len;
+    uint32_t value_len;
+} rec_header_t;
+
+static const char magic[8] = "qshsnap1";
+
+/**
+ * snap_add - Add a record to snap. value is NULL for an unset variable.
+ */
+void snap_add(snap_t *snap, enum SNAP kind, bool exported, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+    rec_header_t rec = {kind, exported, 0, name_len, value == NULL ? UNSET : value_len};
+    size_t need = snap->len + sizeof(rec) + name_len + (value == NULL ? 0 : value_len);
+
+    if (need > snap->cap) {
+        size_t cap = snap->cap == 0 ? 4096 : snap->cap;
+
+        while (cap < need) {
+            cap *= 2;
+        }
+        char *buf = realloc(snap->buf, cap);
+
+        if (buf == NULL) {
+            unix_fatal("realloc error");
+        }
+        snap->buf = buf;
+        snap->cap = cap;
+    }
+    memcpy(snap->buf + snap->len, &rec, sizeof(rec));
+    memcpy(snap->buf + snap->len + sizeof(rec), name, name_len);
+    if (value != NULL) {
+        memcpy(snap->buf + snap->len + sizeof(rec) + name_len, value, value_len);
+    }
+    snap->len = need;
+}
+
+/**
+ * snap_next - Read the record of snap at *pos, and move *pos past it. Return
+ *             false at the end, or if the record is cut short.
+ */
+bool snap_next(const snap_t *snap, size_t *pos, snap_rec_t *rec)
+{
+    rec_header_t head;
+
+    if (snap->len - *pos < sizeof(head)) {
+        return false;
+    }
+    memcpy(&head, snap->buf + *pos, sizeof(head));
+    size_t value_len = head.value_len == UNSET ? 0 : head.value_len;
+
+    if (snap->len - *pos - sizeof(head) < (size_t) head.name_len + value_len) {
+        return false;
+    }
+    rec->kind = head.kind;
+    rec->exported = head.exported;
+    rec->name = snap->buf + *pos + sizeof(head);
+    rec->name_len = head.name_len;
+    rec->value = head.value_len == UNSET ? NULL : rec->name + head.name_len;
+    rec->value_len = value_len;
+    *pos += sizeof(head) + head.name_len + value_len;
+    return true;
+}
+
+/**
+ * snap_name - Write the name of the snapshot of rc, which is an absolute path.
+ */
+static void snap_name(const char *rc, char name[32])
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (; *rc != '\0'; ++rc) {
+        h = (h ^ (unsigned char) *rc) * 1099511628211ULL;
+    }
+    snprintf(name, 32, "rc-%016llx", (unsigned long long) h);
+}
+
+/**
+ * fill_header - Fill header with what identifies rc as it's now. Return false
+ *               if rc can't be found.
+ */
+static bool fill_header(snap_header_t *header, const char *rc)
+{
+    struct stat st;
+
+    if (stat(rc, &st) < 0) {
+        return false;
+    }
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, magic, sizeof(magic));
+    header->dev = st.st_dev;
+    header->ino = st.st_ino;
+    header->size = st.st_size;
+    header->mtime_sec = st.st_mtim.tv_sec;
+    header->mtime_nsec = st.st_mtim.tv_nsec;
+    header->path_len = strlen(rc);
+    return true;
+}
+
+/**
+ * snap_save - Save snap as the snapshot of rc, which is an absolute path.
+ *             Return false if it can't be.
+ */
+bool snap_save(const snap_t *snap, const char *rc)
+{
+    snap_header_t header;
+    char name[32];
+    char tmp[48];
+    int dir = open_cache("snap");
+
+    if (dir < 0) {
+        return false;
+    }
+    if (!fill_header(&header, rc)) {
+        close(dir);
+        return false;
+    }
+    snap_name(rc, name);
+    snprintf(tmp, sizeof(tmp), "%s.%d", name, (int) getpid());
+    int fd = openat(dir, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    struct iovec iov[3] = {
+        {&header, sizeof(header)},
+        {(char *) rc, header.path_len},
+        {snap->buf, snap->len},
+    };
+    size_t total = sizeof(header) + header.path_len + snap->len;
+    // it takes the place of the old one at once, so a shell never maps half of it
+    bool saved = fd >= 0 && writev(fd, iov, 3) == (ssize_t) total
+        && renameat(dir, tmp, dir, name) == 0;
+
+    if (fd >= 0) {
+        close(fd);
+        if (!saved) {
+            unlinkat(dir, tmp, 0);
+        }
+    }
+    close(dir);
+    return saved;
+}
+
+/**
+ * snap_load - Map the snapshot of rc, which is an absolute path, into snap.
+ *             Return false if there's none, or it's out of date.
+ */
+bool snap_load(snap_t *snap, const char *rc)
+{
+    snap_header_t now;
+    snap_header_t header;
+    char name[32];
+    struct stat st;
+    int dir = open_cache("snap");
+
+    if (dir < 0) {
+        return false;
+    }
+    snap_name(rc, name);
+    int fd = openat(dir, name, O_RDONLY | O_CLOEXEC);
+
+    close(dir);
+    if (fd < 0) {
+        return false;
+    }
+    if (!fill_header(&now, rc) || fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(header)
+            || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || memcmp(&header, &now, sizeof(header)) != 0
+            || (size_t) st.st_size < sizeof(header) + header.path_len) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    if (memcmp((char *) map + sizeof(header), rc, header.path_len) != 0) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    snap->map = map;
+    snap->map_len = st.st_size;
+    snap->buf = (char *) map + sizeof(header) + header.path_len;
+    snap->len = st.st_size - sizeof(header) - header.path_len;
+    snap->cap = 0;
+    return true;
+}
+
+/**
+ * snap_free - Free or unmap snap.
+ */
+void snap_free(snap_t *snap)
+{
+    if (snap->map != NULL) {
+        munmap(snap->map, snap->map_len);
+    } else {
+        free(snap->buf);
+    }
+    memset(snap, 0, sizeof(*snap));
+}
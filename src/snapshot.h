@@ -0,0 +1,44 @@
+/**
+ * Description: Declarations of snapshots of the state an rc file leaves.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum SNAP {
+    // a variable read by the rc file before it's written, with its value then
+    SNAP_READ,
+    // a variable left by the rc file, with its value
+    SNAP_SET,
+    SNAP_UNSET,
+    // words of a builtin command to be run again
+    SNAP_RUN,
+};
+
+// a record of a snapshot, the strings of which aren't terminated
+typedef struct _snap_rec_t {
+    enum SNAP kind;
+    bool exported;
+    const char *name;
+    size_t name_len;
+    // NULL if the variable is unset
+    const char *value;
+    size_t value_len;
+} snap_rec_t;
+
+// a snapshot being made, or mapped to be read
+typedef struct _snap_t {
+    char *buf;
+    size_t len;
+    size_t cap;
+    // the mapping of the file, or NULL if buf is allocated
+    void *map;
+    size_t map_len;
+} snap_t;
+
+void snap_add(snap_t *snap, enum SNAP kind, bool exported, const char *name, size_t name_len, const char *value, size_t value_len);
+bool snap_next(const snap_t *snap, size_t *pos, snap_rec_t *rec);
+bool snap_save(const snap_t *snap, const char *rc);
+bool snap_load(snap_t *snap, const char *rc);
+void snap_free(snap_t *snap);
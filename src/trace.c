@@ -0,0 +1,268 @@
+/**
+ * Description: The timeline of the shell traced to a file in Chrome's trace
+ *              format, which chrome://tracing and Perfetto open. It's on if
+ *              $QSH_TRACE names the file. Events are recorded in a ring in
+ *              memory of each process, taking a clock read and a few stores,
+ *              and written out as JSON only when half of the ring is full,
+ *              before exec, and on exit. The file is opened for appending so
+ *              that processes write their own events, as lines of an array
+ *              left open, which the format allows.
+ *
+ *              A child gets a track of its own: the shell begins it when the
+ *              child is forked, the child marks its exec, and the shell ends
+ *              it when the child is reaped, even in the handler of SIGCHLD.
+ */
+#include "error.h"
+#include "fdtab.h"
+#include "trace.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// events in the ring, a power of 2
+#define RING_SIZE 16384
+#define NAME_SIZE 40
+#define OUT_SIZE 65536
+// what a line of an event takes at most
+#define LINE_SIZE (NAME_SIZE * 6 + 160)
+
+typedef struct _event_t {
+    unsigned long long ns;
+    // a static string
+    const char *cat;
+    pid_t pid;
+    int status;
+    // 'B', 'E' or 'i', and whether status is given
+    char ph;
+    bool has_status;
+    char name[NAME_SIZE];
+} event_t;
+
+static event_t *ring;
+// events recorded, and those written out, so far
+static unsigned long head;
+static unsigned long tail;
+static int fd = -1;
+static pid_t self;
+
+/**
+ * record - Record an event of the track of pid in the ring. It's safe in
+ *          signal handlers, since a slot is taken by one atomic add.
+ */
+static void record(char ph, const char *cat, const char *name, pid_t pid, bool has_status, int status)
+{
+    unsigned long i = __atomic_fetch_add(&head, 1, __ATOMIC_SEQ_CST);
+    event_t *event = &ring[i & (RING_SIZE - 1)];
+    struct timespec ts;
+    const char *s = name == NULL ? cat : name;
+    size_t n = strnlen(s, NAME_SIZE - 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    event->ns = (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    event->cat = cat;
+    event->pid = pid;
+    event->ph = ph;
+    event->has_status = has_status;
+    event->status = status;
+    memcpy(event->name, s, n);
+    event->name[n] = '\0';
+}
+
+/**
+ * flush_half - Write out the ring once half of it is full, so that events
+ *              are seldom lost. It's done only out of signal handlers.
+ */
+static void flush_half(void)
+{
+    if (head - tail >= RING_SIZE / 2) {
+        trace_flush();
+    }
+}
+
+/**
+ * escape - Copy s into dest as the inside of a JSON string.
+ */
+static void escape(char *dest, const char *s)
+{
+    for (; *s != '\0'; ++s) {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\') {
+            *dest++ = '\\';
+            *dest++ = c;
+        } else if (c < 0x20) {
+            dest += sprintf(dest, "\\u%04x", c);
+        } else {
+            *dest++ = c;
+        }
+    }
+    *dest = '\0';
+}
+
+/**
+ * put_event - Print an event as a line of the array into buf. Return its
+ *             length.
+ */
+static int put_event(char *buf, const event_t *event)
+{
+    char name[NAME_SIZE * 6];
+    int len = 0;
+
+    escape(name, event->name);
+    len = sprintf(buf, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d",
+            name, event->cat, event->ph, event->ns / 1000, event->ns % 1000, event->pid, event->pid);
+    if (event->ph == 'i') {
+        len += sprintf(buf + len, ",\"s\":\"t\"");
+    }
+    if (event->has_status) {
+        len += sprintf(buf + len, ",\"args\":{\"status\":%d}", event->status);
+    }
+    return len + sprintf(buf + len, "},\n");
+}
+
+/**
+ * put_out - Write n bytes of buf to the file. Each write holds whole lines,
+ *           so lines of processes writing at once aren't mixed.
+ */
+static void put_out(const char *buf, size_t n)
+{
+    while (n > 0) {
+        ssize_t written = write(fd, buf, n);
+
+        if (written <= 0) {
+            return;
+        }
+        buf += written;
+        n -= written;
+    }
+}
+
+/**
+ * trace_open - Start tracing to path. It's emptied first unless append is
+ *              true, as it's for shells run by a traced shell. Return false
+ *              if it can't be opened.
+ */
+bool trace_open(const char *path, bool append)
+{
+    struct stat st;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (append ? 0 : O_TRUNC), 0644);
+    if ((fd = fd_shell(fd)) < 0) {
+        unix_error(path);
+        return false;
+    }
+    if ((ring = calloc(RING_SIZE, sizeof(*ring))) == NULL) {
+        unix_fatal("calloc error");
+    }
+    self = getpid();
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        put_out("[\n", 2);
+    }
+    atexit(trace_flush);
+    return true;
+}
+
+/**
+ * trace_begin - Begin a span of the shell.
+ */
+void trace_begin(const char *cat, const char *name)
+{
+    if (ring != NULL) {
+        flush_half();
+        record('B', cat, name, self, false, 0);
+    }
+}
+
+/**
+ * trace_end - End the last span of the shell.
+ */
+void trace_end(const char *cat)
+{
+    if (ring != NULL) {
+        record('E', cat, NULL, self, false, 0);
+    }
+}
+
+/**
+ * trace_mark - Mark a moment of the shell.
+ */
+void trace_mark(const char *cat, const char *name)
+{
+    if (ring != NULL) {
+        flush_half();
+        record('i', cat, name, self, false, 0);
+    }
+}
+
+/**
+ * trace_child - Begin the track of a child just forked, running name.
+ */
+void trace_child(pid_t pid, const char *name)
+{
+    if (ring != NULL) {
+        flush_half();
+        record('B', "child", name, pid, false, 0);
+    }
+}
+
+/**
+ * trace_reaped - End the track of a child reaped with status.
+ */
+void trace_reaped(pid_t pid, int status)
+{
+    if (ring != NULL) {
+        record('E', "child", "exit", pid, true, status);
+    }
+}
+
+/**
+ * trace_flush - Write out events in the ring. Those which were overwritten
+ *               before are counted in an event of their own.
+ */
+void trace_flush(void)
+{
+    static char buf[OUT_SIZE];
+    unsigned long end = head;
+    size_t len = 0;
+
+    if (ring == NULL) {
+        return;
+    }
+    if (end - tail > RING_SIZE) {
+        len = sprintf(buf, "{\"name\":\"lost\",\"ph\":\"i\",\"s\":\"p\",\"pid\":%d,\"tid\":%d,\"ts\":%llu,"
+                "\"args\":{\"events\":%lu}},\n", self, self, ring[(end - RING_SIZE) & (RING_SIZE - 1)].ns / 1000,
+                end - tail - RING_SIZE);
+        tail = end - RING_SIZE;
+    }
+    for (; tail != end; ++tail) {
+        if (len + LINE_SIZE > sizeof(buf)) {
+            put_out(buf, len);
+            len = 0;
+        }
+        len += put_event(buf + len, &ring[tail & (RING_SIZE - 1)]);
+    }
+    put_out(buf, len);
+}
+
+/**
+ * trace_reset - Drop events of the shell in a forked child, which are the
+ *               shell's to write out.
+ */
+void trace_reset(void)
+{
+    self = getpid();
+    tail = head;
+}
+
+/**
+ * trace_fd - Return the descriptor of the trace, or -1 if it's off. It's
+ *            closed on exec.
+ */
+int trace_fd(void)
+{
+    return fd;
+}
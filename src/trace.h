@@ -0,0 +1,18 @@
+/**
+ * Description: Declarations of the timeline of the shell traced to a file in
+ *              Chrome's trace format.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+bool trace_open(const char *path, bool append);
+void trace_begin(const char *cat, const char *name);
+void trace_end(const char *cat);
+void trace_mark(const char *cat, const char *name);
+void trace_child(pid_t pid, const char *name);
+void trace_reaped(pid_t pid, int status);
+void trace_flush(void);
+void trace_reset(void);
+int trace_fd(void);
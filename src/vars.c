@@ -0,0 +1,278 @@
+/**
+ * Description: Shell variables in a chained hash table, and positional
+ *              parameters. Exported variables are kept in environ as well.
+ */
+#include "vars.h"
+#include "error.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct _var_t {
+    struct _var_t *next;
+    char *value;
+    size_t cap;
+    uint32_t hash;
+    bool exported;
+    char name[];
+} var_t;
+
+static var_t **table;
+static size_t table_size;
+static size_t var_num;
+
+static char **params;
+static int params_num;
+// told of variables read and written, if it's set
+static var_tracer_t *tracer;
+
+/**
+ * hash - FNV-1a hash of a name.
+ */
+static uint32_t hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * is_name - Judge whether a string is a valid name of variables.
+ */
+bool is_name(const char *name, size_t len)
+{
+    if (len == 0 || !(isalpha((unsigned char) name[0]) || name[0] == '_')) {
+        return false;
+    }
+    for (size_t i = 1; i < len; ++i) {
+        if (!(isalnum((unsigned char) name[i]) || name[i] == '_')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * find_var - Find the variable called name, the length of which is len.
+ */
+static var_t *find_var(const char *name, size_t len, uint32_t h)
+{
+    if (table_size == 0) {
+        return NULL;
+    }
+    for (var_t *var = table[h & (table_size - 1)]; var != NULL; var = var->next) {
+        if (var->hash == h && strncmp(var->name, name, len) == 0 && var->name[len] == '\0') {
+            return var;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * grow_table - Double buckets of the table when it's full.
+ */
+static void grow_table(void)
+{
+    size_t size = table_size == 0 ? 64 : table_size * 2;
+    var_t **buckets = calloc(size, sizeof(*buckets));
+
+    if (buckets == NULL) {
+        unix_fatal("calloc error");
+    }
+    for (size_t i = 0; i < table_size; ++i) {
+        for (var_t *var = table[i], *next = NULL; var != NULL; var = next) {
+            next = var->next;
+            var->next = buckets[var->hash & (size - 1)];
+            buckets[var->hash & (size - 1)] = var;
+        }
+    }
+    free(table);
+    table = buckets;
+    table_size = size;
+}
+
+/**
+ * store - Store value in the variable called name, creating it if needed.
+ *         The value buffer is reused when it's large enough.
+ */
+static var_t *store(const char *name, size_t len, const char *value)
+{
+    uint32_t h = hash(name, len);
+    var_t *var = find_var(name, len, h);
+    size_t n = strlen(value) + 1;
+
+    if (var == NULL) {
+        if (var_num >= table_size) {
+            grow_table();
+        }
+        if ((var = malloc(sizeof(*var) + len + 1)) == NULL) {
+            unix_fatal("malloc error");
+        }
+        memcpy(var->name, name, len);
+        var->name[len] = '\0';
+        var->hash = h;
+        var->value = NULL;
+        var->cap = 0;
+        var->exported = false;
+        var->next = table[h & (table_size - 1)];
+        table[h & (table_size - 1)] = var;
+        ++var_num;
+    }
+    if (n > var->cap) {
+        char *tmp = realloc(var->value, n);
+
+        if (tmp == NULL) {
+            unix_fatal("realloc error");
+        }
+        var->value = tmp;
+        var->cap = n;
+    }
+    memcpy(var->value, value, n);
+    return var;
+}
+
+/**
+ * get_var - Get value of the variable called name. Return NULL if it's unset.
+ */
+const char *get_var(const char *name, size_t len)
+{
+    var_t *var = find_var(name, len, hash(name, len));
+
+    if (tracer != NULL) {
+        tracer(name, len, false);
+    }
+
+    return var == NULL ? NULL : var->value;
+}
+
+/**
+ * set_var - Set the variable called name, exporting it if export is true.
+ */
+void set_var(const char *name, size_t len, const char *value, bool export)
+{
+    if (tracer != NULL) {
+        tracer(name, len, true);
+    }
+    var_t *var = store(name, len, value);
+
+    var->exported = var->exported || export;
+    if (var->exported && setenv(var->name, value, 1) < 0) {
+        unix_error("setenv error");
+    }
+}
+
+/**
+ * export_var - Export the variable called name, creating it if needed.
+ */
+void export_var(const char *name, size_t len)
+{
+    const char *value = get_var(name, len);
+
+    set_var(name, len, value == NULL ? "" : value, true);
+}
+
+/**
+ * unset_var - Remove the variable called name.
+ */
+void unset_var(const char *name)
+{
+    size_t len = strlen(name);
+    uint32_t h = hash(name, len);
+
+    if (tracer != NULL) {
+        tracer(name, len, true);
+    }
+    if (table_size == 0) {
+        return;
+    }
+    for (var_t **link = &table[h & (table_size - 1)]; *link != NULL; link = &(*link)->next) {
+        var_t *var = *link;
+
+        if (var->hash == h && strcmp(var->name, name) == 0) {
+            if (var->exported) {
+                unsetenv(name);
+            }
+            *link = var->next;
+            free(var->value);
+            free(var);
+            --var_num;
+            return;
+        }
+    }
+}
+
+/**
+ * var_exported - Judge whether the variable called name is exported.
+ */
+bool var_exported(const char *name, size_t len)
+{
+    var_t *var = find_var(name, len, hash(name, len));
+
+    return var != NULL && var->exported;
+}
+
+/**
+ * trace_vars - Tell hook of every variable read or written from now on, or
+ *              stop telling if it's NULL.
+ */
+void trace_vars(var_tracer_t *hook)
+{
+    tracer = hook;
+}
+
+/**
+ * import_env - Make variables of the environment exported shell variables.
+ */
+void import_env(char **env)
+{
+    for (; *env != NULL; ++env) {
+        const char *equal = strchr(*env, '=');
+
+        if (equal != NULL && is_name(*env, equal - *env)) {
+            store(*env, equal - *env, equal + 1)->exported = true;
+        }
+    }
+}
+
+/**
+ * set_params - Set positional parameters, argv[0] of which is $0.
+ */
+void set_params(int argc, char **argv)
+{
+    params = argv;
+    params_num = argc - 1;
+}
+
+/**
+ * param_num - Get the number of positional parameters.
+ */
+int param_num(void)
+{
+    return params_num;
+}
+
+/**
+ * get_param - Get positional parameter i. Return NULL if it's unset.
+ */
+const char *get_param(int i)
+{
+    return i >= 0 && i <= params_num ? params[i] : NULL;
+}
+
+/**
+ * shift_params - Drop the first n positional parameters.
+ */
+void shift_params(int n)
+{
+    if (n > params_num) {
+        n = params_num;
+    }
+    // $0 stays where it is
+    params[n] = params[0];
+    params += n;
+    params_num -= n;
+}
@@ -0,0 +1,24 @@
+/**
+ * Description: Declarations of shell variables and positional parameters.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// told of the variable called name read, or written if write is true
+typedef void var_tracer_t(const char *name, size_t len, bool write);
+
+const char *get_var(const char *name, size_t len);
+void set_var(const char *name, size_t len, const char *value, bool export);
+void unset_var(const char *name);
+void export_var(const char *name, size_t len);
+bool var_exported(const char *name, size_t len);
+void trace_vars(var_tracer_t *hook);
+void import_env(char **env);
+bool is_name(const char *name, size_t len);
+
+void set_params(int argc, char **argv);
+int param_num(void);
+const char *get_param(int i);
+void shift_params(int n);
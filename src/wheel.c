@@ -0,0 +1,334 @@
+/**
+ * Description: A timer wheel enforcing deadlines of jobs. A single timerfd is
+ *              armed for the nearest tick having a deadline, so any number of
+ *              jobs with deadlines costs one timer. A job which is due gets a
+ *              signal, and SIGKILL after a grace period if it's still there.
+ */
+#include "error.h"
+#include "fdtab.h"
+#include "wheel.h"
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+// a tick is 10ms, so the wheel turns once every 10.24s
+#define TICK_MS 10
+#define SLOTS 1024
+#define BUCKETS 256
+// deadlines allocated at once
+#define BLOCK 64
+
+typedef struct _deadline_t {
+    // links in a slot of the wheel, prev is NULL if it's out of the wheel
+    struct _deadline_t *next;
+    struct _deadline_t **prev;
+    // link in a bucket hashed by pgid
+    struct _deadline_t *hnext;
+    pid_t pgid;
+    int sig;
+    // the tick when it's due
+    uint64_t at;
+    // ticks between sig and SIGKILL, or 0 for no SIGKILL
+    uint64_t grace;
+    bool fired;
+} deadline_t;
+
+static deadline_t *slots[SLOTS];
+static deadline_t *buckets[BUCKETS];
+// deadlines are never freed, since they are cancelled in signal handlers
+static deadline_t *free_list;
+// the last tick expired
+static uint64_t cursor;
+// the tick the timer is armed for, or 0
+static uint64_t armed;
+// deadlines in the wheel
+static size_t active;
+static int tfd = -1;
+
+/**
+ * monotonic_ms - Return milliseconds of CLOCK_MONOTONIC.
+ */
+long long monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * parse_duration - Parse a duration such as "1.5", "30s", "2m", "1h" or "1d"
+ *                  into milliseconds. Return false if it's malformed.
+ */
+bool parse_duration(const char *s, long long *ms)
+{
+    char *end = NULL;
+
+    if (!isdigit((unsigned char) *s) && *s != '.') {
+        return false;
+    }
+    double value = strtod(s, &end);
+
+    switch (*end) {
+    case '\0':
+    case 's':
+        break;
+    case 'm':
+        value *= 60;
+        break;
+    case 'h':
+        value *= 60 * 60;
+        break;
+    case 'd':
+        value *= 24 * 60 * 60;
+        break;
+    default:
+        return false;
+    }
+    if (end == s || (*end != '\0' && end[1] != '\0') || !isfinite(value)) {
+        return false;
+    }
+    // a century is as good as forever
+    value = value > 3e9 ? 3e12 : value * 1000;
+    *ms = value;
+    // round it up, so that a deadline never comes early
+    if (*ms < value) {
+        ++*ms;
+    }
+    return true;
+}
+
+/**
+ * link_slot - Put d in the slot of its tick.
+ */
+static void link_slot(deadline_t *d)
+{
+    deadline_t **slot = &slots[d->at % SLOTS];
+
+    if ((d->next = *slot) != NULL) {
+        d->next->prev = &d->next;
+    }
+    *slot = d;
+    d->prev = slot;
+    ++active;
+}
+
+/**
+ * unlink_slot - Take d out of the wheel.
+ */
+static void unlink_slot(deadline_t *d)
+{
+    if (d->prev != NULL) {
+        if ((*d->prev = d->next) != NULL) {
+            d->next->prev = d->prev;
+        }
+        d->prev = NULL;
+        --active;
+    }
+}
+
+/**
+ * arm - Arm the timer for tick, or disarm it if tick is 0.
+ */
+static void arm(uint64_t tick)
+{
+    struct itimerspec spec;
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = tick * TICK_MS / 1000;
+    spec.it_value.tv_nsec = tick * TICK_MS % 1000 * 1000000;
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        unix_fatal("timerfd_settime error");
+    }
+    armed = tick;
+}
+
+/**
+ * rearm - Arm the timer for the nearest tick having a deadline. Deadlines
+ *         beyond a turn of the wheel only wake it up once a turn.
+ */
+static void rearm(void)
+{
+    if (active == 0) {
+        arm(0);
+        return;
+    }
+    for (uint64_t tick = cursor + 1; tick <= cursor + SLOTS; ++tick) {
+        for (deadline_t *d = slots[tick % SLOTS]; d != NULL; d = d->next) {
+            if (d->at <= tick) {
+                arm(tick);
+                return;
+            }
+        }
+    }
+    arm(cursor + SLOTS);
+}
+
+/**
+ * wheel_add - Send sig to process group pgid at the time in milliseconds of
+ *             CLOCK_MONOTONIC, and SIGKILL grace milliseconds later unless
+ *             grace is 0. Call it with SIGCHLD blocked.
+ */
+void wheel_add(pid_t pgid, long long at, long long grace, int sig)
+{
+    if (tfd < 0) {
+        if ((tfd = fd_shell(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))) < 0) {
+            unix_fatal("timerfd_create error");
+        }
+        cursor = monotonic_ms() / TICK_MS;
+    }
+    if (free_list == NULL) {
+        deadline_t *block = malloc(BLOCK * sizeof(*block));
+
+        if (block == NULL) {
+            unix_fatal("malloc error");
+        }
+        for (size_t i = 0; i < BLOCK; ++i) {
+            block[i].hnext = free_list;
+            free_list = &block[i];
+        }
+    }
+    deadline_t *d = free_list;
+
+    free_list = d->hnext;
+    d->pgid = pgid;
+    d->sig = sig;
+    d->at = (at + TICK_MS - 1) / TICK_MS;
+    d->grace = (grace + TICK_MS - 1) / TICK_MS;
+    d->fired = false;
+    if (d->at <= cursor) {
+        d->at = cursor + 1;
+    }
+    link_slot(d);
+    d->hnext = buckets[pgid % BUCKETS];
+    buckets[pgid % BUCKETS] = d;
+    if (armed == 0 || d->at < armed) {
+        arm(d->at);
+    }
+}
+
+/**
+ * wheel_cancel - Forget the deadline of process group pgid once it's gone.
+ *                Return whether it was due before. It's safe in a handler of
+ *                SIGCHLD.
+ */
+bool wheel_cancel(pid_t pgid)
+{
+    for (deadline_t **p = &buckets[pgid % BUCKETS]; *p != NULL; p = &(*p)->hnext) {
+        deadline_t *d = *p;
+
+        if (d->pgid == pgid) {
+            bool fired = d->fired;
+
+            *p = d->hnext;
+            unlink_slot(d);
+            d->hnext = free_list;
+            free_list = d;
+            // the timer may go off for nothing once, which is harmless
+            return fired;
+        }
+    }
+    return false;
+}
+
+/**
+ * fire - Signal the process group of d, and keep it for SIGKILL if there's a
+ *        grace period left.
+ */
+static void fire(deadline_t *d, uint64_t now)
+{
+    if (kill(-d->pgid, d->sig) < 0 && errno != ESRCH) {
+        unix_error("kill error");
+    }
+    if (d->sig != SIGKILL && d->sig != SIGCONT) {
+        // a stopped job couldn't handle the signal
+        kill(-d->pgid, SIGCONT);
+    }
+    d->fired = true;
+    unlink_slot(d);
+    if (d->sig != SIGKILL && d->grace > 0) {
+        d->sig = SIGKILL;
+        d->at = now + d->grace;
+        link_slot(d);
+    }
+}
+
+/**
+ * wheel_expire - Signal jobs whose deadlines have passed, and arm the timer
+ *                for the next one.
+ */
+void wheel_expire(void)
+{
+    uint64_t expirations;
+    sigset_t mask;
+    sigset_t prev;
+
+    if (tfd < 0) {
+        return;
+    }
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &prev);
+    if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        unix_error("read error");
+    }
+    uint64_t now = monotonic_ms() / TICK_MS;
+    // every slot is visited once at most however long it has slept
+    uint64_t last = now - cursor > SLOTS ? cursor + SLOTS : now;
+
+    for (uint64_t tick = cursor + 1; tick <= last; ++tick) {
+        deadline_t *next = NULL;
+
+        for (deadline_t *d = slots[tick % SLOTS]; d != NULL; d = next) {
+            // fire() may put it back to the head of this slot
+            next = d->next;
+            if (d->at <= now) {
+                fire(d, now);
+            }
+        }
+    }
+    cursor = now;
+    rearm();
+    sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/**
+ * wheel_active - Return whether any deadline is pending.
+ */
+bool wheel_active(void)
+{
+    return active > 0;
+}
+
+/**
+ * wheel_fd - Return the timerfd, which is readable when a deadline passes,
+ *            or -1 if no deadline has been set.
+ */
+int wheel_fd(void)
+{
+    return tfd;
+}
+
+/**
+ * wheel_reset - Forget deadlines of the shell in a forked child.
+ */
+void wheel_reset(void)
+{
+    if (tfd >= 0) {
+        close(tfd);
+        tfd = -1;
+    }
+    // they are left to exec, or to the end of the child
+    memset(slots, 0, sizeof(slots));
+    memset(buckets, 0, sizeof(buckets));
+    free_list = NULL;
+    armed = 0;
+    active = 0;
+}
@@ -0,0 +1,16 @@
+/**
+ * Description: Declarations of the timer wheel enforcing deadlines of jobs.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+long long monotonic_ms(void);
+bool parse_duration(const char *s, long long *ms);
+void wheel_add(pid_t pgid, long long at, long long grace, int sig);
+bool wheel_cancel(pid_t pgid);
+void wheel_expire(void);
+bool wheel_active(void);
+int wheel_fd(void);
+void wheel_reset(void);
@@ -1,26 +1,60 @@
 #include <check.h>
 #include "main.c"
+#include <sys/stat.h>
 
-START_TEST(test_parseline)
+START_TEST(test_lexer)
 {
-    char *cmdline = "ls -l  >>test.txt 2>/dev/null <test.txt 2>&- \"-a\" -bC\n";
+    const char *src = "a\\ b 'c d'|& 2>>x && $(echo \")\")\n";
+    lexer_t lexer;
+    token_t token;
 
-    copybuf(cmd, cmdline, MAXLINE);
-    char *argv[MAXARGS] = {NULL};
-    // to judge whether to redirect later
+    lex_init(&lexer, src, strlen(src));
+    ck_assert_int_eq(lex_next(&lexer, &token), T_WORD);
+    ck_assert_int_eq(token.len, 4);
+    ck_assert_int_eq(lex_next(&lexer, &token), T_WORD);
+    ck_assert_int_eq(token.len, 5);
+    ck_assert_int_eq(lex_next(&lexer, &token), T_PIPE);
+    ck_assert_int_eq(lex_next(&lexer, &token), T_AMP);
+    ck_assert_int_eq(lex_next(&lexer, &token), T_REDIR);
+    ck_assert_int_eq(token.fd, 2);
+    ck_assert_int_eq(token.redir, R_APPEND);
+    ck_assert_int_eq(lex_next(&lexer, &token), T_WORD);
+    ck_assert_int_eq(lex_next(&lexer, &token), T_AND);
+    ck_assert_int_eq(lex_next(&lexer, &token), T_WORD);
+    ck_assert_int_eq(token.len, 11);
+    ck_assert_int_eq(lex_next(&lexer, &token), T_NEWLINE);
+    ck_assert_int_eq(lex_next(&lexer, &token), T_EOF);
+
+    lex_init(&lexer, "echo \"a", 7);
+    lex_next(&lexer, &token);
+    ck_assert_int_eq(lex_next(&lexer, &token), T_ERROR);
+    ck_assert_msg(lexer.incomplete, "the quote is not closed");
+}
+END_TEST
+
+START_TEST(test_compile)
+{
+    const char *cmdline = "ls -l  >>test.txt 2>/dev/null <test.txt 2>&- \"-a\" -bC\n";
+    prog_t prog;
+    size_t consumed = 0;
     redirect_t redirects[MAXARGS];
-    parseline(cmd, argv, redirects);
-
-    ck_assert_ptr_ne(redirects, NULL);
-    fputs("\n", stdout);
-    fputs("Redirects begin:\n", stdout);
-    redirect(redirects);
-    fputs("Redirects end:\n\n", stdout);
-    ck_assert_str_eq(argv[0], "ls");
-    ck_assert_str_eq(argv[1], "-l");
-    ck_assert_str_eq(argv[2], "-a");
-    ck_assert_str_eq(argv[3], "-bC");
-    ck_assert_ptr_eq(argv[4], NULL);
+    strvec_t argv = {NULL, 0, 0};
+
+    memset(&prog, 0, sizeof(prog));
+    ck_assert_int_eq(compile(&prog, cmdline, strlen(cmdline), &consumed), COMPILE_OK);
+    ck_assert_int_eq(consumed, strlen(cmdline));
+    ck_assert_int_eq(prog.code[0].op, OP_PIPE);
+    ck_assert_int_eq(prog.code[1].op, OP_END);
+    const cmd_t *cmd = &prog.cmds[prog.code[0].a];
+
+    expand_args(&prog, cmd, &argv);
+    ck_assert_int_eq(argv.n, 4);
+    ck_assert_str_eq(argv.v[0], "ls");
+    ck_assert_str_eq(argv.v[1], "-l");
+    ck_assert_str_eq(argv.v[2], "-a");
+    ck_assert_str_eq(argv.v[3], "-bC");
+    ck_assert_ptr_eq(argv.v[4], NULL);
+    ck_assert_msg(make_redirects(&prog, cmd, redirects), "redirects are valid");
     ck_assert_str_eq(redirects[0].filename, "test.txt");
     ck_assert_int_eq(redirects[0].type, OUT | APPEND);
     ck_assert_str_eq(redirects[1].filename, "/dev/null");
@@ -31,62 +65,657 @@ START_TEST(test_parseline)
     ck_assert_int_eq(redirects[3].type, ERR | CLOSE);
     ck_assert_int_eq(redirects[4].type, NO);
 
-    copybuf(cmd, "cd ~ &\n", MAXLINE);
-    parseline(cmd, argv, redirects);
-    ck_assert_str_eq(argv[0], "cd");
-    ck_assert_str_eq(argv[1], "/home/qyl");
+    const char *heredoc = "cat <<EOF <<-'END'\n\"$doc\"\nEOF\n\t$doc\n\tEND\n";
+
+    ck_assert_int_eq(compile(&prog, heredoc, strlen(heredoc), &consumed), COMPILE_OK);
+    cmd = &prog.cmds[prog.code[0].a];
+    set_var("doc", 3, "body", false);
+    ck_assert_msg(make_redirects(&prog, cmd, redirects), "here-documents are valid");
+    ck_assert_int_eq(redirects[0].type, IN | HEREDOC);
+    ck_assert_int_eq(redirects[0].doc_len, 7);
+    ck_assert_msg(memcmp(redirects[0].doc, "\"body\"\n", 7) == 0, "quotes are kept in the body");
+    ck_assert_int_eq(redirects[1].doc_len, 5);
+    ck_assert_msg(memcmp(redirects[1].doc, "$doc\n", 5) == 0, "quoted delimiter keeps the body");
+    ck_assert_int_eq(compile(&prog, "cat <<EOF\n", 10, &consumed), COMPILE_INCOMPLETE);
+
+    ck_assert_int_eq(compile(&prog, "if true; then\n", 14, &consumed), COMPILE_INCOMPLETE);
+    ck_assert_int_eq(compile(&prog, "fi\n", 3, &consumed), COMPILE_ERROR);
+    prog_free(&prog);
+}
+END_TEST
+
+START_TEST(test_expand)
+{
+    char *params[] = {"qsh", "a b", "c", NULL};
+    strvec_t fields = {NULL, 0, 0};
+
+    set_var("x", 1, "main.c", false);
+    set_var("IFS", 3, " :", false);
+    set_params(3, params);
+    ck_assert_str_eq(expand_string("${x%.c}-$((1 + 2 * 3))", 22, 0), "main-7");
+    ck_assert_str_eq(expand_string("'$x'\"$x\"\\$x", 12, 0), "$xmain.c$x");
+    ck_assert_str_eq(expand_string("${#x}${y:-none}", 15, 0), "6none");
+
+    set_var("y", 1, " 1:2  3 ", false);
+    expand_word("$y", 2, &fields);
+    ck_assert_int_eq(fields.n, 3);
+    ck_assert_str_eq(fields.v[0], "1");
+    ck_assert_str_eq(fields.v[2], "3");
+
+    fields.n = 0;
+    expand_word("\"$@\"", 4, &fields);
+    ck_assert_int_eq(fields.n, 2);
+    ck_assert_str_eq(fields.v[0], "a b");
+    ck_assert_str_eq(fields.v[1], "c");
+    unset_var("IFS");
+}
+END_TEST
+
+START_TEST(test_arith)
+{
+    bool ok = false;
+    const char *script = "z=$((1/0))\n";
+
+    ck_assert_msg(arith_eval("(-9223372036854775807-1) / -1", &ok) == LONG_MIN && ok, "the quotient wraps");
+    ck_assert_msg(arith_eval("(-9223372036854775807-1) % -1", &ok) == 0 && ok, "the remainder is 0");
+    ck_assert_msg(arith_eval("1 << 63", &ok) == LONG_MIN && ok, "the sign bit can be set");
+    arith_eval("1 << 64", &ok);
+    ck_assert(!ok);
+    arith_eval("z /= 0", &ok);
+    ck_assert(!ok);
+    ck_assert_msg(arith_eval("0 && 1 / 0", &ok) == 0 && ok, "what isn't evaluated can't fail");
+    // a failed expansion fails the command, which assigns nothing
+    set_var("z", 1, "kept", false);
+    ck_assert_msg(run_source(script, strlen(script), true, NULL), "script is valid");
+    ck_assert_int_eq(last_status, 1);
+    ck_assert_str_eq(get_var("z", 1), "kept");
+    script = "z=$((1<<64)) true\n";
+    ck_assert_msg(run_source(script, strlen(script), true, NULL), "script is valid");
+    ck_assert_int_eq(last_status, 1);
+    ck_assert_str_eq(get_var("z", 1), "kept");
+}
+END_TEST
+
+START_TEST(test_glob)
+{
+    char dir[] = "/tmp/qsh_globXXXXXX";
+    const char *files[] = {"a.json", "b/c.json", "b/d/e.json", "b/d/f.txt", ".h/g.json", NULL};
+    char path[PATH_MAX];
+    char **paths = NULL;
+    strvec_t fields = {NULL, 0, 0};
+
+    ck_assert_ptr_ne(mkdtemp(dir), NULL);
+    for (const char **file = files; *file != NULL; ++file) {
+        snprintf(path, sizeof(path), "%s/%s", dir, *file);
+        for (char *slash = strchr(path + strlen(dir) + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+            *slash = '\0';
+            mkdir(path, 0755);
+            *slash = '/';
+        }
+        close(open(path, O_CREAT | O_WRONLY, 0644));
+    }
+    snprintf(path, sizeof(path), "%s/**/*.json", dir);
+    size_t n = glob_paths(path, &paths);
+
+    ck_assert_int_eq(n, 3);
+    ck_assert_str_eq(paths[0] + strlen(dir), "/a.json");
+    ck_assert_str_eq(paths[1] + strlen(dir), "/b/c.json");
+    ck_assert_str_eq(paths[2] + strlen(dir), "/b/d/e.json");
+    free_paths(paths, n);
+
+    ck_assert_int_eq(chdir(dir), 0);
+    expand_word("b/*/", 4, &fields);
+    expand_word("'*'.json", 8, &fields);
+    expand_word("b/\\*", 4, &fields);
+    expand_word("x*", 2, &fields);
+    ck_assert_int_eq(fields.n, 4);
+    ck_assert_str_eq(fields.v[0], "b/d/");
+    ck_assert_str_eq(fields.v[1], "*.json");
+    ck_assert_str_eq(fields.v[2], "b/*");
+    ck_assert_str_eq(fields.v[3], "x*");
+
+    // '[' is a pattern only if ']' closes it, so "[" never reads a directory
+    const char *words[] = {"[", "a[b", "[]", "'['x]", "[x/]", "[ab]", "[!]]"};
+    const bool globs[] = {false, false, false, false, false, true, true};
+
+    for (size_t i = 0; i < sizeof(words) / sizeof(*words); ++i) {
+        expand_t e;
 
-    copybuf(cmd, "ls 234 >a\n", MAXLINE);
-    parseline(cmd, argv, redirects);
-    fputs("\n", stdout);
-    fputs("Redirects begin:\n", stdout);
-    redirect(redirects);
-    fputs("Redirects end:\n\n", stdout);
-    ck_assert_str_eq(redirects[0].filename, "a");
-    ck_assert_int_eq(redirects[0].type, OUT);
+        exp_init(&e, &fields, EXP_SPLIT);
+        expand_text(&e, words[i], strlen(words[i]), false);
+        ck_assert_msg(field_glob(&e) == globs[i], "%s", words[i]);
+        end_field(&e, false);
+        exp_done(&e);
+    }
+    ck_assert_str_eq(fields.v[4], "[");
+    ck_assert_str_eq(fields.v[5], "a[b");
 }
 END_TEST
 
-START_TEST(test_split)
+START_TEST(test_run)
 {
-    char *cmdline = "ls -l  >>test.txt 2>/dev/null <test.txt 2>&- \"-a\" -bC |less <a.txt |sort -b\n";
+    const char *script = "s=; for i in 1 2 3; do s=$s$i; done\n"
+        "if [ $s = 123 ]; then r=yes; else r=no; fi\n"
+        "case $s in 1*3) c=match;; *) c=none;; esac\n"
+        "false || o=or; false && a=and\n";
+
+    ck_assert_msg(run_source(script, strlen(script), true, NULL), "script is valid");
+    ck_assert_str_eq(get_var("s", 1), "123");
+    ck_assert_str_eq(get_var("r", 1), "yes");
+    ck_assert_str_eq(get_var("c", 1), "match");
+    ck_assert_str_eq(get_var("o", 1), "or");
+    ck_assert_ptr_eq(get_var("a", 1), NULL);
+    ck_assert_int_eq(last_status, 1);
+}
+END_TEST
+
+START_TEST(test_trace)
+{
+    const char *path = "/tmp/qsh_test_trace.json";
+    mark_t mark = arena_mark();
+    char *text = NULL;
+
+    unlink(path);
+    ck_assert(trace_open(path, false));
+    trace_begin("parse", NULL);
+    trace_end("parse");
+    trace_child(123, "say \"hi\"");
+    trace_reaped(123, 2);
+    trace_flush();
+    int fd = open(path, O_RDONLY);
+
+    ck_assert_int_ge(fd, 0);
+    read_all(fd, &text);
+    close(fd);
+    ck_assert(strncmp(text, "[\n{\"name\":\"parse\",\"cat\":\"parse\",\"ph\":\"B\"", 39) == 0);
+    ck_assert_ptr_ne(strstr(text, "\"name\":\"say \\\"hi\\\"\",\"cat\":\"child\",\"ph\":\"B\""), NULL);
+    ck_assert_ptr_ne(strstr(text, "\"pid\":123,\"tid\":123,\"args\":{\"status\":2}},\n"), NULL);
+    // what's written out once isn't written again
+    trace_flush();
+    fd = open(path, O_RDONLY);
+    ck_assert_int_eq(strlen(text), lseek(fd, 0, SEEK_END));
+    close(fd);
+    arena_release(mark);
+}
+END_TEST
+
+START_TEST(test_coproc)
+{
+    const char *script = "coproc ECHO cat\n";
+    char buf[16];
+
+    ck_assert_msg(run_source(script, strlen(script), true, NULL), "script is valid");
+    int in = atoi(get_var("ECHO_IN", 7));
+    int out = atoi(get_var("ECHO_OUT", 8));
+
+    ck_assert(in >= FD_SHELL && fdtab_has(in) && out >= FD_SHELL && fdtab_has(out));
+    pid_t pid = atoi(get_var("ECHO_PID", 8));
+
+    ck_assert(pid > 0);
+    ck_assert_int_eq(write(in, "abc\n", 4), 4);
+    ck_assert_int_eq(read(out, buf, sizeof(buf)), 4);
+    ck_assert(memcmp(buf, "abc\n", 4) == 0);
+    // pipes of the last coprocess of the same name are closed
+    ck_assert_msg(run_source("coproc ECHO true\n", 17, true, NULL), "script is valid");
+    ck_assert_int_ne(atoi(get_var("ECHO_PID", 8)), pid);
+    ck_assert(fdtab_has(atoi(get_var("ECHO_IN", 7))) && fdtab_has(atoi(get_var("ECHO_OUT", 8))));
+    run_source("coproc 1ECHO cat\n", 17, true, NULL);
+    ck_assert_int_eq(last_status, 2);
+
+    // writing to a coprocess which has exited is an error, not SIGPIPE
+    ck_assert_msg(run_source("coproc GONE true\n", 17, true, NULL), "script is valid");
+    in = atoi(get_var("GONE_IN", 7));
+    pid = atoi(get_var("GONE_PID", 8));
+    int status = 0;
+    int saved = dup(STDOUT_FILENO);
+    redirect_t redirects[2] = {{.type = OUT | DUP, .fd = STDOUT_FILENO, .from = in}, {.type = NO}};
+    char *argv[] = {"echo", "hi", NULL};
+
+    ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+    fflush(stdout);
+    dup2(in, STDOUT_FILENO);
+    run_builtin(argv, redirects);
+    __fpurge(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    ck_assert_int_eq(last_status, 1);
+    // once it's reaped, its pipes are closed and its variables unset
+    child_reaped(pid, status);
+    run_source(":\n", 2, true, NULL);
+    ck_assert(!fdtab_has(in) && fcntl(in, F_GETFD) < 0);
+    ck_assert_ptr_eq(get_var("GONE_IN", 7), NULL);
+    ck_assert_ptr_eq(get_var("GONE_PID", 8), NULL);
+}
+END_TEST
+
+START_TEST(test_jobring)
+{
+    const char *script = "ring 8\n{ echo 0123456789abcdef; echo xy; } &\n";
+    char *data = NULL;
+    size_t len = 0;
+
+    ck_assert_msg(run_source(script, strlen(script), true, NULL), "script is valid");
+    ck_assert_int_eq(ring_size, 8);
+    // the ring is filled by another thread as the job writes
+    for (int i = 0; i < 200; ++i) {
+        ck_assert(jobring_copy(last_bg, &data, &len));
+        if (len == 8 && memcmp(data, "cdef\nxy\n", 8) == 0) {
+            break;
+        }
+        free(data);
+        data = NULL;
+        usleep(10000);
+    }
+    ck_assert_msg(data != NULL, "only the last bytes are kept");
+    free(data);
+    ck_assert(!jobring_copy(shell_pid, &data, &len));
+    run_source("ring 1K\n", 8, true, NULL);
+    ck_assert_int_eq(ring_size, 1024);
+    run_source("ring 1X\n", 8, true, NULL);
+    ck_assert_int_eq(last_status, 2);
+    run_source("ring off\n", 9, true, NULL);
+    ck_assert_int_eq(ring_size, 0);
+}
+END_TEST
+
+START_TEST(test_jobshm)
+{
+    job_t table[2];
+    jobshm_job_t copy[2];
+
+    memset(table, 0, sizeof(table));
+    setenv("XDG_RUNTIME_DIR", "/tmp", 1);
+    ck_assert(jobshm_open(table, 2));
+    unsetenv("XDG_RUNTIME_DIR");
+    int fd = open(jobshm_path(), O_RDONLY);
+
+    ck_assert(fd >= 0);
+    const jobshm_t *shm = mmap(NULL, sizeof(*shm) + 2 * sizeof(*copy), PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+    ck_assert(shm != MAP_FAILED);
+    ck_assert_str_eq(shm->magic, JOBSHM_MAGIC);
+    ck_assert_int_eq(shm->njobs, 2);
+    ck_assert_int_eq(shm->pid, getpid());
+    uint32_t seq = shm->seq;
+
+    table[1] = (job_t) {.name = "sleep 9 &\n", .pid = 42, .last = 43, .state = BG, .jid = 2, .num = 2, .start = 7};
+    jobshm_update(1);
+    // a change is seen at once, and moves the seqlock by 2
+    ck_assert_int_eq(shm->seq, seq + 2);
+    ck_assert(jobshm_read(shm, copy));
+    ck_assert_int_eq(copy[0].jid, 0);
+    ck_assert_int_eq(copy[1].jid, 2);
+    ck_assert_int_eq(copy[1].pgid, 42);
+    ck_assert_int_eq(copy[1].last, 43);
+    ck_assert_int_eq(copy[1].state, BG);
+    ck_assert_int_eq(copy[1].procs, 2);
+    ck_assert(copy[1].start == 7);
+    ck_assert_str_eq(copy[1].name, "sleep 9 &");
+    char *path = strdup(jobshm_path());
 
-    copybuf(cmd, cmdline, MAXLINE);
-    char *argv[MAXARGS] = {NULL};
+    jobshm_close();
+    ck_assert(access(path, F_OK) < 0);
+    ck_assert(jobshm_path() == NULL);
+    munmap((void *) shm, sizeof(*shm) + 2 * sizeof(*copy));
+    free(path);
+}
+END_TEST
+
+START_TEST(test_tail)
+{
+    // whether the last simple command of each line is in tail position
+    const char *lines[] = {"a; b\n", "a && b\n", "if a; then b; else c; fi\n",
+        "for i in 1; do a; done\n", "{ a; } >f\n", "a &\n"};
+    const bool tails[] = {true, true, true, false, false, false};
 
-    split(cmd, '|', argv);
-    ck_assert_str_eq(argv[0], "ls -l  >>test.txt 2>/dev/null <test.txt 2>&- \"-a\" -bC ");
-    ck_assert_str_eq(argv[1], "less <a.txt ");
-    ck_assert_str_eq(argv[2], "sort -b\n");
-    ck_assert_ptr_eq(argv[3], NULL);
+    for (size_t i = 0; i < sizeof(lines) / sizeof(*lines); ++i) {
+        prog_t prog;
+        size_t consumed = 0;
+        bool tail = false;
 
-    copybuf(cmd, "cat", MAXLINE);
-    split(cmd, ';', argv);
-    ck_assert_str_eq(argv[0], "cat");
-    ck_assert_ptr_eq(argv[1], NULL);
+        memset(&prog, 0, sizeof(prog));
+        ck_assert_int_eq(compile(&prog, lines[i], strlen(lines[i]), &consumed), COMPILE_OK);
+        for (uint32_t pc = 0; pc < prog.ncode; ++pc) {
+            if (prog.code[pc].op == OP_PIPE) {
+                tail = !(prog.code[pc].flags & PIPE_BG) && tail_position(&prog, pc + 1);
+            }
+        }
+        ck_assert_msg(tail == tails[i], "%s", lines[i]);
+        prog_free(&prog);
+    }
+    ck_assert(blank(" \n\t", 3) && !blank(" x", 2));
 }
 END_TEST
 
 START_TEST(test_builtin_cmd)
 {
-    char *argv1[] = {"ls"};
-    char *argv3[] = {"exit"};
+    char *argv1[] = {"ls", NULL};
+    char *argv2[] = {"true", NULL};
+    char *argv3[] = {"exit", NULL};
 
     ck_assert_msg(!builtin_cmd(argv1), "ls is not built-in command");
+    ck_assert_msg(builtin_cmd(argv2), "true is built-in command");
+    ck_assert_int_eq(last_status, 0);
     ck_assert_msg(builtin_cmd(argv3), "exit is built-in command");
 }
 END_TEST
 
-START_TEST(test_preprocess)
+START_TEST(test_test)
+{
+    char *argv1[] = {"test", "-d", "/", "-a", "!", "-f", "/", NULL};
+    char *argv2[] = {"[", "3", "-lt", "12", "]", NULL};
+    char *argv3[] = {"[", "abc", "\\<", "abd", NULL};
+    char *argv4[] = {"test", "(", "a", "=", "b", ")", "-o", "-n", "", NULL};
+    char *argv5[] = {"test", "-n", NULL};
+    char *argv6[] = {"test", "x", "-eq", "1", NULL};
+
+    ck_assert_int_eq(do_test(argv1), 0);
+    ck_assert_int_eq(do_bracket(argv2), 0);
+    ck_assert_int_eq(do_bracket(argv3), 2);
+    ck_assert_int_eq(do_test(argv4), 1);
+    ck_assert_int_eq(do_test(argv5), 0);
+    ck_assert_int_eq(do_test(argv6), 2);
+}
+END_TEST
+
+START_TEST(test_timeout)
+{
+    char *argv1[] = {"timeout", "-s", "INT", "-k", "1m", "1.5", "sleep", "9", NULL};
+    char *argv2[] = {"timeout", "1x", "sleep", "9", NULL};
+    const char *script = "timeout 0.05 sleep 5; s=$?; timeout 5 true; t=$?\n";
+    limit_t limit;
+    long long ms = 0;
+
+    ck_assert_msg(parse_duration("2h", &ms) && ms == 7200000, "hours are parsed");
+    ck_assert_msg(!parse_duration("-1", &ms), "durations aren't negative");
+    ck_assert_ptr_eq(timeout_command(argv1, &limit), argv1 + 6);
+    ck_assert_int_eq(limit.ms, 1500);
+    ck_assert_int_eq(limit.grace, 60000);
+    ck_assert_int_eq(limit.sig, SIGINT);
+    ck_assert_ptr_eq(timeout_command(argv2, &limit), NULL);
+
+    ck_assert_msg(run_source(script, strlen(script), true, NULL), "script is valid");
+    ck_assert_str_eq(get_var("s", 1), "124");
+    ck_assert_str_eq(get_var("t", 1), "0");
+    ck_assert_msg(!wheel_active(), "deadlines are cancelled");
+}
+END_TEST
+
+START_TEST(test_admit)
 {
-    char s[256] = "ls |cat &";
+    const char *script = "admit -j 1 -l 8; sleep 0.1 & sleep 0.1 &\n";
+    char *argv[] = {"admit", "-p", NULL};
+    long long start = monotonic_ms();
+
+    ck_assert_msg(run_source(script, strlen(script), true, NULL), "script is valid");
+    // the second job starts after the first one
+    ck_assert_int_ge(monotonic_ms() - start, 100);
+    ck_assert_int_eq(running_jobs(), 1);
+    ck_assert_int_eq(admit_jobs, 1);
+    ck_assert_int_eq(do_admit(argv), 2);
+    ck_assert_msg(run_source("admit off\n", 10, true, NULL), "script is valid");
+    ck_assert_int_eq(admit_load, 0);
+}
+END_TEST
+
+START_TEST(test_gate)
+{
+    const char *path = "/tmp/qsh_test_gate";
+    int gate[2];
+    int status = 0;
+
+    unlink(path);
+    hold_gate(gate);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        pass_gate(gate);
+        _exit(creat(path, 0644) < 0);
+    }
+    close(gate[0]);
+    usleep(100000);
+    // a queued job does nothing until it's admitted
+    ck_assert_int_eq(access(path, F_OK), -1);
+    close(gate[1]);
+    ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+    ck_assert_int_eq(status, 0);
+    ck_assert_int_eq(access(path, F_OK), 0);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_batch)
+{
+    char *argv1[] = {"chmod", "-R", "--", "644", "a", "bb", "ccc", NULL};
+    char *argv2[] = {"rm", "-f", NULL};
+    char *argv3[] = {"batch", "-P", "4", "-k", "1", "chmod", "644", NULL};
+    unsigned jobs = 1;
+    int fixed = -1;
+
+    ck_assert_int_eq(batch_fixed(argv1, 7, 1), 4);
+    ck_assert_int_eq(batch_fixed(argv2, 2, 0), 2);
+    ck_assert_int_eq(arg_space(argv1 + 4, 2), 5 + 2 * sizeof(char *));
+    // "a" and "bb" fit, and a word too long goes to a chunk alone
+    ck_assert_int_eq(chunk_end(argv1, 4, 7, 5 + 2 * sizeof(char *)), 6);
+    ck_assert_int_eq(chunk_end(argv1, 6, 7, 1), 7);
+    ck_assert_ptr_eq(batch_command(argv3, &jobs, &fixed), argv3 + 5);
+    ck_assert_int_eq(jobs, 4);
+    ck_assert_int_eq(fixed, 1);
+    ck_assert_msg(arg_max() > 4096, "exec takes some arguments");
+    // fixed words leaving no word, or no room, run nothing
+    ck_assert_int_eq(run_batches(argv1, 7, 1), 126);
+    size_t max = arg_max();
+    char *word = malloc(max + 1);
+
+    memset(word, 'x', max);
+    word[max] = '\0';
+    char *argv4[] = {"echo", word, "a", NULL};
+
+    ck_assert_int_eq(run_batches(argv4, 2, 1), 126);
+    free(word);
+}
+END_TEST
+
+START_TEST(test_memo)
+{
+    memo_key_t a = MEMO_SEED;
+    memo_key_t b = MEMO_SEED;
+    int out[2];
+    int err[2];
+    int status = 0;
+
+    memo_hash(&a, "ab", 2);
+    memo_hash(&a, "c", 1);
+    memo_hash(&b, "a", 1);
+    memo_hash(&b, "bc", 2);
+    ck_assert_msg(a != b, "words are hashed apart");
+    setenv("XDG_CACHE_HOME", "/tmp/qsh_test_cache", 1);
+    memo_trim(0);
+    ck_assert(!memo_replay(a, &status));
+    ck_assert(pipe(out) == 0 && pipe(err) == 0);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        _exit(7);
+    }
+    close(out[1]);
+    close(err[1]);
+    ck_assert_int_eq(memo_record(a, pid, out[0], err[0], 1 << 20), 7);
+    ck_assert(memo_replay(a, &status));
+    ck_assert_int_eq(status, 7);
+    memo_trim(0);
+    ck_assert(!memo_replay(a, &status));
+}
+END_TEST
+
+START_TEST(test_snapshot)
+{
+    snap_t snap = {NULL, 0, 0, NULL, 0};
+    snap_rec_t rec;
+    size_t pos = 0;
+    const char *rc = "/tmp/qsh_test_rc";
+    FILE *fp = fopen(rc, "w");
+
+    ck_assert_ptr_ne(fp, NULL);
+    fputs("X=1\n", fp);
+    fclose(fp);
+    setenv("XDG_CACHE_HOME", "/tmp/qsh_test_cache", 1);
+    snap_add(&snap, SNAP_READ, false, "HOME", 4, NULL, 0);
+    snap_add(&snap, SNAP_SET, true, "X", 1, "1", 1);
+    snap_add(&snap, SNAP_RUN, false, "pin\0off", 8, NULL, 0);
+    ck_assert(snap_save(&snap, rc));
+    snap_free(&snap);
+    ck_assert(snap_load(&snap, rc));
+    ck_assert(snap_next(&snap, &pos, &rec));
+    ck_assert_int_eq(rec.kind, SNAP_READ);
+    ck_assert_ptr_eq(rec.value, NULL);
+    ck_assert(snap_next(&snap, &pos, &rec));
+    ck_assert_int_eq(rec.kind, SNAP_SET);
+    ck_assert(rec.exported);
+    ck_assert_int_eq(rec.value_len, 1);
+    ck_assert_int_eq(rec.value[0], '1');
+    ck_assert(snap_next(&snap, &pos, &rec));
+    ck_assert_int_eq(rec.kind, SNAP_RUN);
+    ck_assert_int_eq(memcmp(rec.name, "pin\0off", 8), 0);
+    ck_assert(!snap_next(&snap, &pos, &rec));
+    snap_free(&snap);
+    // a changed rc file makes it out of date
+    fp = fopen(rc, "a");
+    fputs("Y=2\n", fp);
+    fclose(fp);
+    ck_assert(!snap_load(&snap, rc));
+    unlink(rc);
+    // only what depends on the rc file alone is snapshotted
+    const char *scripts[] = {"X=$(echo a)\n", "X=$(cat /dev/null)\n", "[ -f /x ]\n", "X=$(pwd)\n",
+        "for f in '/tmp/*' [; do :; done\n", "for f in /tmp/*; do :; done\n", ": ~root\n"};
+    const bool pures[] = {true, false, false, false, true, false, false};
+
+    rc_running = true;
+    for (size_t i = 0; i < sizeof(scripts) / sizeof(*scripts); ++i) {
+        rc_pure = true;
+        run_source(scripts[i], strlen(scripts[i]), true, NULL);
+        ck_assert_msg(rc_pure == pures[i], "%s", scripts[i]);
+    }
+    rc_running = false;
+    snap_free(&rc_snap);
+}
+END_TEST
+
+START_TEST(test_jobstat)
+{
+    int status = 0;
+
+    // forget jobs started by earlier tests
+    jobstat_clear();
+    ck_assert_int_eq(jobstat_next(&status), -1);
+    ck_assert_int_eq(jobstat_add(100), 1);
+    ck_assert_int_eq(jobstat_add(200), 2);
+    ck_assert_int_eq(jobstat_add(300), 3);
+    ck_assert_int_eq(jobstat_find(2), 200);
+    ck_assert_int_eq(jobstat_next(&status), 0);
+    ck_assert(jobstat_done(300, 7));
+    ck_assert(jobstat_done(100, 1));
+    ck_assert(!jobstat_done(400, 0));
+    ck_assert_int_eq(jobstat_get(200), JOBSTAT_RUNNING);
+    ck_assert_int_eq(jobstat_get(100), 1);
+    ck_assert_int_eq(jobstat_get(100), JOBSTAT_UNKNOWN);
+    // the first to finish comes first, skipping those waited for
+    ck_assert_int_eq(jobstat_next(&status), 300);
+    ck_assert_int_eq(status, 7);
+    ck_assert_int_eq(jobstat_next(&status), 0);
+    jobstat_forget(200);
+    ck_assert_int_eq(jobstat_next(&status), -1);
+    for (pid_t pid = 1; pid <= 10000; ++pid) {
+        jobstat_add(pid);
+        jobstat_done(pid, pid % 256);
+    }
+    for (pid_t pid = 1; pid <= 10000; ++pid) {
+        ck_assert_int_eq(jobstat_next(&status), pid);
+        ck_assert_int_eq(status, pid % 256);
+    }
+    jobstat_clear();
+}
+END_TEST
+
+START_TEST(test_rotate)
+{
+    const char *log = "/tmp/qsh_test_rotate.log";
+    char path[64];
+    char line[100];
+    struct stat st;
+
+    memset(line, 'x', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\n';
+    for (int i = 0; i <= 3; ++i) {
+        snprintf(path, sizeof(path), i == 0 ? "%s" : "%s.%d", log, i);
+        unlink(path);
+    }
+    ck_assert_int_eq(rotate_open("/tmp/qsh_test_rotate.log:1X:2"), -1);
+    int fd = rotate_open("/tmp/qsh_test_rotate.log:1K:2");
+
+    ck_assert_int_ge(fd, 0);
+    for (int i = 0; i < 40; ++i) {
+        ck_assert_int_eq(write(fd, line, sizeof(line)), sizeof(line));
+        // the line is in the log once the pump has gone through the pipe
+        rotate_sync(0);
+    }
+    close(fd);
+    rotate_sync(0);
+    // a log is rotated once it has 11 lines, and two old logs are kept
+    for (int i = 0; i <= 3; ++i) {
+        snprintf(path, sizeof(path), i == 0 ? "%s" : "%s.%d", log, i);
+        if (i == 3) {
+            ck_assert_int_ne(stat(path, &st), 0);
+        } else {
+            ck_assert_int_eq(stat(path, &st), 0);
+            ck_assert_int_eq(st.st_size, i == 0 ? 700 : 1100);
+        }
+    }
+}
+END_TEST
+
+START_TEST(test_fdtab)
+{
+    const char *cmdline = "cmd 3>>log 4<&- >&3 2>&1 5<in <&5\n";
+    prog_t prog;
+    size_t consumed = 0;
+    redirect_t redirects[MAXARGS];
+
+    fdtab_add(7);
+    fdtab_add(4);
+    fdtab_add(7);
+    ck_assert(fdtab_has(4) && fdtab_has(7) && !fdtab_has(5));
+    ck_assert_int_eq(fdtab_next(3), 4);
+    ck_assert_int_eq(fdtab_next(5), 7);
+    fdtab_del(4);
+    fdtab_del(7);
+    ck_assert_int_eq(fdtab_next(0), -1);
+    int fd = fd_shell(dup(STDIN_FILENO));
+
+    ck_assert_int_ge(fd, FD_SHELL);
+    ck_assert(fcntl(fd, F_GETFD) & FD_CLOEXEC);
+    close(fd);
 
-    ck_assert_msg(preprocess(s), "s is on background");
-    ck_assert_str_eq(s, "ls |cat  ");
-    char b[32] = "cat lse";
+    memset(&prog, 0, sizeof(prog));
+    ck_assert_int_eq(compile(&prog, cmdline, strlen(cmdline), &consumed), COMPILE_OK);
+    const cmd_t *cmd = &prog.cmds[prog.code[0].a];
 
-    ck_assert_msg(!preprocess(b), "s is on foreground");
-    ck_assert_str_eq(b, "cat lse");
+    ck_assert_msg(make_redirects(&prog, cmd, redirects), "redirects are valid");
+    ck_assert_int_eq(redirects[0].type, FD | APPEND);
+    ck_assert_int_eq(redirects[0].fd, 3);
+    ck_assert_str_eq(redirects[0].filename, "log");
+    ck_assert_int_eq(redirects[1].type, IN | FD | CLOSE);
+    ck_assert_int_eq(redirects[1].fd, 4);
+    ck_assert_int_eq(redirects[2].type, OUT | DUP);
+    ck_assert_int_eq(redirects[2].from, 3);
+    ck_assert_int_eq(redirects[3].type, ERR | DUP);
+    ck_assert_int_eq(redirects[3].from, 1);
+    ck_assert_int_eq(redirects[4].type, IN | FD);
+    ck_assert_int_eq(redirects[4].fd, 5);
+    ck_assert_int_eq(redirects[5].type, IN | DUP);
+    ck_assert_int_eq(redirects[5].from, 5);
+    ck_assert_int_eq(redirects[6].type, NO);
 }
 END_TEST
 
@@ -96,10 +725,28 @@ Suite *main_suite(void)
     /* Core test case */
     TCase *tc_core = tcase_create("Core");
 
-    tcase_add_test(tc_core, test_split);
-    tcase_add_test(tc_core, test_parseline);
+    tcase_add_test(tc_core, test_lexer);
+    tcase_add_test(tc_core, test_compile);
+    tcase_add_test(tc_core, test_expand);
+    tcase_add_test(tc_core, test_arith);
+    tcase_add_test(tc_core, test_glob);
+    tcase_add_test(tc_core, test_run);
+    tcase_add_test(tc_core, test_test);
+    tcase_add_test(tc_core, test_timeout);
+    tcase_add_test(tc_core, test_admit);
+    tcase_add_test(tc_core, test_gate);
+    tcase_add_test(tc_core, test_batch);
+    tcase_add_test(tc_core, test_memo);
+    tcase_add_test(tc_core, test_snapshot);
+    tcase_add_test(tc_core, test_jobstat);
+    tcase_add_test(tc_core, test_rotate);
+    tcase_add_test(tc_core, test_fdtab);
+    tcase_add_test(tc_core, test_trace);
+    tcase_add_test(tc_core, test_coproc);
+    tcase_add_test(tc_core, test_jobring);
+    tcase_add_test(tc_core, test_jobshm);
+    tcase_add_test(tc_core, test_tail);
     tcase_add_test(tc_core, test_builtin_cmd);
-    tcase_add_test(tc_core, test_preprocess);
     suite_add_tcase(s, tc_core);
     return s;
 }